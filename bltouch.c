@@ -18,6 +18,7 @@
 #if BLTOUCH_ENABLE == 1
 
 #include <math.h>
+#include <stdlib.h>
 #include <string.h>
 #include <stdio.h>
 
@@ -25,6 +26,10 @@
 #include "grbl/nuts_bolts.h"
 #include "grbl/protocol.h"
 
+#include "plugin_prof.h"
+#include "flightrec.h"
+#include "bltouch_mesh.h"
+
 #define STOW_ALARM true
 
 // Safety: The probe needs time to recognize the command.
@@ -69,6 +74,18 @@
 #define BLTOUCH_SELFTEST_TIME     12000
 #endif
 
+// Two-stage probing defaults, $BLTPROBE
+
+#ifndef BLTOUCH_PROBE_FAST_FEED
+#define BLTOUCH_PROBE_FAST_FEED     300.0f  // mm/min
+#endif
+#ifndef BLTOUCH_PROBE_SLOW_FEED
+#define BLTOUCH_PROBE_SLOW_FEED      25.0f  // mm/min
+#endif
+#ifndef BLTOUCH_PROBE_BACKOFF
+#define BLTOUCH_PROBE_BACKOFF         2.0f  // mm
+#endif
+
 typedef enum {
     BLTouch_Deploy    = 10,
     BLTouch_Stow      = 90,
@@ -80,13 +97,20 @@ typedef enum {
     BLTouch_Reset     = 160
 } BLTCommand_t;
 
-static xbar_t servo = {0};
 static uint8_t servo_port = 0xFF;
 static on_probe_start_ptr on_probe_start;
 static on_probe_completed_ptr on_probe_completed;
 static on_report_options_ptr on_report_options;
 static user_mcode_ptrs_t user_mcode;
-static bool high_speed = false, selftest = false;
+static bool high_speed = false, selftest = false, session = false, session_high_speed;
+
+static struct {
+    bool active;
+    uint8_t step;
+    uint8_t touches;
+    float z[2];
+    char line[4][40];   // probing moves followed by restore of units, distance and motion mode and feed rate
+} probe = {0};
 
 static bool bltouch_cmd (BLTCommand_t cmd, uint16_t ms);
 
@@ -95,6 +119,18 @@ static void selftest_done (void *data)
     bltouch_cmd(BLTouch_Stow, BLTOUCH_STOW_DELAY);
 }
 
+// Read back the current angle from the driver if supported, the pin info
+// is fetched on demand rather than keeping a copy of the xbar_t struct around.
+static float servo_get_angle (float current_angle)
+{
+    xbar_t *pwm_pin;
+
+    if(hal.port.get_pin_info && (pwm_pin = hal.port.get_pin_info(Port_Analog, Port_Output, servo_port)) && pwm_pin->get_value)
+        current_angle = pwm_pin->get_value(pwm_pin);
+
+    return current_angle;
+}
+
 static bool bltouch_cmd (BLTCommand_t cmd, uint16_t ms)
 {
     static float current_angle = -1.0f;
@@ -111,11 +147,14 @@ static bool bltouch_cmd (BLTCommand_t cmd, uint16_t ms)
 
     selftest = cmd == BLTouch_Selftest;
 
-    if((float)cmd != (servo.get_value ? servo.get_value(&servo) : current_angle)) {
+    if((float)cmd != servo_get_angle(current_angle)) {
 
         hal.port.analog_out(servo_port, current_angle = (float)cmd);
-        if(ms)
+        FLIGHTREC(FlightRec_BLTouch, cmd, 0);
+        if(ms) {
             delay_sec(max((float)ms / 1e3f, (float)BLTOUCH_MIN_DELAY / 1e3f), DelayMode_SysSuspend);
+            PLUGIN_STALL_DELAY(PluginStall_BLTouch, max(ms, BLTOUCH_MIN_DELAY));
+        }
     }
 
     return true;
@@ -138,6 +177,8 @@ static user_mcode_type_t mcode_check (user_mcode_t mcode)
 
 static status_code_t mcode_validate (parser_block_t *gc_block)
 {
+    PLUGIN_PROF_BEGIN(PluginProf_M401_Validate);
+
     status_code_t state = Status_OK;
 
     switch(gc_block->user_mcode) {
@@ -173,16 +214,25 @@ static status_code_t mcode_validate (parser_block_t *gc_block)
             break;
     }
 
+    PLUGIN_PROF_END(PluginProf_M401_Validate);
+
+    if(state == Status_OK)
+        PLUGIN_STALL_SYNC_BEGIN(PluginStall_BLTouch);
+
     return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
 }
 
 static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
 {
+    PLUGIN_STALL_SYNC_END(PluginStall_BLTouch);
+    PLUGIN_PROF_BEGIN(PluginProf_M401_Execute);
+
     bool handled = true;
 
     switch(gc_block->user_mcode) {
 
          case Probe_Deploy:
+             FLIGHTREC(FlightRec_MCode, 0, Probe_Deploy);
              if(gc_block->words.s)
                  high_speed = gc_block->values.s != 0.0f;
              if(gc_block->words.h) {
@@ -195,6 +245,7 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
              break;
 
          case Probe_Stow:
+             FLIGHTREC(FlightRec_MCode, 0, Probe_Stow);
              bltouch_cmd(BLTouch_Stow, BLTOUCH_STOW_DELAY);
              break;
 
@@ -203,6 +254,8 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
             break;
     }
 
+    PLUGIN_PROF_END(PluginProf_M401_Execute);
+
     if(!handled && user_mcode.execute)
         user_mcode.execute(state, gc_block);
 }
@@ -211,23 +264,189 @@ static bool onProbeStart (axes_signals_t axes, float *target, plan_line_data_t *
 {
     bool ok = on_probe_start == NULL || on_probe_start(axes, target, pl_data);
 
+    PLUGIN_PROF_BEGIN(PluginProf_ProbeStart);
+
     if(!high_speed && ok)
         bltouch_cmd(BLTouch_Deploy, BLTOUCH_DEPLOY_DELAY);
 
+    PLUGIN_PROF_END(PluginProf_ProbeStart);
+
     return ok;
 }
 
 static void onProbeCompleted (void)
 {
+    PLUGIN_PROF_BEGIN(PluginProf_ProbeCompleted);
+
     if(!high_speed)
         bltouch_cmd(BLTouch_Stow, BLTOUCH_STOW_DELAY);
 
+    PLUGIN_PROF_END(PluginProf_ProbeCompleted);
+
+    if(probe.active && sys.flags.probe_succeeded && probe.touches < 2) {
+        float position[N_AXIS];
+        system_convert_array_steps_to_mpos(position, sys.probe_position);
+        probe.z[probe.touches++] = position[Z_AXIS];
+    }
+
+#if BLTOUCH_MESH_ENABLE
+    bltouch_mesh_probe_completed();
+#endif
+
     if(on_probe_completed)
         on_probe_completed();
 }
 
+// Deploys the probe and keeps it deployed for a sequence of probing moves.
+void bltouch_session (bool on)
+{
+    if(on == session)
+        return;
+
+    if((session = on)) {
+        session_high_speed = high_speed;
+        high_speed = true;
+        bltouch_cmd(BLTouch_Deploy, BLTOUCH_DEPLOY_DELAY);
+    } else {
+        high_speed = session_high_speed;
+        bltouch_cmd(BLTouch_Stow, BLTOUCH_STOW_DELAY);
+    }
+}
+
+// Writes a block restoring the units, distance mode, motion mode and feed rate of the parser state to line.
+// Motion modes that cannot be programmed without axis words are cancelled with G80 so that following
+// blocks do not continue probing.
+void bltouch_modal_restore (char *line)
+{
+    strcpy(line, gc_state.modal.units_imperial ? "G20" : "G21");
+    strcat(line, gc_state.modal.distance_incremental ? "G91" : "G90");
+
+    switch(gc_state.modal.motion) {
+
+        case MotionMode_Seek:
+            strcat(line, "G0");
+            break;
+
+        case MotionMode_Linear:
+            strcat(line, "G1");
+            break;
+
+        default:
+            strcat(line, "G80");
+            break;
+    }
+
+    if(gc_state.feed_rate > 0.0f) {
+        strcat(line, "F");
+        strcat(line, ftoa(gc_state.modal.units_imperial ? gc_state.feed_rate / MM_PER_INCH : gc_state.feed_rate, N_DECIMAL_COORDVALUE_MM));
+    }
+}
+
+// Two-stage probing: fast approach, back-off and slow touch with the probe deployed once.
+
+static void probe_sequence (void *data)
+{
+    sys_state_t state = state_get();
+
+    if(!probe.active)
+        return;
+
+    if(state & (STATE_ALARM|STATE_ESTOP)) {
+        probe.active = false;
+        bltouch_session(false);
+        return;
+    }
+
+    if(probe.step < 4) {
+        if(protocol_enqueue_gcode(probe.line[probe.step]))
+            probe.step++;
+    } else if(state == STATE_IDLE) {
+
+        probe.active = false;
+        bltouch_session(false);
+
+        if(probe.touches == 2) {
+            hal.stream.write("[BLTPROBE:");
+            hal.stream.write(ftoa(probe.z[1], N_DECIMAL_COORDVALUE_MM));
+            hal.stream.write("|FAST:");
+            hal.stream.write(ftoa(probe.z[0], N_DECIMAL_COORDVALUE_MM));
+            hal.stream.write("]" ASCII_EOL);
+        }
+
+        return;
+    }
+
+    task_add_delayed(probe_sequence, NULL, 10);
+}
+
+// $BLTPROBE=<distance>[,<fast feed>[,<slow feed>[,<back-off>]]]
+static status_code_t bltouch_probe (sys_state_t state, char *args)
+{
+    char *end;
+    uint_fast8_t idx = 0;
+    float value[4] = { 0.0f, BLTOUCH_PROBE_FAST_FEED, BLTOUCH_PROBE_SLOW_FEED, BLTOUCH_PROBE_BACKOFF };
+
+    if(args == NULL)
+        return Status_InvalidStatement;
+
+    if(state != STATE_IDLE || probe.active)
+        return Status_IdleError;
+
+#if BLTOUCH_MESH_ENABLE
+    if(bltouch_mesh_active())
+        return Status_IdleError;
+#endif
+
+    do {
+        value[idx] = strtof(args, &end);
+        if(end == args || !(*end == ',' || *end == '\0'))
+            return Status_BadNumberFormat;
+        args = end + 1;
+    } while(*end && ++idx < 4);
+
+    if(*end)
+        return Status_InvalidStatement;
+
+    if(value[0] <= 0.0f || value[1] <= 0.0f || value[2] <= 0.0f || value[3] <= 0.0f)
+        return Status_GcodeValueOutOfRange;
+
+    strcpy(probe.line[0], "G21G91G38.2Z-");
+    strcat(probe.line[0], ftoa(value[0], 3));
+    strcat(probe.line[0], "F");
+    strcat(probe.line[0], ftoa(value[1], 0));
+
+    strcpy(probe.line[1], "G21G91G0Z");
+    strcat(probe.line[1], ftoa(value[3], 3));
+
+    strcpy(probe.line[2], "G21G91G38.2Z-");
+    strcat(probe.line[2], ftoa(value[3] * 2.0f, 3));
+    strcat(probe.line[2], "F");
+    strcat(probe.line[2], ftoa(value[2], 0));
+
+    bltouch_modal_restore(probe.line[3]);
+
+    probe.step = probe.touches = 0;
+    probe.active = true;
+
+    bltouch_session(true);
+
+    if(!task_add_immediate(probe_sequence, NULL)) {
+        probe.active = false;
+        bltouch_session(false);
+        return Status_Unhandled;
+    }
+
+    return Status_OK;
+}
+
+bool bltouch_probe_active (void)
+{
+    return probe.active;
+}
+
 const sys_command_t bltouch_command_list[] = {
     {"BLTEST", bltouch_selftest, {}, { .str = "perform BLTouch probe self-test" } },
+    {"BLTPROBE", bltouch_probe, {}, { .str = "two-stage probe, $BLTPROBE=<distance>[,<fast feed>[,<slow feed>[,<back-off>]]]" } },
 };
 
 static sys_commands_t bltouch_commands = {
@@ -240,32 +459,33 @@ static void onReportOptions (bool newopt)
     on_report_options(newopt);
 
     if(!newopt)
-        report_plugin(servo_port == 0xFF ? "BLTouch (N/A)" : "BLTouch", "0.04");
+        report_plugin(servo_port == 0xFF ? "BLTouch (N/A)" : "BLTouch", "0.06");
 }
 
 static bool claim_servo (xbar_t *servo_pwm, uint8_t port, void *data)
 {
     servo_port = port;
 
-    if(ioport_claim(Port_Analog, Port_Output, &servo_port, "BLTouch probe")) {
-
-        if(servo_pwm->get_value)
-            memcpy(&servo, servo_pwm, sizeof(xbar_t));
-
-        return true;
-    } else
+    if(!ioport_claim(Port_Analog, Port_Output, &servo_port, "BLTouch probe"))
         servo_port = 0xFF;
 
-    return false;
+    return servo_port != 0xFF;
 }
 
 static void bltouch_stow (void *data)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_BLTouchStow);
+
     bltouch_cmd(BLTouch_Stow, BLTOUCH_STOW_DELAY);
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_BLTouchStow);
 }
 
 void bltouch_init (void)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_BLTouchInit);
+    PLUGIN_PROF_INIT();
+
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
 
@@ -284,9 +504,14 @@ void bltouch_init (void)
         grbl.on_probe_completed = onProbeCompleted;
 
         system_register_commands(&bltouch_commands);
-        protocol_enqueue_foreground_task(bltouch_stow, NULL);
+        plugin_defer(bltouch_stow, NULL); // not critical, stowing delays startup by BLTOUCH_STOW_DELAY ms
+#if BLTOUCH_MESH_ENABLE
+        bltouch_mesh_init();
+#endif
     } else
         protocol_enqueue_foreground_task(report_warning, "No servo PWM output available for BLTouch!");
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_BLTouchInit);
 }
 
 #endif // BLTOUCH_ENABLE
@@ -0,0 +1,509 @@
+/*
+
+  bltouch_mesh.c - BLTouch probed height map Z compensation
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Probes a grid of points with the probe kept deployed for the whole sequence, the height map is
+  stored in NVS and applied as bilinear Z compensation to motion. Lines are split where they cross
+  grid lines, per cell coefficients are precomputed so the offset for a segment end point costs
+  a few multiply-adds.
+
+  $BLTMESH=<x0>,<y0>,<x1>,<y1>,<nx>,<ny> - probe grid, corners in machine coordinates.
+      Start with the probe positioned above the work at a safe height, this height is used for
+      moves between points. The first point is used as the reference height.
+  $BLTMESH   - report height map.
+  $BLTMESH=0 - disable compensation.
+  $BLTMESH=1 - enable compensation.
+
+  Dependencies:
+
+  A kinematics enabled build (KINEMATICS_API), compensation is applied via the kinematics segment_line()
+  and transform_steps_to_cartesian() functions. Not for kinematics that segments motion, e.g. delta.
+
+*/
+
+#include "driver.h"
+
+#if BLTOUCH_ENABLE == 1
+
+#include "bltouch_mesh.h"
+
+#if BLTOUCH_MESH_ENABLE
+
+#ifndef KINEMATICS_API
+#error "BLTouch mesh compensation requires a kinematics enabled build!"
+#endif
+
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/task.h"
+#include "grbl/protocol.h"
+#include "grbl/kinematics.h"
+#include "grbl/nvs_buffer.h"
+#include "grbl/state_machine.h"
+
+#include "plugin_nvs.h"
+#include "plugin_prof.h"
+
+#ifndef BLTOUCH_MESH_MAX_POINTS
+#define BLTOUCH_MESH_MAX_POINTS 7 // per axis
+#endif
+
+#ifndef BLTOUCH_MESH_PROBE_DEPTH
+#define BLTOUCH_MESH_PROBE_DEPTH 10.0f // mm, max probing distance below safe height
+#endif
+
+#ifndef BLTOUCH_MESH_PROBE_FEED
+#define BLTOUCH_MESH_PROBE_FEED 100.0f // mm/min
+#endif
+
+typedef struct {
+    uint8_t nx;
+    uint8_t ny;
+    bool enabled;
+    float x0;
+    float y0;
+    float dx;
+    float dy;
+    float z[BLTOUCH_MESH_MAX_POINTS * BLTOUCH_MESH_MAX_POINTS]; // offset from first point, row major
+} bltouch_mesh_t;
+
+// z = a + b * u + c * v + d * u * v, u and v is the distance from the cell origin
+typedef struct {
+    float a;
+    float b;
+    float c;
+    float d;
+} mesh_cell_t;
+
+typedef struct {
+    bool active;
+    uint8_t step;       // line of current point
+    uint16_t point;     // current point
+    uint16_t probe;     // point of last probe line
+    uint16_t probed;    // number of successful probes
+    float safe_z;
+    char line[64];
+    char restore[40];   // block restoring units, distance and motion mode and feed rate when done
+} mesh_sequence_t;
+
+static bool active = false;     // compensation active
+static float inv_dx, inv_dy;
+static nvs_address_t nvs_address;
+static bltouch_mesh_t mesh;
+static mesh_sequence_t seq;
+static mesh_cell_t cell[(BLTOUCH_MESH_MAX_POINTS - 1) * (BLTOUCH_MESH_MAX_POINTS - 1)];
+static float *(*segment_line)(float *target, float *position, plan_line_data_t *pl_data, bool init);
+static float *(*transform_steps_to_cartesian)(float *position, int32_t *steps);
+
+static void mesh_compile (void)
+{
+    uint_fast8_t i, j;
+    mesh_cell_t *c;
+    float *z;
+
+    if((active = mesh.enabled && mesh.nx >= 2 && mesh.ny >= 2 && mesh.dx > 0.0f && mesh.dy > 0.0f)) {
+
+        inv_dx = 1.0f / mesh.dx;
+        inv_dy = 1.0f / mesh.dy;
+
+        for(j = 0; j < mesh.ny - 1; j++) {
+            for(i = 0; i < mesh.nx - 1; i++) {
+                z = &mesh.z[j * mesh.nx + i];
+                c = &cell[j * (mesh.nx - 1) + i];
+                c->a = z[0];
+                c->b = (z[1] - z[0]) * inv_dx;
+                c->c = (z[mesh.nx] - z[0]) * inv_dy;
+                c->d = (z[mesh.nx + 1] - z[1] - z[mesh.nx] + z[0]) * inv_dx * inv_dy;
+            }
+        }
+    }
+}
+
+// Returns Z offset at x, y. Outside the grid the edge values are used.
+static float mesh_offset (float x, float y)
+{
+    float u = x - mesh.x0, v = y - mesh.y0;
+    int_fast16_t i = (int_fast16_t)floorf(u * inv_dx), j = (int_fast16_t)floorf(v * inv_dy);
+
+    i = i < 0 ? 0 : (i > mesh.nx - 2 ? mesh.nx - 2 : i);
+    j = j < 0 ? 0 : (j > mesh.ny - 2 ? mesh.ny - 2 : j);
+
+    u = max(0.0f, min(u - (float)i * mesh.dx, mesh.dx));
+    v = max(0.0f, min(v - (float)j * mesh.dy, mesh.dy));
+
+    mesh_cell_t *c = &cell[j * (mesh.nx - 1) + i];
+
+    return c->a + u * (c->b + c->d * v) + c->c * v;
+}
+
+// Splits lines where grid lines are crossed and adds the Z offset to each segment end point.
+// Segments are passed on to any kinematics segmentation installed before the mesh.
+static float *mesh_segment_line (float *target, float *position, plan_line_data_t *pl_data, bool init)
+{
+    static bool chained = false;
+    static uint_fast8_t n_segments, segment;
+    static float start[N_AXIS], delta[N_AXIS], segment_target[N_AXIS], segment_start[N_AXIS], t[2 * BLTOUCH_MESH_MAX_POINTS + 1];
+
+    uint_fast8_t idx, k;
+    float tt, *next;
+
+    if(init) {
+
+        n_segments = segment = 0;
+        chained = false;
+
+        for(idx = 0; idx < N_AXIS; idx++) {
+            start[idx] = segment_start[idx] = position[idx];
+            delta[idx] = target[idx] - position[idx];
+        }
+
+        if(active) {
+            segment_start[Z_AXIS] += mesh_offset(start[X_AXIS], start[Y_AXIS]);
+            // Grid edges are included as the offset is constant outside the grid
+            for(k = 0; k < mesh.nx; k++) {
+                tt = (mesh.x0 + (float)k * mesh.dx - start[X_AXIS]) / delta[X_AXIS];
+                if(delta[X_AXIS] != 0.0f && tt > 0.0f && tt < 1.0f)
+                    t[n_segments++] = tt;
+            }
+            for(k = 0; k < mesh.ny; k++) {
+                tt = (mesh.y0 + (float)k * mesh.dy - start[Y_AXIS]) / delta[Y_AXIS];
+                if(delta[Y_AXIS] != 0.0f && tt > 0.0f && tt < 1.0f)
+                    t[n_segments++] = tt;
+            }
+            // Insertion sort, n is small, crossings at the same point are dropped
+            for(k = 1; k < n_segments; k++) {
+                tt = t[k];
+                for(idx = k; idx > 0 && t[idx - 1] > tt; idx--)
+                    t[idx] = t[idx - 1];
+                t[idx] = tt;
+            }
+            for(k = idx = 0; k < n_segments; k++) {
+                if(idx == 0 || t[k] - t[idx - 1] > 1e-6f)
+                    t[idx++] = t[k];
+            }
+            n_segments = idx;
+        }
+
+        t[n_segments++] = 1.0f;
+
+        return segment_target;
+    }
+
+    do {
+
+        if(chained) {
+            if((next = segment_line(NULL, NULL, pl_data, false)))
+                return next;
+            chained = false;
+        }
+
+        if(segment == n_segments)
+            return NULL;
+
+        tt = t[segment++];
+
+        for(idx = 0; idx < N_AXIS; idx++)
+            segment_target[idx] = segment == n_segments ? start[idx] + delta[idx] : start[idx] + delta[idx] * tt;
+
+        if(active)
+            segment_target[Z_AXIS] += mesh_offset(segment_target[X_AXIS], segment_target[Y_AXIS]);
+
+        if(segment_line) {
+            if(segment_line(segment_target, segment_start, pl_data, true) == NULL)
+                return NULL;
+            memcpy(segment_start, segment_target, sizeof(segment_start));
+            chained = true;
+        }
+
+    } while(chained);
+
+    return segment_target;
+}
+
+static float *mesh_transform_steps_to_cartesian (float *position, int32_t *steps)
+{
+    uint_fast8_t idx;
+
+    if(transform_steps_to_cartesian)
+        transform_steps_to_cartesian(position, steps);
+    else for(idx = 0; idx < N_AXIS; idx++)
+        position[idx] = (float)steps[idx] / settings.axis[idx].steps_per_mm;
+
+    if(active)
+        position[Z_AXIS] -= mesh_offset(position[X_AXIS], position[Y_AXIS]);
+
+    return position;
+}
+
+static void mesh_set_enabled (bool on)
+{
+    mesh.enabled = on;
+    mesh_compile();
+    gc_sync_position(); // reported position changes when compensation is toggled
+}
+
+static void mesh_save (void)
+{
+    plugin_nvs_write(nvs_address, &mesh, sizeof(bltouch_mesh_t));
+}
+
+static void mesh_load (void)
+{
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&mesh, nvs_address, sizeof(bltouch_mesh_t), true) != NVS_TransferResult_OK ||
+        mesh.nx > BLTOUCH_MESH_MAX_POINTS || mesh.ny > BLTOUCH_MESH_MAX_POINTS)
+        memset(&mesh, 0, sizeof(bltouch_mesh_t));
+
+    mesh_compile();
+}
+
+// Probing sequence
+
+static uint16_t seq_grid_index (uint16_t point)
+{
+    uint_fast8_t j = point / mesh.nx, i = point % mesh.nx;
+
+    return j * mesh.nx + (j & 1 ? mesh.nx - 1 - i : i); // serpentine order
+}
+
+// Returns true while a probing sequence is running.
+bool bltouch_mesh_active (void)
+{
+    return seq.active;
+}
+
+// Restores the units, distance and motion mode and feed rate that was active when probing was started.
+static void seq_restore (void *data)
+{
+    if(!protocol_enqueue_gcode(seq.restore))
+        task_add_delayed(seq_restore, NULL, 10);
+}
+
+static void seq_end (const char *message)
+{
+    seq.active = false;
+    bltouch_session(false);
+
+    if(!(state_get() & (STATE_ALARM|STATE_ESTOP)))
+        seq_restore(NULL);
+
+    hal.stream.write("[MSG:");
+    hal.stream.write(message);
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static void seq_run (void *data)
+{
+    uint16_t idx;
+    sys_state_t state = state_get();
+
+    if(!seq.active)
+        return;
+
+    if(state & (STATE_ALARM|STATE_ESTOP)) {
+        mesh_load(); // restore previous mesh
+        seq_end("Mesh probing failed");
+        return;
+    }
+
+    if(seq.point == mesh.nx * mesh.ny) {
+        if(state == STATE_IDLE && seq.probed == seq.point) {
+            for(idx = mesh.nx * mesh.ny - 1; idx > 0; idx--)
+                mesh.z[idx] -= mesh.z[0];
+            mesh.z[0] = 0.0f;
+            mesh_set_enabled(true);
+            mesh_save();
+            seq_end("Mesh probing completed");
+        } else
+            task_add_delayed(seq_run, NULL, 10);
+        return;
+    }
+
+    idx = seq_grid_index(seq.point);
+
+    switch(seq.step) {
+
+        case 0:
+            strcpy(seq.line, "G21G53G0X");
+            strcat(seq.line, ftoa(mesh.x0 + (float)(idx % mesh.nx) * mesh.dx, 3));
+            strcat(seq.line, "Y");
+            strcat(seq.line, ftoa(mesh.y0 + (float)(idx / mesh.nx) * mesh.dy, 3));
+            break;
+
+        case 1:
+            strcpy(seq.line, "G21G91G38.2Z-");
+            strcat(seq.line, ftoa(BLTOUCH_MESH_PROBE_DEPTH, 3));
+            strcat(seq.line, "F");
+            strcat(seq.line, ftoa(BLTOUCH_MESH_PROBE_FEED, 0));
+            break;
+
+        default:
+            strcpy(seq.line, "G21G90G53G0Z");
+            strcat(seq.line, ftoa(seq.safe_z, 3));
+            break;
+    }
+
+    if(protocol_enqueue_gcode(seq.line)) {
+        if(seq.step == 1)
+            seq.probe = idx;
+        if(++seq.step == 3) {
+            seq.step = 0;
+            seq.point++;
+        }
+    }
+
+    task_add_delayed(seq_run, NULL, 10);
+}
+
+void bltouch_mesh_probe_completed (void)
+{
+    float position[N_AXIS];
+
+    if(seq.active && sys.flags.probe_succeeded) {
+        system_convert_array_steps_to_mpos(position, sys.probe_position);
+        mesh.z[seq.probe] = position[Z_AXIS];
+        seq.probed++;
+    }
+}
+
+static status_code_t mesh_start (char *args)
+{
+    char *end;
+    uint_fast8_t idx;
+    float value[6], position[N_AXIS];
+
+    for(idx = 0; idx < 6; idx++) {
+        value[idx] = strtof(args, &end);
+        if(end == args || (*end != (idx == 5 ? '\0' : ',')))
+            return Status_InvalidStatement;
+        args = end + 1;
+    }
+
+    if(!(isintf(value[4]) && isintf(value[5])))
+        return Status_BadNumberFormat;
+
+    if(value[4] < 2.0f || value[5] < 2.0f || value[4] > (float)BLTOUCH_MESH_MAX_POINTS || value[5] > (float)BLTOUCH_MESH_MAX_POINTS ||
+        value[2] <= value[0] || value[3] <= value[1])
+        return Status_GcodeValueOutOfRange;
+
+    mesh_set_enabled(false);
+
+    mesh.nx = (uint8_t)value[4];
+    mesh.ny = (uint8_t)value[5];
+    mesh.x0 = value[0];
+    mesh.y0 = value[1];
+    mesh.dx = (value[2] - value[0]) / (float)(mesh.nx - 1);
+    mesh.dy = (value[3] - value[1]) / (float)(mesh.ny - 1);
+
+    system_convert_array_steps_to_mpos(position, sys.position);
+
+    memset(&seq, 0, sizeof(mesh_sequence_t));
+    seq.safe_z = position[Z_AXIS];
+    bltouch_modal_restore(seq.restore);
+    seq.active = true;
+
+    bltouch_session(true);
+
+    if(!task_add_immediate(seq_run, NULL)) {
+        seq.active = false;
+        bltouch_session(false);
+        return Status_Unhandled;
+    }
+
+    return Status_OK;
+}
+
+static status_code_t mesh_command (sys_state_t state, char *args)
+{
+    uint_fast8_t i, j;
+
+    if(args) {
+
+        if(state != STATE_IDLE || seq.active || bltouch_probe_active())
+            return Status_IdleError;
+
+        if((*args == '0' || *args == '1') && args[1] == '\0') {
+            if(*args == '1' && mesh.nx < 2)
+                return Status_InvalidStatement;
+            mesh_set_enabled(*args == '1');
+            mesh_save();
+            return Status_OK;
+        }
+
+        return mesh_start(args);
+    }
+
+    hal.stream.write("[MESH:");
+    hal.stream.write(uitoa(mesh.nx));
+    hal.stream.write("x");
+    hal.stream.write(uitoa(mesh.ny));
+    hal.stream.write("|X0:");
+    hal.stream.write(ftoa(mesh.x0, 3));
+    hal.stream.write("|Y0:");
+    hal.stream.write(ftoa(mesh.y0, 3));
+    hal.stream.write("|DX:");
+    hal.stream.write(ftoa(mesh.dx, 3));
+    hal.stream.write("|DY:");
+    hal.stream.write(ftoa(mesh.dy, 3));
+    hal.stream.write("|ON:");
+    hal.stream.write(uitoa(active));
+    hal.stream.write("]" ASCII_EOL);
+
+    for(j = 0; j < mesh.ny; j++) {
+        hal.stream.write("[MESHROW:");
+        hal.stream.write(uitoa(j));
+        hal.stream.write("|");
+        for(i = 0; i < mesh.nx; i++) {
+            if(i)
+                hal.stream.write(",");
+            hal.stream.write(ftoa(mesh.z[j * mesh.nx + i], 3));
+        }
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+void bltouch_mesh_init (void)
+{
+    static const sys_command_t mesh_command_list[] = {
+        {"BLTMESH", mesh_command, {}, { .str = "probe height map, $BLTMESH=<x0>,<y0>,<x1>,<y1>,<nx>,<ny>, $BLTMESH=0|1 to disable/enable compensation" } }
+    };
+
+    static sys_commands_t mesh_commands = {
+        .n_commands = sizeof(mesh_command_list) / sizeof(sys_command_t),
+        .commands = mesh_command_list
+    };
+
+    static plugin_nvs_block_t nvs_block = {
+        .id = PluginNVS_BLTouchMesh,
+        .size = sizeof(bltouch_mesh_t),
+        .address = &nvs_address,
+        .load = mesh_load
+    };
+
+    if((nvs_address = nvs_alloc(sizeof(bltouch_mesh_t)))) {
+
+        mesh_load();
+
+        segment_line = kinematics.segment_line;
+        kinematics.segment_line = mesh_segment_line;
+
+        transform_steps_to_cartesian = kinematics.transform_steps_to_cartesian;
+        kinematics.transform_steps_to_cartesian = mesh_transform_steps_to_cartesian;
+
+        system_register_commands(&mesh_commands);
+        plugin_nvs_register(&nvs_block);
+    } else
+        protocol_enqueue_foreground_task(report_warning, "BLTouch mesh failed to initialize!");
+}
+
+#endif // BLTOUCH_MESH_ENABLE
+
+#endif // BLTOUCH_ENABLE
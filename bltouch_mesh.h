@@ -0,0 +1,31 @@
+/*
+
+  bltouch_mesh.h - BLTouch probed height map Z compensation
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Enable by adding #define BLTOUCH_MESH_ENABLE 1 to my_machine.h, requires BLTOUCH_ENABLE.
+
+*/
+
+#ifndef _BLTOUCH_MESH_H_
+#define _BLTOUCH_MESH_H_
+
+#ifndef BLTOUCH_MESH_ENABLE
+#define BLTOUCH_MESH_ENABLE 0
+#endif
+
+void bltouch_mesh_init (void);
+void bltouch_mesh_probe_completed (void);
+bool bltouch_mesh_active (void);
+
+// Implemented by bltouch.c, keeps the probe deployed between probing moves while on.
+void bltouch_session (bool on);
+// Implemented by bltouch.c, returns true while a $BLTPROBE sequence is running.
+bool bltouch_probe_active (void);
+// Implemented by bltouch.c, writes a block restoring the modal state changed by probing moves.
+void bltouch_modal_restore (char *line);
+
+#endif // _BLTOUCH_MESH_H_
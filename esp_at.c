@@ -26,7 +26,9 @@
 #if ESP_AT_ENABLE == 1
 
 #include <stdio.h>
+#include <ctype.h>
 #include <string.h>
+#include <stdlib.h>
 
 #ifdef ARDUINO
 #include "../grbl/hal.h"
@@ -42,10 +44,92 @@
 #include "grbl/nvs_buffer.h"
 #endif
 
+#include "esp_at_spi.h"
+#include "plugin_nvs.h"
+#include "plugin_prof.h"
+#include "flightrec.h"
+
 #ifndef COPROC_STREAM
 #define COPROC_STREAM 255 // Claim first free stream
 #endif
 
+#ifndef ESP_AT_TOKENS
+#define ESP_AT_TOKENS 0 // Set to 1 to enable tokenised G-code transfer mode
+#endif
+
+#ifndef ESP_AT_DUAL_CORE
+#define ESP_AT_DUAL_CORE 0 // Set to 1 to hand received data from the core servicing the ESP UART to the protocol core via a lock-free ring
+#endif
+
+#if ESP_AT_DUAL_CORE
+#ifdef __STDC_NO_ATOMICS__
+#error "ESP_AT_DUAL_CORE requires C11 atomics!"
+#endif
+#include <stdatomic.h>
+#ifndef ESP_AT_RX_RING_SIZE
+#define ESP_AT_RX_RING_SIZE 1024 // must be a power of 2, min. 32
+#endif
+#if ESP_AT_RX_RING_SIZE < 32 || (ESP_AT_RX_RING_SIZE & (ESP_AT_RX_RING_SIZE - 1))
+#error "ESP_AT_RX_RING_SIZE must be a power of 2, min. 32!"
+#endif
+#endif
+
+#ifndef ESP_AT_TX_BULK_SIZE
+#define ESP_AT_TX_BULK_SIZE 256 // must be a power of 2
+#endif
+
+#ifndef ESP_AT_TX_PRIORITY_SIZE
+#define ESP_AT_TX_PRIORITY_SIZE 128 // must be a power of 2
+#endif
+
+#ifndef ESP_AT_TX_UART_FILL
+#define ESP_AT_TX_UART_FILL 32 // Max. number of characters queued in the UART buffer, keep low for fast status reports
+#endif
+
+#ifndef ESP_AT_WATCHDOG_INTERVAL
+#define ESP_AT_WATCHDOG_INTERVAL 10000 // ms between liveness probes when no client is connected, 0 to disable
+#endif
+
+#ifndef ESP_AT_STALL_TIMEOUT
+#define ESP_AT_STALL_TIMEOUT 5000 // ms without progress with output pending before the ESP is reset, requires ESP_AT_WATCHDOG_INTERVAL > 0
+#endif
+
+#ifndef ESP_AT_SESSION_GRACE
+#define ESP_AT_SESSION_GRACE 3000 // ms to keep the session attached after the client connection is lost, 0 to disable
+#endif
+
+#ifndef ESP_AT_TCP_SNDBUF
+#define ESP_AT_TCP_SNDBUF 2920 // ESP-AT TCP send buffer size
+#endif
+
+#ifndef ESP_AT_TCP_DRAIN_RATE
+#define ESP_AT_TCP_DRAIN_RATE 16 // Max. bytes per ms assumed forwarded by the ESP to the client, 0 to disable in-flight accounting
+#endif
+
+#ifndef ESP_AT_REPORT_INTERVAL_MAX
+#define ESP_AT_REPORT_INTERVAL_MAX 1000 // Max. ms between unsolicited status reports when link is slow, 0 to disable throttling
+#endif
+
+#ifndef ESP_AT_REPORT_BACKLOG_HIGH
+#define ESP_AT_REPORT_BACKLOG_HIGH 192 // TX backlog that increases the status report interval
+#endif
+
+#ifndef ESP_AT_REPORT_BACKLOG_LOW
+#define ESP_AT_REPORT_BACKLOG_LOW 48 // TX backlog that decreases the status report interval
+#endif
+
+#ifndef ESP_AT_RSSI_WEAK
+#define ESP_AT_RSSI_WEAK -75 // dBm, minimum status report interval is set to 100 ms if weaker at connect
+#endif
+
+#ifndef ESP_AT_LINE_BUFFER_SIZE
+#define ESP_AT_LINE_BUFFER_SIZE 128 // Longest expected reply is +CWJAP:"<32 char ssid>","xx:xx:xx:xx:xx:xx",<channel>,<rssi>,...
+#endif
+
+#ifndef ESP_AT_JOB_CACHE
+#define ESP_AT_JOB_CACHE 0 // Set to 1 to enable caching of jobs in the ESP filesystem, requires ESP-AT built with AT+FS support
+#endif
+
 typedef struct {
     uint8_t boot0;
     uint8_t reset;
@@ -72,18 +156,43 @@ typedef struct {
 
 static uint32_t timeout;
 static bool esp_at_running;
-static char ip[16];
-static char gateway[16];
-static char netmask[16];
-static char mac[18];
-static char buf[130];
+static uint8_t ip[4];
+static uint8_t mac[6];
+static char buf[ESP_AT_LINE_BUFFER_SIZE];
 static on_report_options_ptr on_report_options;
 static nvs_address_t nvs_address;
 static io_stream_t at_cmd_stream;
 static esp_at_settings_t esp_at_settings;
 static const io_stream_t *session_stream;
+static on_execute_realtime_ptr on_execute_realtime;
+static int8_t rssi = 0;
+static at_ports_t at_ports = { 0xFF, 0xFF };
+#if ESP_AT_SESSION_GRACE
+static bool session_lost = false, session_dropped = false, rebinding = false;
+static uint8_t session_peer[4];
+static void session_drop (void);
+#else
+#define session_lost false
+#endif
+#if ESP_AT_JOB_CACHE
+static bool tx_hold = false, job_active = false;
+#else
+#define tx_hold false
+#endif
 
 static void await_connect (void *data);
+#if ESP_AT_DUAL_CORE
+static void rx_ring_drain (void);
+static void rx_ring_flush (void);
+static void rx_ring_events (void *data);
+#endif
+#if ESP_AT_WATCHDOG_INTERVAL
+static bool watchdog_check (bool line_pending);
+static bool watchdog_pending (void);
+static void watchdog_restart (void);
+static void watchdog_ok (void);
+static uint32_t tx_pumped = 0, rx_count = 0; // for stall detection
+#endif
 
 /////////////////////////
 
@@ -105,6 +214,9 @@ static uint16_t atStreamRxFree (void)
 //
 static void atStreamRxFlush (void)
 {
+#if ESP_AT_DUAL_CORE
+    rx_ring_flush();
+#endif
     rxbuf.tail = rxbuf.head;
 }
 
@@ -113,17 +225,291 @@ static void atStreamRxFlush (void)
 //
 static void atStreamRxCancel (void)
 {
+#if ESP_AT_DUAL_CORE
+    rx_ring_flush();
+#endif
     rxbuf.data[rxbuf.head] = ASCII_CAN;
     rxbuf.tail = rxbuf.head;
     rxbuf.head = BUFNEXT(rxbuf.head, rxbuf);
 }
 
+/*
+  Output is queued in two lanes, status reports, ok responses and output written
+  while a write is blocked waiting for space (i.e. from the realtime loop) goes
+  to the priority lane. The lanes are pumped to the UART a line at a time,
+  priority lane first, keeping the UART buffer short.
+*/
+
+typedef enum {
+    TxLane_Bulk = 0,
+    TxLane_Priority,
+    TxLane_Discard
+} tx_lane_id_t;
+
+typedef struct {
+    uint_fast16_t head;
+    uint_fast16_t tail;
+    uint_fast16_t mask;
+    bool open;              // line being written is not yet terminated
+    char *data;
+} tx_lane_t;
+
+static char tx_bulk[ESP_AT_TX_BULK_SIZE], tx_priority[ESP_AT_TX_PRIORITY_SIZE];
+static tx_lane_t tx_lanes[] = {
+    { .mask = ESP_AT_TX_BULK_SIZE - 1, .data = tx_bulk },
+    { .mask = ESP_AT_TX_PRIORITY_SIZE - 1, .data = tx_priority },
+    { .mask = 0, .data = NULL } // throttled status reports
+};
+static tx_lane_t *pump_lane = NULL;     // lane being pumped, NULL at line boundary
+static uint_fast8_t write_depth = 0;    // > 0 when a write is blocked
+
+#if ESP_AT_TCP_DRAIN_RATE
+
+/*
+  There is no SEND OK confirmation from the ESP in transparent mode, data is silently dropped
+  if the TCP send buffer overflows. Bytes that have left the UART are counted as in flight
+  until drained by the ESP at the assumed drain rate. When the ESP reports busy the send buffer
+  is taken to be full and the rate is halved, it is increased again each time the in-flight
+  count drains to zero without the ESP reporting busy, up to ESP_AT_TCP_DRAIN_RATE.
+*/
+
+static struct {
+    uint32_t pumped;    // bytes written to the UART
+    uint32_t sent;      // bytes that has left the UART
+    uint32_t inflight;
+    uint32_t ms;
+    uint32_t rate;      // bytes per ms
+} tx_flow = { .rate = ESP_AT_TCP_DRAIN_RATE };
+
+static void tx_flow_reset (void)
+{
+    tx_flow.sent = tx_flow.pumped - at_cmd_stream.get_tx_buffer_count();
+    tx_flow.inflight = 0;
+    tx_flow.ms = hal.get_elapsed_ticks();
+    tx_flow.rate = ESP_AT_TCP_DRAIN_RATE;
+}
+
+static uint16_t tx_inflight (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks(), sent = tx_flow.pumped - at_cmd_stream.get_tx_buffer_count(),
+             drained = (ms - tx_flow.ms) * tx_flow.rate;
+
+    tx_flow.inflight += sent - tx_flow.sent;
+    if(tx_flow.inflight > drained)
+        tx_flow.inflight -= drained;
+    else if(tx_flow.inflight) {
+        tx_flow.inflight = 0;
+        if(tx_flow.rate < ESP_AT_TCP_DRAIN_RATE)
+            tx_flow.rate++;
+    }
+    tx_flow.sent = sent;
+    tx_flow.ms = ms;
+
+    return (uint16_t)min(tx_flow.inflight, ESP_AT_TCP_SNDBUF);
+}
+
+// Called when the ESP reports busy.
+static void tx_busy (void *data)
+{
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Busy, tx_flow.rate);
+
+    tx_inflight();
+    tx_flow.inflight = ESP_AT_TCP_SNDBUF;
+    if(tx_flow.rate > 1)
+        tx_flow.rate >>= 1;
+}
+
+#else
+#define tx_flow_reset()
+#define tx_inflight() 0
+
+static void tx_busy (void *data)
+{
+}
+#endif // ESP_AT_TCP_DRAIN_RATE
+
+//
+// Returns number of characters that can be written to the UART
+//
+static uint16_t tx_room (void)
+{
+    uint16_t uart = at_cmd_stream.get_tx_buffer_count(), inflight = tx_inflight();
+
+    return uart >= ESP_AT_TX_UART_FILL || inflight >= ESP_AT_TCP_SNDBUF
+            ? 0
+            : min(ESP_AT_TX_UART_FILL - uart, ESP_AT_TCP_SNDBUF - inflight);
+}
+
+static void tx_lanes_flush (void)
+{
+    tx_lanes[TxLane_Bulk].tail = tx_lanes[TxLane_Bulk].head;
+    tx_lanes[TxLane_Bulk].open = false;
+    tx_lanes[TxLane_Priority].tail = tx_lanes[TxLane_Priority].head;
+    tx_lanes[TxLane_Priority].open = false;
+    tx_lanes[TxLane_Discard].open = false;
+    pump_lane = NULL;
+}
+
+//
+// Moves lane data to the UART, returns false if nothing was moved
+//
+static bool tx_pump (void)
+{
+    static bool busy = false;
+
+    char c;
+    bool moved = false;
+    uint16_t room;
+
+    if(busy || session_lost || tx_hold)
+        return false;
+
+    busy = true;
+
+    room = tx_room();
+
+    while(room--) {
+
+        if(pump_lane == NULL) {
+            if(tx_lanes[TxLane_Priority].head != tx_lanes[TxLane_Priority].tail)
+                pump_lane = &tx_lanes[TxLane_Priority];
+            else if(tx_lanes[TxLane_Bulk].head != tx_lanes[TxLane_Bulk].tail)
+                pump_lane = &tx_lanes[TxLane_Bulk];
+            else
+                break;
+        }
+
+        if(pump_lane->head == pump_lane->tail)
+            break; // rest of line not yet written
+
+        c = pump_lane->data[pump_lane->tail];
+        pump_lane->tail = (pump_lane->tail + 1) & pump_lane->mask;
+        at_cmd_stream.write_char(c);
+#if ESP_AT_TCP_DRAIN_RATE
+        tx_flow.pumped++;
+#endif
+#if ESP_AT_WATCHDOG_INTERVAL
+        tx_pumped++;
+#endif
+        moved = true;
+
+        if(c == ASCII_LF)
+            pump_lane = NULL;
+    }
+
+    busy = false;
+
+    return moved;
+}
+
+static uint16_t atStreamTxCount (void);
+
+#if ESP_AT_REPORT_INTERVAL_MAX
+
+/*
+  Unsolicited status reports are dropped when the TX backlog builds up,
+  the minimum interval between reports is doubled each time a report is written
+  with the backlog above ESP_AT_REPORT_BACKLOG_HIGH and halved when below
+  ESP_AT_REPORT_BACKLOG_LOW. Reports requested by the client are always sent.
+*/
+
+static bool report_requested = false;
+
+static bool report_throttle (void)
+{
+    static uint32_t last_ms = 0, interval = 0;
+
+    uint32_t ms = hal.get_elapsed_ticks(), floor = rssi && rssi < ESP_AT_RSSI_WEAK ? 100 : 0;
+    uint16_t backlog = atStreamTxCount();
+
+    if(backlog > ESP_AT_REPORT_BACKLOG_HIGH)
+        interval = interval ? min(interval << 1, ESP_AT_REPORT_INTERVAL_MAX) : 50;
+    else if(backlog < ESP_AT_REPORT_BACKLOG_LOW)
+        interval = interval > 50 ? interval >> 1 : 0;
+
+    if(interval < floor)
+        interval = floor;
+
+    if(!report_requested && ms - last_ms < interval)
+        return true;
+
+    last_ms = ms;
+    report_requested = false;
+
+    return false;
+}
+
+#endif // ESP_AT_REPORT_INTERVAL_MAX
+
+static tx_lane_t *tx_lane_select (const char *s)
+{
+    if(tx_lanes[TxLane_Discard].open)
+        return &tx_lanes[TxLane_Discard];
+
+    if(write_depth || tx_lanes[TxLane_Priority].open)
+        return &tx_lanes[TxLane_Priority];
+
+    if(!tx_lanes[TxLane_Bulk].open && *s == '<') {
+        if(session_lost)
+            return &tx_lanes[TxLane_Discard];
+#if ESP_AT_REPORT_INTERVAL_MAX
+        if(report_throttle())
+            return &tx_lanes[TxLane_Discard];
+#endif
+        return &tx_lanes[TxLane_Priority];
+    }
+
+    if(!tx_lanes[TxLane_Bulk].open && !strcmp(s, "ok" ASCII_EOL))
+        return &tx_lanes[TxLane_Priority];
+
+    return &tx_lanes[TxLane_Bulk];
+}
+
+static bool tx_lane_put (tx_lane_t *lane, const char c)
+{
+    if(lane->data == NULL) {
+        lane->open = c != ASCII_LF;
+        return true;
+    }
+
+    uint_fast16_t next_head = (lane->head + 1) & lane->mask;
+
+    if(next_head == lane->tail) {
+
+        bool nested = write_depth++ > 0;
+
+        while(next_head == lane->tail) {
+            // Nested writes cannot wait for the blocked outer write to complete its line,
+            // output is dropped when the buffer is full while the client is disconnected
+            // and the session is then ended rather than resumed.
+            if(session_lost || (!tx_pump() && (nested ? tx_room() > 0 : !hal.stream_blocking_callback()))) {
+#if ESP_AT_SESSION_GRACE
+                if(session_lost)
+                    session_drop();
+#endif
+                write_depth--;
+                return false;
+            }
+        }
+
+        write_depth--;
+    }
+
+    lane->data[lane->head] = c;
+    lane->head = next_head;
+    lane->open = c != ASCII_LF;
+
+    return true;
+}
+
 //
-// Returns number of characters pending transmission
+// Returns number of characters pending transmission, including characters in flight to the client
 //
 static uint16_t atStreamTxCount (void)
 {
-    return at_cmd_stream.get_tx_buffer_count();
+    return at_cmd_stream.get_tx_buffer_count() + tx_inflight() +
+            ((tx_lanes[TxLane_Bulk].head - tx_lanes[TxLane_Bulk].tail) & tx_lanes[TxLane_Bulk].mask) +
+             ((tx_lanes[TxLane_Priority].head - tx_lanes[TxLane_Priority].tail) & tx_lanes[TxLane_Priority].mask);
 }
 
 //
@@ -131,7 +517,12 @@ static uint16_t atStreamTxCount (void)
 //
 static bool atStreamPutC (const char c)
 {
-    return at_cmd_stream.write_char(c);
+    char s[2] = { c, '\0' };
+    bool ok = tx_lane_put(tx_lane_select(s), c);
+
+    tx_pump();
+
+    return ok;
 }
 
 //
@@ -140,9 +531,12 @@ static bool atStreamPutC (const char c)
 static void atStreamWriteS (const char *s)
 {
     char c, *ptr = (char *)s;
+    tx_lane_t *lane = tx_lane_select(s);
 
     while((c = *ptr++) != '\0')
-        atStreamPutC(c);
+        tx_lane_put(lane, c);
+
+    tx_pump();
 }
 
 //
@@ -151,9 +545,12 @@ static void atStreamWriteS (const char *s)
 static void atStreamWrite (const char *s, uint16_t length)
 {
     char *ptr = (char *)s;
+    tx_lane_t *lane = tx_lane_select(s);
 
     while(length--)
-        atStreamPutC(*ptr++);
+        tx_lane_put(lane, *ptr++);
+
+    tx_pump();
 }
 
 //
@@ -163,6 +560,11 @@ static int16_t atStreamGetC (void)
 {
     uint_fast16_t tail = rxbuf.tail;    // Get buffer pointer
 
+#if ESP_AT_DUAL_CORE
+    if(tail == rxbuf.head)
+        rx_ring_drain();
+#endif
+
     if(tail == rxbuf.head)
         return -1; // no data available
 
@@ -192,9 +594,23 @@ static enqueue_realtime_command_ptr atStreamSetRtHandler (enqueue_realtime_comma
     return prev;
 }
 
+static bool atStream_rx_realtime (char c)
+{
+#if ESP_AT_WATCHDOG_INTERVAL
+    rx_count++;
+#endif
+
+#if ESP_AT_REPORT_INTERVAL_MAX
+    if(c == CMD_STATUS_REPORT || c == CMD_STATUS_REPORT_LEGACY)
+        report_requested = true;
+#endif
+
+    return enqueue_realtime_command(c);
+}
+
 static void atStream_rx_insert (char c)
 {
-    if(!enqueue_realtime_command(c)) {                          // Check and strip realtime commands...
+    if(!atStream_rx_realtime(c)) {                              // Check and strip realtime commands...
 
         uint_fast16_t next_head = BUFNEXT(rxbuf.head, rxbuf);   // Get and increment buffer pointer
         if(next_head == rxbuf.tail)                             // If buffer full
@@ -206,6 +622,273 @@ static void atStream_rx_insert (char c)
     }
 }
 
+#if ESP_AT_DUAL_CORE
+
+/*
+  On dual core MCUs the driver may service the ESP UART interrupt on the core not running the protocol loop
+  and stepping. The receive path, URC matching and token expansion, then runs on that core and the framed data
+  is handed over to the protocol core via a lock-free single producer, single consumer ring. The ring is drained
+  by the protocol core, realtime commands are extracted and the remaining data added to the input buffer there.
+  Events that must be acted upon by the protocol core are passed as flags.
+*/
+
+typedef enum {
+    RxEvent_Closed = 1 << 0,
+    RxEvent_TokenAck = 1 << 1,
+    RxEvent_Busy = 1 << 2
+} rx_event_t;
+
+static struct {
+    atomic_uint_fast16_t head;  // written by the producer only
+    atomic_uint_fast16_t tail;  // written by the consumer only
+    atomic_uint events;
+    atomic_bool overflow;
+    atomic_bool token_reset;    // set by the consumer to restart token negotiation
+    uint32_t done[ESP_AT_RX_RING_SIZE / 32]; // realtime commands extracted ahead of the data, consumer only
+    char data[ESP_AT_RX_RING_SIZE];
+} rx_ring = {0};
+
+// Producer, called on the core servicing the ESP UART.
+static ISR_CODE void ISR_FUNC(rx_ring_put)(char c)
+{
+    uint_fast16_t head = atomic_load_explicit(&rx_ring.head, memory_order_relaxed),
+                  next_head = (head + 1) & (ESP_AT_RX_RING_SIZE - 1);
+
+    if(next_head == atomic_load_explicit(&rx_ring.tail, memory_order_acquire))
+        atomic_store_explicit(&rx_ring.overflow, true, memory_order_relaxed);
+    else {
+        rx_ring.data[head] = c;
+        atomic_store_explicit(&rx_ring.head, next_head, memory_order_release); // publish data before head
+    }
+}
+
+// Consumer, called on the protocol core. Events are acted upon after preceding data has been moved.
+// Data is left in the ring while the input buffer is full, realtime commands are extracted from it
+// and flagged as done so that they are skipped when moved later.
+static void rx_ring_drain (void)
+{
+    uint_fast32_t events = atomic_exchange_explicit(&rx_ring.events, 0, memory_order_acquire);
+    uint_fast16_t idx,
+                  tail = atomic_load_explicit(&rx_ring.tail, memory_order_relaxed),
+                  head = atomic_load_explicit(&rx_ring.head, memory_order_acquire); // after events so that data preceding them is included
+
+    while(tail != head && BUFNEXT(rxbuf.head, rxbuf) != rxbuf.tail) {
+        if(rx_ring.done[tail >> 5] & (1UL << (tail & 0x1F)))
+            rx_ring.done[tail >> 5] &= ~(1UL << (tail & 0x1F));
+        else
+            atStream_rx_insert(rx_ring.data[tail]);
+        tail = (tail + 1) & (ESP_AT_RX_RING_SIZE - 1);
+    }
+
+    for(idx = tail; idx != head; idx = (idx + 1) & (ESP_AT_RX_RING_SIZE - 1)) {
+        if(!(rx_ring.done[idx >> 5] & (1UL << (idx & 0x1F))) && atStream_rx_realtime(rx_ring.data[idx]))
+            rx_ring.done[idx >> 5] |= 1UL << (idx & 0x1F);
+    }
+
+    atomic_store_explicit(&rx_ring.tail, tail, memory_order_release); // release slots after data is read
+
+    if(atomic_exchange_explicit(&rx_ring.overflow, false, memory_order_relaxed))
+        rxbuf.overflow = 1;
+
+    if(tail != head)
+        atomic_fetch_or_explicit(&rx_ring.events, events, memory_order_relaxed); // wait for the data to be moved
+    else if(events)
+        task_add_immediate(rx_ring_events, (void *)(uintptr_t)events);
+}
+
+static void rx_ring_flush (void)
+{
+    atomic_store_explicit(&rx_ring.tail, atomic_load_explicit(&rx_ring.head, memory_order_acquire), memory_order_release);
+    memset(rx_ring.done, 0, sizeof(rx_ring.done));
+}
+
+#define rx_framed(c) rx_ring_put(c)
+#define rx_signal(fn, event) atomic_fetch_or_explicit(&rx_ring.events, event, memory_order_release)
+#define token_negotiate() atomic_store_explicit(&rx_ring.token_reset, true, memory_order_release)
+
+#else
+
+#define rx_framed(c) atStream_rx_insert(c)
+#define rx_signal(fn, event) task_add_immediate(fn, NULL)
+#define token_negotiate() token.state = Token_Negotiate
+
+#endif // ESP_AT_DUAL_CORE
+
+#if ESP_AT_TOKENS
+
+/*
+  Tokenised G-code transfer mode, enabled by the client sending TOKEN_MAGIC as the first byte
+  after connecting. The controller replies with [TOKENS:1] when enabled.
+
+  0x00 - 0xBF: passed through unchanged, this includes realtime commands.
+  0xC0 - 0xD9: word letter A - Z, followed by a value descriptor and 1 - 4 bytes of payload.
+  0xDA - 0xFF: reserved, discarded.
+
+  Value descriptor: bits 0-2: number of decimals, 0 - 4.
+                    bit 3: payload is a delta from the previous value of the same word.
+                    bits 4-5: payload length - 1.
+
+  Payload: signed little endian integer, value = payload / 10^decimals.
+
+  Payload bytes are never checked for realtime commands.
+*/
+
+#define TOKEN_MAGIC    0xFE
+#define TOKEN_WORD     0xC0
+#define TOKEN_DECIMALS 4
+#define TOKEN_VALUE_MAX ((int64_t)INT32_MAX * 10000) // value range of a 4 byte payload without decimals,
+#define TOKEN_VALUE_MIN ((int64_t)INT32_MIN * 10000) // in 1/10^TOKEN_DECIMALS units
+
+typedef enum {
+    Token_Negotiate = 0,
+    Token_Off,
+    Token_Idle,
+    Token_Descriptor,
+    Token_Payload
+} token_state_t;
+
+typedef struct {
+    token_state_t state;
+    uint8_t letter;
+    uint8_t descriptor;
+    uint8_t count;
+    uint8_t length;
+    uint32_t payload;
+    int64_t last[26]; // in 1/10^TOKEN_DECIMALS units
+    uint8_t last_decimals[26];
+} token_decoder_t;
+
+static token_decoder_t token = {0}; // owned by the core receiving data, see token_negotiate()
+
+static void token_ack (void *data)
+{
+    if(session_stream)
+        session_stream->write("[TOKENS:1]" ASCII_EOL);
+}
+
+static void token_expand (void)
+{
+    static const int32_t scale[] = { 10000, 1000, 100, 10, 1 };
+
+    char num[20], *s = &num[sizeof(num) - 1];
+    uint_fast8_t decimals = token.descriptor & 0x07, digits = TOKEN_DECIMALS;
+    int64_t value = (int32_t)token.payload;
+
+    if(token.length < 4 && (value & (1 << (token.length * 8 - 1)))) // sign extend
+        value -= 1LL << (token.length * 8);
+
+    value *= scale[decimals];
+
+    // Keep the precision of the previous value when adding a delta.
+    if(token.descriptor & 0x08) {
+        value += token.last[token.letter];
+        decimals = max(decimals, token.last_decimals[token.letter]);
+    }
+
+    // Out of range, the letter is passed on without a value so that the line is rejected by the parser.
+    if(value > TOKEN_VALUE_MAX || value < TOKEN_VALUE_MIN) {
+        rx_framed('A' + token.letter);
+        return;
+    }
+
+    token.last[token.letter] = value;
+    token.last_decimals[token.letter] = decimals;
+
+    rx_framed('A' + token.letter);
+
+    bool negative = value < 0;
+    uint64_t uvalue = (uint64_t)(negative ? -value : value);
+
+    // Format right to left, dropping digits beyond the requested number of decimals.
+    *s = '\0';
+    while(digits > decimals) {
+        uvalue /= 10;
+        digits--;
+    }
+    while(digits) {
+        *--s = '0' + uvalue % 10;
+        uvalue /= 10;
+        if(--digits == 0)
+            *--s = '.';
+    }
+    do {
+        *--s = '0' + uvalue % 10;
+        uvalue /= 10;
+    } while(uvalue);
+
+    if(negative)
+        rx_framed('-');
+
+    while(*s)
+        rx_framed(*s++);
+}
+
+static void atStream_rx_put (char c)
+{
+#if ESP_AT_DUAL_CORE
+    // Token state is owned by the producer core, restart is requested by the protocol core.
+    if(atomic_exchange_explicit(&rx_ring.token_reset, false, memory_order_acquire))
+        token.state = Token_Negotiate;
+#endif
+
+    switch(token.state) {
+
+        case Token_Negotiate:
+            if((uint8_t)c == TOKEN_MAGIC) {
+                memset(token.last, 0, sizeof(token.last));
+                memset(token.last_decimals, 0, sizeof(token.last_decimals));
+                token.state = Token_Idle;
+                rx_signal(token_ack, RxEvent_TokenAck);
+                return;
+            }
+            token.state = Token_Off;
+            // no break
+
+        case Token_Off:
+            rx_framed(c);
+            break;
+
+        case Token_Idle:
+            if((uint8_t)c < TOKEN_WORD)
+                rx_framed(c);
+            else if((uint8_t)c < TOKEN_WORD + 26) {
+                token.letter = (uint8_t)c - TOKEN_WORD;
+                token.state = Token_Descriptor;
+            }
+            break;
+
+        case Token_Descriptor:
+            token.descriptor = (uint8_t)c;
+            if((token.descriptor & 0x07) > TOKEN_DECIMALS || (token.descriptor & 0xC0))
+                token.state = Token_Idle; // invalid, drop word
+            else {
+                token.length = ((token.descriptor >> 4) & 0x03) + 1;
+                token.count = 0;
+                token.payload = 0;
+                token.state = Token_Payload;
+            }
+            break;
+
+        case Token_Payload:
+            token.payload |= (uint32_t)(uint8_t)c << (token.count * 8);
+            if(++token.count == token.length) {
+                token_expand();
+                token.state = Token_Idle;
+            }
+            break;
+    }
+}
+
+// Returns true while a token word is being decoded, descriptor and payload bytes are binary data.
+#define token_in_word() (token.state == Token_Descriptor || token.state == Token_Payload)
+
+#else
+
+#define atStream_rx_put(c) rx_framed(c)
+#define token_in_word() false
+
+#endif // ESP_AT_TOKENS
+
 /////////////////////////
 
 static bool is_done (char *s, bool *status)
@@ -237,9 +920,6 @@ static bool send_command (char *command)
 
         if((c = at_cmd_stream.read()) != SERIAL_NO_DATA) {
 
-            if(s - buf >= sizeof(buf) - 1)
-                return false;
-
             if(c == ASCII_LF) {
 
                 *s = '\0';
@@ -251,11 +931,13 @@ static bool send_command (char *command)
                     *buf = '\0';
                     s = buf;
                 }
-            } else if(c != ASCII_CR)
+            } else if(c != ASCII_CR && s - buf < sizeof(buf) - 1) // truncate overlong lines
                 *s++ = (char)c;
         }
     }
 
+    PLUGIN_STALL_DELAY(PluginStall_EspAt, hal.get_elapsed_ticks() + 1000 - timeout);
+
     return !strcmp(buf, "OK");
 }
 
@@ -293,33 +975,141 @@ static char *get_reply (char *command)
                     s=buf;
                 }
             } else
-            if(c != ASCII_CR)
+            if(c != ASCII_CR && s - buf < sizeof(buf) - 1) // truncate overlong lines
                 *s++ = (char)c;
         }
     }
 
+    PLUGIN_STALL_DELAY(PluginStall_EspAt, hal.get_elapsed_ticks() + 5000 - timeout);
+
     return *buf ? buf : NULL;
 }
 
-static void close_session (void *data)
+//
+// Parses a dotted quad IPv4 address terminated by '"' or '\0' into 4 bytes
+//
+static bool ip_parse (const char *s, uint8_t *addr)
 {
-    if(session_stream) {
-        stream_disconnect(session_stream);
-        session_stream = NULL;
+    uint8_t octets[4];
+    uint_fast8_t idx = 0, digits = 0;
+    uint_fast16_t octet = 0;
+
+    for(;; s++) {
+        if(*s >= '0' && *s <= '9' && digits < 3) {
+            octet = octet * 10 + (*s - '0');
+            digits++;
+        } else if(digits && octet <= 255 && (idx < 3 ? *s == '.' : (*s == '"' || *s == '\0'))) {
+            octets[idx++] = (uint8_t)octet;
+            if(idx == 4)
+                break;
+            octet = digits = 0;
+        } else
+            return false;
+    }
+
+    memcpy(addr, octets, sizeof(octets));
+
+    return true;
+}
+
+//
+// Parses a MAC address in xx:xx:xx:xx:xx:xx format into 6 bytes
+//
+static bool mac_parse (const char *s, uint8_t *addr)
+{
+    uint8_t octets[6];
+    uint_fast8_t idx, nibble;
+    char c;
+
+    for(idx = 0; idx < 12; idx++) {
+        c = *s++;
+        if(c >= '0' && c <= '9')
+            nibble = c - '0';
+        else if((c |= 0x20) >= 'a' && c <= 'f')
+            nibble = c - 'a' + 10;
+        else
+            return false;
+        if(idx & 1) {
+            octets[idx >> 1] |= nibble;
+            if(idx < 11 && *s++ != ':')
+                return false;
+        } else
+            octets[idx >> 1] = nibble << 4;
+    }
+
+    memcpy(addr, octets, sizeof(octets));
+
+    return true;
+}
+
+#if ESP_AT_REPORT_INTERVAL_MAX
+
+//
+// Returns signal strength of the AP connection in dBm, 0 if not available
+//
+static int8_t get_rssi (void)
+{
+    char *s = get_reply("AT+CWJAP?");
+    int8_t rssi = 0;
+    int_fast8_t field = 0;
+
+    while(s && !is_done(s, NULL)) {
+
+        // +CWJAP:<ssid>,<bssid>,<channel>,<rssi>,...
+        if(!strncmp(s, "+CWJAP:", 7) && (s = strstr(s, "\",\"")) && (s = strstr(s + 3, "\","))) {
+            s++;
+            while(*s && field < 2) {
+                if(*s++ == ',')
+                    field++;
+            }
+            if(field == 2)
+                rssi = (int8_t)atoi(s);
+        }
+
+        s = get_reply(NULL); // consume the trailing OK so it is not taken as the reply to the next command
+    }
+
+    return rssi;
+}
+
+#endif
+
+static void close_session (void *data)
+{
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Closed, 0);
+
+    // Keep the session attached while in the grace window.
+    if(!session_lost) {
+
+        if(session_stream) {
+            stream_disconnect(session_stream);
+            session_stream = NULL;
+        }
+
+        tx_lanes_flush();
     }
 
+    tx_flow_reset();
+#if ESP_AT_JOB_CACHE
+    tx_hold = false; // transparent mode may have been suspended by $ESPSTORE
+#endif
+
     at_cmd_stream.set_enqueue_rt_handler(stream_buffer_all);
 
     hal.delay_ms(20, NULL);
     at_cmd_stream.write("+++");
     hal.delay_ms(1000, NULL);
+    PLUGIN_STALL_DELAY(PluginStall_EspAt, 1020);
 
     if(send_command("AT+CIPMODE=0")) {
 
-        if(esp_at_settings.mode == WiFiMode_AP)
+        if(esp_at_settings.mode == WiFiMode_AP && !session_lost)
             send_command("AT+CWQIF"); // disconnect client
 
         task_add_delayed(await_connect, NULL, 100);
+#if ESP_AT_WATCHDOG_INTERVAL
+        watchdog_restart();
+#endif
 
         if(data)
             *((bool *)data) = true;
@@ -328,6 +1118,83 @@ static void close_session (void *data)
     at_cmd_stream.reset_read_buffer();
 }
 
+#if ESP_AT_SESSION_GRACE
+
+/*
+  When the client connection is lost the session stream is kept attached for ESP_AT_SESSION_GRACE ms,
+  output is buffered in the TX lanes. A client connecting from the same address within that time
+  is bound to the session and receives the buffered output. The session is ended early if output,
+  e.g. an ok, has to be dropped since the client would then lose track of the command stream.
+*/
+
+static void session_expired (void *data);
+
+static void session_end (void)
+{
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Expired, session_dropped);
+
+    task_delete(session_expired, NULL);
+    session_lost = session_dropped = false;
+    if(session_stream) {
+        stream_disconnect(session_stream);
+        session_stream = NULL;
+    }
+    tx_lanes_flush();
+}
+
+static void session_expired (void *data)
+{
+    if(rebinding)
+        task_add_delayed(session_expired, NULL, 50);
+    else if(session_lost)
+        session_end();
+}
+
+static void session_drop (void)
+{
+    if(!session_dropped) {
+        session_dropped = true;
+        if(!rebinding)
+            task_add_immediate(session_expired, NULL);
+    }
+}
+
+//
+// Gets the remote address of the client, returns false if not available
+//
+static bool get_peer (uint8_t *addr)
+{
+    bool ok = false;
+    char *s = get_reply("AT+CIPSTATUS"), *ip;
+
+    while(s && !is_done(s, NULL)) {
+
+        // +CIPSTATUS:<link ID>,<"type">,<"remote IP">,<remote port>,<local port>,<tetype>
+        if(!strncmp(s, "+CIPSTATUS:0,", 13) && (ip = strstr(s + 13, ",\"")))
+            ok = ip_parse(ip + 2, addr);
+
+        s = get_reply(NULL);
+    }
+
+    return ok;
+}
+
+static void connection_lost (void *data)
+{
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Lost, 0);
+
+    if(session_stream && !session_lost) {
+        session_lost = true;
+        task_add_delayed(session_expired, NULL, ESP_AT_SESSION_GRACE);
+    }
+
+    close_session(NULL);
+}
+
+#else
+#define connection_lost close_session
+#endif // ESP_AT_SESSION_GRACE
+
 static ISR_CODE bool ISR_FUNC(esp_at_receive)(char c)
 {
     static const char *cmds[] =
@@ -335,40 +1202,48 @@ static ISR_CODE bool ISR_FUNC(esp_at_receive)(char c)
         "",
         "CLOSED" ASCII_EOL,
         "+STA_DISCONNECTED:",
-        "WIFI DISCONNECT" ASCII_EOL
+        "WIFI DISCONNECT" ASCII_EOL,
+        "busy s..." ASCII_EOL
     };
     static const char *s = NULL;
     static uint32_t cmd = 0;
 
-    if(s == NULL && (c == 'C' || c == '+' || c == 'W')) {
-        cmd = c == 'C' ? 1 : (c == '+' ? 2 : 3);
-        s = cmds[cmd];
-        return true;
-    } else if(cmd) {
-
-        if(*s != '\0') {
-            if(c != *(++s)) {
-                if(*s) {
-                    const char *s2 = cmds[cmd];
-                    do {
-                        atStream_rx_insert(*s2++);
-                    } while(s2 != s);
-                    atStream_rx_insert(c);
-                    cmd = 0;
-                }
-            }
-        }
+    if(cmd) {
 
-        if(c == ASCII_LF) {
-            task_add_immediate(close_session, NULL);
+        if(*s != '\0' && c != *(++s) && *s != '\0') {
+            // Not a URC, pass the matched characters on and handle c as data below.
+            const char *s2 = cmds[cmd];
+            do {
+                atStream_rx_put(*s2++);
+            } while(s2 != s);
             cmd = 0;
             s = NULL;
+        } else {
+            if(c == ASCII_LF) {
+                if(cmd == 4)
+                    rx_signal(tx_busy, RxEvent_Busy);
+                else
+                    rx_signal(connection_lost, RxEvent_Closed);
+                cmd = 0;
+                s = NULL;
+            }
+            return true;
         }
+    }
 
+    // Token descriptor and payload bytes may have any value, do not look for URCs in them.
+    if(token_in_word()) {
+        atStream_rx_put(c);
+        return true;
+    }
+
+    if(s == NULL && (c == 'C' || c == '+' || c == 'W' || c == 'b')) {
+        cmd = c == 'C' ? 1 : (c == '+' ? 2 : (c == 'W' ? 3 : 4));
+        s = cmds[cmd];
         return true;
     }
 
-    atStream_rx_insert(c);
+    atStream_rx_put(c);
 
     if(c == ASCII_CR || c == ASCII_LF) {
         cmd = 0;
@@ -378,16 +1253,67 @@ static ISR_CODE bool ISR_FUNC(esp_at_receive)(char c)
     return true;
 }
 
+#if ESP_AT_DUAL_CORE
+
+static void rx_ring_events (void *data)
+{
+    uint_fast32_t events = (uintptr_t)data;
+
+#if ESP_AT_TOKENS
+    if(events & RxEvent_TokenAck)
+        token_ack(NULL);
+#endif
+
+    if(events & RxEvent_Busy)
+        tx_busy(NULL);
+
+    if(events & RxEvent_Closed)
+        connection_lost(NULL);
+}
+
+#endif // ESP_AT_DUAL_CORE
+
 static void await_connected (void *data)
 {
     // NOTE: ESP-AT sends an ASCII_CAN character following the > character,
     //       this is ok since it flushes the protocol line buffer.
     if(at_cmd_stream.read() == '>') {
         hal.stream.cancel_read_buffer();
+#if ESP_AT_TOKENS
+        token_negotiate();
+#endif
         at_cmd_stream.set_enqueue_rt_handler(esp_at_receive);
+#if ESP_AT_JOB_CACHE
+        tx_hold = false;
+#endif
+#if ESP_AT_SESSION_GRACE
+        FLIGHTREC(FlightRec_EspAt, rebinding ? FlightRecEsp_Rebound : FlightRecEsp_Connected, 0);
+        if(rebinding) {
+            rebinding = false;
+            if(session_dropped) { // output was dropped while rebinding, start a new session
+                const io_stream_t *stream = session_stream;
+                session_end();
+                if(stream_connect(stream))
+                    session_stream = stream;
+                else
+                    close_session(NULL);
+            } else {
+                session_lost = false;
+                task_delete(session_expired, NULL);
+                tx_pump(); // send buffered output
+            }
+        }
+#else
+        FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Connected, 0);
+#endif
         return;
     }
 
+#if ESP_AT_SESSION_GRACE
+    if(timeout == 1)
+        rebinding = false;
+#endif
+
     if(--timeout == 0)
         close_session(NULL);
     else
@@ -416,6 +1342,13 @@ static void await_connect (void *data)
 
     int16_t c;
 
+#if ESP_AT_JOB_CACHE
+    if(job_active) { // the AT command stream is owned by the job reader
+        task_add_delayed(await_connect, NULL, 200);
+        return;
+    }
+#endif
+
     if((c = at_cmd_stream.read()) != SERIAL_NO_DATA) {
 
         if(c == ASCII_LF) {
@@ -425,15 +1358,42 @@ static void await_connect (void *data)
 
             debug_printf("%s", buf);
 
+#if ESP_AT_WATCHDOG_INTERVAL
+            if(!strcmp(buf, "OK"))
+                watchdog_ok();
+#endif
+
             if(!strcmp(buf, "0,CONNECT")) {
+#if ESP_AT_WATCHDOG_INTERVAL
+                if(watchdog_pending()) {    // consume probe reply so it is not
+                    get_reply(NULL);        // taken as the reply to the next command
+                    watchdog_ok();
+                }
+#endif
+#if ESP_AT_REPORT_INTERVAL_MAX
+                rssi = esp_at_settings.mode == WiFiMode_AP ? 0 : get_rssi();
+#endif
+#if ESP_AT_SESSION_GRACE
+                uint8_t peer[4] = {0};
+                get_peer(peer);
+                if(session_lost && (session_dropped || !(peer[0] | peer[1] | peer[2] | peer[3]) || memcmp(peer, session_peer, sizeof(peer))))
+                    session_end(); // output was dropped or not the same client
+                memcpy(session_peer, peer, sizeof(peer));
+                rebinding = session_lost;
+#endif
                 if(send_command("AT+CIPMODE=1") &&
                     send_command("AT+CIPSEND") &&
-                     stream_connect(&telnet_stream)) {
+                     (session_lost || stream_connect(&telnet_stream))) {
+                    tx_flow_reset();
                     session_stream = &telnet_stream;
                     idx = 0;
                     timeout = 10;
                     task_add_delayed(await_connected, NULL, 2);
                 } // else disconnect!
+#if ESP_AT_SESSION_GRACE
+                else
+                    rebinding = false;
+#endif
                 return;
             }
         }
@@ -446,6 +1406,11 @@ static void await_connect (void *data)
         }
     }
 
+#if ESP_AT_WATCHDOG_INTERVAL
+    if(watchdog_check(idx != 0))
+        return; // ESP is being reset
+#endif
+
     task_add_delayed(await_connect, NULL, c == SERIAL_NO_DATA ? 200 : 2);
 }
 
@@ -509,21 +1474,8 @@ static bool start_sta (esp_at_wifi_settings_t *network)
         while(s) {
 
             if(!strncmp(s, "+CIPSTA:", 8)) {
-                if(!strncmp(s + 8, "ip:\"", 4)) {
-                    s += 12;
-                    *strchr(s, '"') = '\0';
-                    strcpy(ip, s);
-                }
-                if(!strncmp(s + 8, "gateway:\"", 9)) {
-                    s += 17;
-                    *strchr(s, '"') = '\0';
-                    strcpy(gateway, s);
-                }
-                if(!strncmp(s + 8, "netmask:\"", 9)) {
-                    s += 17;
-                    *strchr(s, '"') = '\0';
-                    strcpy(netmask, s);
-                }
+                if(!strncmp(s + 8, "ip:\"", 4))
+                    ip_parse(s + 12, ip);
             } else if(is_done(s, &ok))
                 break;
 
@@ -536,11 +1488,9 @@ static bool start_sta (esp_at_wifi_settings_t *network)
         s = get_reply("AT+CIPSTAMAC?");
         while(s) {
 
-            if(!strncmp(s, "+CIPSTAMAC:\"", 12)) {
-                s += 12;
-                *strchr(s, '"') = '\0';
-                strcpy(mac, s);
-            } else if(is_done(s, &ok))
+            if(!strncmp(s, "+CIPSTAMAC:\"", 12))
+                mac_parse(s + 12, mac);
+            else if(is_done(s, &ok))
                 break;
 
             s = get_reply(NULL);
@@ -582,21 +1532,8 @@ static bool start_ap (esp_at_wifi_settings_t *network)
         while(s) {
 
             if(!strncmp(s, "+CIPAP:", 7)) {
-                if(!strncmp(s + 7, "ip:\"", 4)) {
-                    s += 11;
-                    *strchr(s, '"') = '\0';
-                    strcpy(ip, s);
-                }
-                if(!strncmp(s + 7, "gateway:\"", 9)) {
-                    s += 16;
-                    *strchr(s, '"') = '\0';
-                    strcpy(gateway, s);
-                }
-                if(!strncmp(s + 7, "netmask:\"", 9)) {
-                    s += 16;
-                    *strchr(s, '"') = '\0';
-                    strcpy(netmask, s);
-                }
+                if(!strncmp(s + 7, "ip:\"", 4))
+                    ip_parse(s + 11, ip);
             } else if(is_done(s, &ok))
                 break;
 
@@ -610,11 +1547,9 @@ static bool start_ap (esp_at_wifi_settings_t *network)
         s = get_reply("AT+CIPAPMAC?");
         while(s) {
 
-            if(!strncmp(s, "+CIPAPMAC:\"", 11)) {
-                s += 11;
-                *strchr(s, '"') = '\0';
-                strcpy(mac, s);
-            } else if(is_done(s, &ok))
+            if(!strncmp(s, "+CIPAPMAC:\"", 11))
+                mac_parse(s + 11, mac);
+            else if(is_done(s, &ok))
                 break;
 
             s = get_reply(NULL);
@@ -629,13 +1564,17 @@ static void esp_at_initialize (void *data)
     char *s;
     bool ok;
 
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EspAtInitialize);
+
     if(!(ok = send_command("ATE0")))
         ok = send_command("ATE0");
 
     if(!(esp_at_running = ok)) {
         close_session(&esp_at_running);
-        if(!esp_at_running)
+        if(!esp_at_running) {
+            PLUGIN_PROF_BOOT_END(PluginBoot_EspAtInitialize);
             return;
+        }
     }
 
     send_command("AT+SYSMSG=4");
@@ -657,6 +1596,7 @@ static void esp_at_initialize (void *data)
     ok = !esp_at_running || send_command("AT+CIPSERVER=0,1");
 
     hal.delay_ms(10, 0);
+    PLUGIN_STALL_DELAY(PluginStall_EspAt, 10);
 
     if(ok) switch(esp_at_settings.mode) {
 
@@ -682,9 +1622,15 @@ static void esp_at_initialize (void *data)
         ok = ok && send_command("AT+CIPMUX=1");
         ok = ok && send_command("AT+CIPSERVERMAXCONN=1");
         sprintf(cmd, "AT+CIPSERVER=1,%d", esp_at_settings.telnet_port);
-        if((esp_at_running = ok && send_command(cmd)))
+        if((esp_at_running = ok && send_command(cmd))) {
             task_add_delayed(await_connect, NULL, 100);
+#if ESP_AT_WATCHDOG_INTERVAL
+            watchdog_restart();
+#endif
+        }
     }
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EspAtInitialize);
 }
 
 static bool get_ports (xbar_t *properties, uint8_t port, void *ports)
@@ -708,20 +1654,174 @@ static bool get_ports (xbar_t *properties, uint8_t port, void *ports)
 
 static void esp_at_startup (void *data)
 {
-    at_ports_t ports = { 0xFF, 0xFF };
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EspAtStartup);
 
     // Claim control ports and reset ESP-AT processor if ports available.
-    if(ioports_enumerate(Port_Digital, Port_Output, (pin_cap_t){ .output = On }, get_ports, (void *)&ports)) {
-        hal.port.digital_out(ports.boot0, 1);
-        hal.port.digital_out(ports.reset, 0);
+    if(ioports_enumerate(Port_Digital, Port_Output, (pin_cap_t){ .output = On }, get_ports, (void *)&at_ports)) {
+        hal.port.digital_out(at_ports.boot0, 1);
+        hal.port.digital_out(at_ports.reset, 0);
         hal.delay_ms(2, NULL);
-        hal.port.digital_out(ports.reset, 1);
-    }
+        PLUGIN_STALL_DELAY(PluginStall_EspAt, 2);
+        hal.port.digital_out(at_ports.reset, 1);
+    } else
+        at_ports.reset = at_ports.boot0 = 0xFF;
 
     // Allow ESP-AT processor time to boot.
     task_add_delayed(esp_at_initialize, NULL, 1500);
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EspAtStartup);
+}
+
+#if ESP_AT_WATCHDOG_INTERVAL
+
+/*
+  Liveness probe, AT is sent every ESP_AT_WATCHDOG_INTERVAL ms while waiting for a client to connect.
+  The ESP is reset and reinitialized after two consecutive probes are not answered with OK.
+  Reinitialization is deferred until the controller is idle.
+
+  While a client is connected the ESP cannot be probed, it is instead reset if output is pending in
+  the UART buffer and neither output has been accepted nor input received for ESP_AT_STALL_TIMEOUT ms.
+  This relies on the ESP stopping the UART via flow control or the SPI handshake when it hangs.
+*/
+
+#define ESP_AT_WATCHDOG_TIMEOUT 500 // ms
+
+static struct {
+    uint32_t next_ms;
+    uint32_t deadline;  // 0 when no probe outstanding
+    uint_fast8_t failures;
+} watchdog = {0};
+
+static void esp_at_reset (void *data);
+
+static void watchdog_restart (void)
+{
+    watchdog.deadline = 0;
+    watchdog.failures = 0;
+    watchdog.next_ms = hal.get_elapsed_ticks() + ESP_AT_WATCHDOG_INTERVAL;
+}
+
+static bool watchdog_pending (void)
+{
+    return watchdog.deadline != 0;
+}
+
+static void watchdog_ok (void)
+{
+    watchdog.deadline = 0;
+    watchdog.failures = 0;
+}
+
+// Returns true if a reset is started.
+static bool watchdog_check (bool line_pending)
+{
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    if(watchdog.deadline) {
+        if((int32_t)(ms - watchdog.deadline) >= 0) {
+            watchdog.deadline = 0;
+            if(++watchdog.failures >= 2) {
+                watchdog.failures = 0;
+                esp_at_reset(NULL);
+                return true;
+            }
+            watchdog.next_ms = ms; // probe again
+        }
+    } else if(!line_pending && (int32_t)(ms - watchdog.next_ms) >= 0) {
+        at_cmd_stream.write("AT" ASCII_EOL);
+        watchdog.deadline = (ms + ESP_AT_WATCHDOG_TIMEOUT) | 1;
+        watchdog.next_ms = ms + ESP_AT_WATCHDOG_INTERVAL;
+    }
+
+    return false;
+}
+
+#if ESP_AT_STALL_TIMEOUT
+
+static void session_stalled (void)
+{
+    at_cmd_stream.set_enqueue_rt_handler(stream_buffer_all);
+
+#if ESP_AT_SESSION_GRACE
+    rebinding = session_lost = session_dropped = false;
+    task_delete(session_expired, NULL);
+#endif
+#if ESP_AT_JOB_CACHE
+    tx_hold = false;
+#endif
+
+    if(session_stream) {
+        stream_disconnect(session_stream);
+        session_stream = NULL;
+    }
+
+    tx_lanes_flush();
+
+    esp_at_reset(NULL);
+}
+
+static void stall_check (void)
+{
+    static uint32_t last_ms = 0, last_sent = 0, last_rx = 0;
+
+    uint16_t count = at_cmd_stream.get_tx_buffer_count();
+    uint32_t ms = hal.get_elapsed_ticks(), sent = tx_pumped - count;
+
+    if(count == 0 || sent != last_sent || rx_count != last_rx) {
+        last_ms = ms;
+        last_sent = sent;
+        last_rx = rx_count;
+    } else if(ms - last_ms >= ESP_AT_STALL_TIMEOUT) {
+        last_ms = ms;
+        session_stalled();
+    }
+}
+
+#endif // ESP_AT_STALL_TIMEOUT
+
+static void esp_at_reinitialize (void *data)
+{
+    at_cmd_stream.reset_read_buffer();
+
+    esp_at_initialize(NULL);
+
+    if(esp_at_running)
+        watchdog_restart();
+    else
+        task_add_delayed(esp_at_reset, NULL, ESP_AT_WATCHDOG_INTERVAL);
+}
+
+static void esp_at_booted (void *data)
+{
+    plugin_defer(esp_at_reinitialize, NULL);
+}
+
+static void esp_at_reset_release (void *data)
+{
+    hal.port.digital_out(at_ports.reset, 1);
+
+    task_add_delayed(esp_at_booted, NULL, 1500);
 }
 
+static void esp_at_reset (void *data)
+{
+    esp_at_running = false;
+
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_Reset, 0);
+    protocol_enqueue_foreground_task(report_warning, "ESP-AT not responding, resetting!");
+
+    if(at_ports.reset != 0xFF) {
+        hal.port.digital_out(at_ports.boot0, 1);
+        hal.port.digital_out(at_ports.reset, 0);
+        task_add_delayed(esp_at_reset_release, NULL, 2);
+    } else {
+        at_cmd_stream.write("AT+RST" ASCII_EOL);
+        task_add_delayed(esp_at_booted, NULL, 1500);
+    }
+}
+
+#endif // ESP_AT_WATCHDOG_INTERVAL
+
 /*
 static bool is_setting_available (const setting_detail_t *setting)
 {
@@ -893,7 +1993,7 @@ static const setting_descr_t esp_at_settings_descr[] = {
 
 static void esp_at_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&esp_at_settings, sizeof(esp_at_settings_t), true);
+    plugin_nvs_write(nvs_address, &esp_at_settings, sizeof(esp_at_settings_t));
 }
 
 static void esp_at_settings_restore (void)
@@ -972,62 +2072,916 @@ static void esp_at_settings_load (void)
         esp_at_settings_restore();
 }
 
-static void report_options (bool newopt)
-{
-    on_report_options(newopt);
+/*
+  $ESPBENCH[=<kbytes>] - Wi-Fi link self test, must be issued from the telnet session.
 
-    if(!newopt) {
+  1. Controller sends [ESPBENCH:SEND|<n>], client sends n bytes of the repeating pattern A-Z.
+     The controller echoes [ESPBENCH:SUM|<offset>|<checksum>] every 1024 bytes,
+     the checksum is the 16-bit sum of the bytes received.
+  2. Controller sends ESP_AT_BENCH_PINGS lines [ESPBENCH:PING|<i>], client replies to each with a single line.
+  3. Controller reports [ESPBENCH:KBS:<rate>|BYTES:<received>|ERR:<pattern errors>|OVR:<overflows>|P50:<us>|P99:<us>].
+*/
 
-        if(*mac) {
-            hal.stream.write("[WIFI MAC:");
-            hal.stream.write(mac);
-            hal.stream.write("]" ASCII_EOL);
-        }
+#ifndef ESP_AT_BENCH_PINGS
+#define ESP_AT_BENCH_PINGS 100
+#endif
 
-        if(*ip) {
-            hal.stream.write("[IP:");
-            hal.stream.write(ip);
-            hal.stream.write("]" ASCII_EOL);
-        }
+#define ESP_AT_BENCH_TIMEOUT 2000 // ms
+
+static uint32_t bench_us (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
 
-        report_plugin(esp_at_running ? "ESP-AT" : "ESP-AT (disabled)", "0.04");
+// Returns next received character, SERIAL_NO_DATA on timeout or abort.
+static int16_t bench_getc (void)
+{
+    int16_t c;
+    uint32_t ms = hal.get_elapsed_ticks();
+
+    while((c = atStreamGetC()) == SERIAL_NO_DATA) {
+        if(!protocol_execute_realtime() || hal.get_elapsed_ticks() - ms > ESP_AT_BENCH_TIMEOUT)
+            break;
     }
+
+    return c;
 }
 
-void esp_at_init (void)
+static status_code_t esp_at_bench (sys_state_t state, char *args)
 {
-    static setting_details_t setting_details = {
-        .groups = esp_at_groups,
-        .n_groups = sizeof(esp_at_groups) / sizeof(setting_group_detail_t),
-        .settings = xesp_at_settings,
-        .n_settings = sizeof(xesp_at_settings) / sizeof(setting_detail_t),
-#ifndef NO_SETTINGS_DESCRIPTIONS
-        .descriptions = esp_at_settings_descr,
-        .n_descriptions = sizeof(esp_at_settings_descr) / sizeof(setting_descr_t),
-#endif
-        .save = esp_at_settings_save,
-        .load = esp_at_settings_load,
-        .restore = esp_at_settings_restore,
-    };
+    int16_t c;
+    uint16_t sum = 0;
+    uint32_t idx, i, j, n = 64 * 1024, received = 0, errors = 0, overflows = 0, start, elapsed, rate;
+    uint32_t rtt[ESP_AT_BENCH_PINGS], tmp;
 
-    bool ok;
-    io_stream_t const *stream = stream_open_instance(COPROC_STREAM, 115200, NULL, "ESP-AT");
-    if((ok = stream != NULL)) {
-        memcpy(&at_cmd_stream, stream, sizeof(io_stream_t));
-        at_cmd_stream.set_enqueue_rt_handler(stream_buffer_all);
+    if(session_stream == NULL || session_lost || hal.stream.type != StreamType_Telnet)
+        return Status_InvalidStatement;
+
+    if(args) {
+        if(!(isdigit(*args) && (n = strtoul(args, NULL, 10) * 1024) && n <= 1024 * 1024))
+            return Status_InvalidStatement;
     }
 
-    if(ok && (nvs_address = nvs_alloc(sizeof(esp_at_settings_t)))) {
+    atStreamRxFlush();
+    rxbuf.overflow = 0;
 
-        on_report_options = grbl.on_report_options;
-        grbl.on_report_options = report_options;
+    hal.stream.write("[ESPBENCH:SEND|");
+    hal.stream.write(uitoa(n));
+    hal.stream.write("]" ASCII_EOL);
 
-        settings_register(&setting_details);
+    // Throughput
 
-        protocol_enqueue_foreground_task(esp_at_startup, NULL);
+    if((c = bench_getc()) != SERIAL_NO_DATA) {
 
-    } else
-        protocol_enqueue_foreground_task(report_warning, "ESP-AT plugin failed to initialize!");
+        start = bench_us();
+
+        do {
+            if(c != 'A' + received % 26)
+                errors++;
+
+            sum += (uint8_t)c;
+
+            if(rxbuf.overflow) {
+                overflows++;
+                rxbuf.overflow = 0;
+            }
+
+            if(++received % 1024 == 0) {
+                hal.stream.write("[ESPBENCH:SUM|");
+                hal.stream.write(uitoa(received));
+                hal.stream.write("|");
+                hal.stream.write(uitoa(sum));
+                hal.stream.write("]" ASCII_EOL);
+            }
+        } while(received < n && (c = bench_getc()) != SERIAL_NO_DATA);
+
+        elapsed = bench_us() - start;
+    } else
+        elapsed = 0;
+
+    rate = elapsed ? (uint32_t)((uint64_t)received * 1000000 / 1024 / elapsed) : 0;
+
+    // Round-trip latency
+
+    atStreamRxFlush();
+
+    for(idx = 0; idx < ESP_AT_BENCH_PINGS; idx++) {
+
+        hal.stream.write("[ESPBENCH:PING|");
+        hal.stream.write(uitoa(idx));
+        hal.stream.write("]" ASCII_EOL);
+
+        start = bench_us();
+
+        while((c = bench_getc()) != SERIAL_NO_DATA && c != ASCII_LF);
+
+        if(c == SERIAL_NO_DATA)
+            break;
+
+        rtt[idx] = bench_us() - start;
+    }
+
+    // Insertion sort, n is small
+    for(i = 1; i < idx; i++) {
+        tmp = rtt[i];
+        for(j = i; j > 0 && rtt[j - 1] > tmp; j--)
+            rtt[j] = rtt[j - 1];
+        rtt[j] = tmp;
+    }
+
+    hal.stream.write("[ESPBENCH:KBS:");
+    hal.stream.write(uitoa(rate));
+    hal.stream.write("|BYTES:");
+    hal.stream.write(uitoa(received));
+    hal.stream.write("|ERR:");
+    hal.stream.write(uitoa(errors));
+    hal.stream.write("|OVR:");
+    hal.stream.write(uitoa(overflows));
+    if(idx) {
+        hal.stream.write("|P50:");
+        hal.stream.write(uitoa(rtt[idx / 2]));
+        hal.stream.write("|P99:");
+        hal.stream.write(uitoa(rtt[(idx * 99 - 1) / 100]));
+    }
+    hal.stream.write("]" ASCII_EOL);
+
+    return idx == ESP_AT_BENCH_PINGS ? Status_OK : Status_InvalidStatement;
+}
+
+#if ESP_AT_JOB_CACHE
+
+/*
+  Job cache, jobs are stored in the ESP filesystem with AT+FS and replayed from there over the serial link
+  without the sender and the Wi-Fi connection in the loop.
+
+  $ESPSTORE=<name>,<size>,<hash> - upload a job, must be issued from the telnet session.
+     <hash> is the FNV-1a hash of the job content as 8 hex digits.
+     If the cached copy has the same size and hash the controller replies [ESPSTORE:CACHED|<hash>].
+     Else the controller replies [ESPSTORE:SEND|<size>] and the client then sends <size> bytes of job content.
+     When received the controller replies [ESPSTORE:OK|<hash>], or [ESPSTORE:FAILED] if the upload or the hash check failed.
+  $ESPRUN=<name> - replay a cached job, the telnet session is closed if issued from it.
+     [ESPRUN:END|<name>|<bytes>] is reported when the whole job has been read, [ESPRUN:FAILED|<name>|<bytes>]
+     if reading failed. On failure the partial line is discarded and a feed hold is issued.
+
+  Transparent mode is suspended while uploading, the client data is buffered by the ESP in passive receive mode
+  and read in chunks that are written to flash. A sidecar file <name>.fnv holds the hash and size of a verified upload.
+*/
+
+#ifndef ESP_AT_JOB_CHUNK
+#define ESP_AT_JOB_CHUNK 256 // bytes per AT+FS read or write
+#endif
+
+#define ESP_AT_JOB_NAME_MAX 24
+#define ESP_AT_JOB_TIMEOUT 5000 // ms
+
+typedef enum {
+    Fetch_Idle = 0,
+    Fetch_Reply,        // awaiting +FS:<length>,
+    Fetch_Data,
+    Fetch_Ok,
+    Fetch_Failed
+} job_fetch_state_t;
+
+typedef struct {
+    bool tag_ok;
+    bool err_ok;
+    uint_fast16_t col;
+    int32_t value;
+} reply_match_t;
+
+static struct {
+    bool failed;
+    bool eol;               // last character returned was a LF
+    uint8_t buf;            // buffer being read from, the other buffer is prefetched
+    uint16_t head;
+    uint16_t count[2];
+    uint32_t size;
+    uint32_t offset;        // bytes fetched
+    uint32_t read;          // bytes read
+    struct {
+        job_fetch_state_t state;
+        uint8_t retries;
+        uint16_t length;
+        uint16_t idx;
+        uint32_t timeout;
+        reply_match_t reply;
+        char line[8];
+    } fetch;
+    char name[ESP_AT_JOB_NAME_MAX + 1];
+    char data[2][ESP_AT_JOB_CHUNK];
+} job = {0};
+
+static io_stream_t job_stream;
+static driver_reset_ptr driver_reset;
+
+static uint32_t job_hash (uint32_t hash, const char *data, uint16_t len)
+{
+    while(len--)
+        hash = (hash ^ (uint8_t)*data++) * 16777619UL;
+
+    return hash;
+}
+
+static char *job_hash_str (uint32_t hash)
+{
+    static const char hex[] = "0123456789ABCDEF";
+    static char s[9];
+
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < 8; idx++)
+        s[idx] = hex[(hash >> (28 - idx * 4)) & 0x0F];
+    s[8] = '\0';
+
+    return s;
+}
+
+static bool job_hash_parse (const char *s, uint32_t *hash)
+{
+    char c;
+    uint_fast8_t idx;
+
+    *hash = 0;
+
+    for(idx = 0; idx < 8; idx++) {
+        if(!isxdigit((unsigned char)(c = *s++)))
+            return false;
+        *hash = (*hash << 4) | (c <= '9' ? c - '0' : (c | 0x20) - 'a' + 10);
+    }
+
+    return true;
+}
+
+// Names are restricted to characters that are safe in quoted AT command arguments.
+static bool job_name_valid (const char *name)
+{
+    size_t len = strlen(name);
+
+    if(len == 0 || len > ESP_AT_JOB_NAME_MAX)
+        return false;
+
+    while(*name) {
+        if(!(isalnum((unsigned char)*name) || *name == '_' || *name == '-' || *name == '.'))
+            return false;
+        name++;
+    }
+
+    return true;
+}
+
+// Returns next character from the ESP, SERIAL_NO_DATA on timeout.
+static int16_t job_getc (uint32_t ms)
+{
+    int16_t c;
+    uint32_t timeout = hal.get_elapsed_ticks() + ms;
+
+    while((c = at_cmd_stream.read()) == SERIAL_NO_DATA && hal.get_elapsed_ticks() <= timeout);
+
+    return c;
+}
+
+//
+// Waits for a reply line starting with <tag><number> and returns the number, -1 on timeout or error.
+// The character following the number is returned in term, length prefixed data follows if it is ','.
+// Other lines, such as URCs, are skipped.
+//
+static void reply_match_init (reply_match_t *m)
+{
+    m->tag_ok = m->err_ok = true;
+    m->col = 0;
+    m->value = 0;
+}
+
+// Returns the number following the tag when the character terminating it is received in term,
+// -1 on an error reply and -2 while pending.
+static int32_t reply_match (reply_match_t *m, const char *tag, char c, char *term)
+{
+    uint_fast16_t len = strlen(tag);
+
+    if(c == ASCII_LF) {
+        reply_match_init(m);
+        return -2;
+    }
+
+    if(m->tag_ok) {
+        if(m->col < len)
+            m->tag_ok = c == tag[m->col];
+        else if(c >= '0' && c <= '9')
+            m->value = (m->col == len ? 0 : m->value) * 10 + c - '0';
+        else if(m->col > len) {
+            *term = c;
+            return m->value;
+        } else
+            m->tag_ok = false;
+    }
+
+    if(m->err_ok && (m->err_ok = m->col < 5 && c == "ERROR"[m->col]) && m->col == 4)
+        return -1;
+
+    m->col++;
+
+    return -2;
+}
+
+static int32_t job_await_reply (const char *tag, char *term)
+{
+    int16_t c;
+    int32_t value = -2;
+    reply_match_t reply;
+
+    reply_match_init(&reply);
+
+    while(value == -2 && (c = job_getc(ESP_AT_JOB_TIMEOUT)) != SERIAL_NO_DATA)
+        value = reply_match(&reply, tag, (char)c, term);
+
+    return value < 0 ? -1 : value;
+}
+
+static bool job_await_ok (void)
+{
+    bool ok = false;
+    char *s;
+
+    while((s = get_reply(NULL)) && !is_done(s, &ok));
+
+    return ok;
+}
+
+// Reads length prefixed data following a reply tag and the terminating OK, returns number of bytes read or -1 on error.
+static int32_t job_get_data (const char *tag, char *data, uint16_t len)
+{
+    char term;
+    int16_t c;
+    int32_t idx, n;
+
+    if((n = job_await_reply(tag, &term)) < 0 || term != ',' || n > len)
+        return -1;
+
+    for(idx = 0; idx < n; idx++) {
+        if((c = job_getc(1000)) == SERIAL_NO_DATA)
+            return -1;
+        data[idx] = (char)c;
+    }
+
+    return job_await_ok() ? n : -1;
+}
+
+static void fs_command (uint_fast8_t op, const char *name, bool sidecar, int32_t offset, uint16_t len)
+{
+    char cmd[ESP_AT_JOB_NAME_MAX + 36];
+
+    strcpy(cmd, "AT+FS=0,");
+    strcat(cmd, uitoa(op));
+    strcat(cmd, ",\"");
+    strcat(cmd, name);
+    if(sidecar)
+        strcat(cmd, ".fnv");
+    strcat(cmd, "\"");
+    if(offset >= 0) {
+        strcat(cmd, ",");
+        strcat(cmd, uitoa(offset));
+        strcat(cmd, ",");
+        strcat(cmd, uitoa(len));
+    }
+
+    debug_printf("%s", cmd);
+
+    at_cmd_stream.reset_read_buffer();
+    at_cmd_stream.write(cmd);
+    at_cmd_stream.write(ASCII_EOL);
+}
+
+static void fs_delete (const char *name, bool sidecar)
+{
+    fs_command(0, name, sidecar, -1, 0);
+    job_await_ok();
+}
+
+static bool fs_write (const char *name, bool sidecar, uint32_t offset, const char *data, uint16_t len)
+{
+    int16_t c;
+
+    fs_command(1, name, sidecar, offset, len);
+
+    while((c = job_getc(1000)) != SERIAL_NO_DATA && c != '>');
+
+    if(c == SERIAL_NO_DATA)
+        return false;
+
+    while(len--)
+        at_cmd_stream.write_char(*data++);
+
+    return job_await_ok();
+}
+
+static int32_t fs_read (const char *name, bool sidecar, uint32_t offset, char *data, uint16_t len)
+{
+    fs_command(2, name, sidecar, offset, len);
+
+    return job_get_data("+FS:", data, len);
+}
+
+// Returns file size, -1 if not found.
+static int32_t fs_size (const char *name, bool sidecar)
+{
+    char term;
+    int32_t size;
+
+    fs_command(3, name, sidecar, -1, 0);
+
+    return (size = job_await_reply("+FS:", &term)) >= 0 && job_await_ok() ? size : -1;
+}
+
+// Gets hash and size of the cached copy from the sidecar file.
+static bool job_cached (const char *name, uint32_t *hash, uint32_t *size)
+{
+    char data[20], *end;
+    int32_t n = fs_size(name, true);
+
+    if(n <= 9 || n >= sizeof(data) || fs_read(name, true, 0, data, n) != n)
+        return false;
+
+    data[n] = '\0';
+    *size = strtoul(data + 9, &end, 10);
+
+    return job_hash_parse(data, hash) && data[8] == ',' && end != data + 9;
+}
+
+// Reads client data buffered by the ESP in passive receive mode, returns number of bytes read or -1 if none available.
+static int32_t job_recv (char *data, uint16_t len)
+{
+    char cmd[24];
+
+    strcpy(cmd, "AT+CIPRECVDATA=0,");
+    strcat(cmd, uitoa(len));
+
+    at_cmd_stream.reset_read_buffer();
+    at_cmd_stream.write(cmd);
+    at_cmd_stream.write(ASCII_EOL);
+
+    return job_get_data("+CIPRECVDATA:", data, len);
+}
+
+// Sends a message to the client while transparent mode is suspended.
+static bool job_send (const char *s)
+{
+    char cmd[24], *reply;
+    int16_t c;
+
+    strcpy(cmd, "AT+CIPSEND=0,");
+    strcat(cmd, uitoa(strlen(s)));
+
+    at_cmd_stream.reset_read_buffer();
+    at_cmd_stream.write(cmd);
+    at_cmd_stream.write(ASCII_EOL);
+
+    while((c = job_getc(1000)) != SERIAL_NO_DATA && c != '>');
+
+    if(c == SERIAL_NO_DATA)
+        return false;
+
+    at_cmd_stream.write(s);
+
+    while((reply = get_reply(NULL)) && strcmp(reply, "SEND OK") && strcmp(reply, "SEND FAIL") && strncmp(reply, "ERROR", 5));
+
+    return reply && !strcmp(reply, "SEND OK");
+}
+
+// Leaves transparent mode keeping the session attached, output is held in the TX lanes.
+static bool passthrough_exit (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks() + 500;
+
+    while((tx_lanes[TxLane_Bulk].head != tx_lanes[TxLane_Bulk].tail ||
+            tx_lanes[TxLane_Priority].head != tx_lanes[TxLane_Priority].tail ||
+             at_cmd_stream.get_tx_buffer_count()) && hal.get_elapsed_ticks() <= ms)
+        tx_pump();
+
+    tx_hold = true;
+
+    at_cmd_stream.set_enqueue_rt_handler(stream_buffer_all);
+
+    hal.delay_ms(20, NULL);
+    at_cmd_stream.write("+++");
+    hal.delay_ms(1000, NULL);
+    PLUGIN_STALL_DELAY(PluginStall_EspAt, 1020);
+
+    return send_command("AT+CIPMODE=0");
+}
+
+static bool passthrough_enter (void)
+{
+    bool ok;
+
+    if((ok = send_command("AT+CIPMODE=1") && send_command("AT+CIPSEND") && job_getc(1000) == '>')) {
+        hal.delay_ms(2, NULL);
+        at_cmd_stream.reset_read_buffer(); // discard the ASCII_CAN following the prompt
+        at_cmd_stream.set_enqueue_rt_handler(esp_at_receive);
+        tx_flow_reset();
+        tx_hold = false;
+        tx_pump();
+    }
+
+    return ok;
+}
+
+static status_code_t esp_at_store (sys_state_t state, char *args)
+{
+    bool ok, cached = false;
+    char *s, msg[32];
+    int32_t n;
+    uint32_t size, hash, cached_hash, cached_size, offset = 0, fnv = 2166136261UL, ms;
+
+    if(session_stream == NULL || session_lost || hal.stream.type != StreamType_Telnet)
+        return Status_InvalidStatement;
+
+    if(state != STATE_IDLE || job_active)
+        return Status_IdleError;
+
+    if(!(args && (s = strchr(args, ','))))
+        return Status_InvalidStatement;
+
+    *s++ = '\0';
+
+    if(!(job_name_valid(args) && isdigit((unsigned char)*s) && (size = strtoul(s, &s, 10)) && *s++ == ',' && job_hash_parse(s, &hash) && s[8] == '\0'))
+        return Status_InvalidStatement;
+
+    if((ok = passthrough_exit()) &&
+         !(cached = job_cached(args, &cached_hash, &cached_size) && cached_hash == hash && cached_size == size)) {
+
+        fs_delete(args, true);
+        fs_delete(args, false);
+
+        strcpy(msg, "[ESPSTORE:SEND|");
+        strcat(msg, uitoa(size));
+        strcat(msg, "]" ASCII_EOL);
+
+        if((ok = send_command("AT+CIPRECVMODE=1") && job_send(msg))) {
+
+            ms = hal.get_elapsed_ticks();
+
+            while(ok && offset < size) {
+                if((n = job_recv(job.data[0], min(size - offset, ESP_AT_JOB_CHUNK))) > 0) {
+                    fnv = job_hash(fnv, job.data[0], n);
+                    ok = fs_write(args, false, offset, job.data[0], n);
+                    offset += n;
+                    ms = hal.get_elapsed_ticks();
+                } else if(hal.get_elapsed_ticks() - ms > ESP_AT_JOB_TIMEOUT)
+                    ok = false;
+                else
+                    hal.delay_ms(5, NULL);
+
+                if(!protocol_execute_realtime())
+                    ok = false;
+            }
+
+            send_command("AT+CIPRECVMODE=0");
+        }
+
+        if((ok = ok && fnv == hash)) {
+            strcpy(msg, job_hash_str(hash));
+            strcat(msg, ",");
+            strcat(msg, uitoa(size));
+            ok = fs_write(args, true, 0, msg, strlen(msg));
+        } else
+            fs_delete(args, false);
+
+        FLIGHTREC(FlightRec_EspAt, FlightRecEsp_JobStored, ok);
+    }
+
+    if(!passthrough_enter()) {
+        connection_lost(NULL);
+        return Status_OK;
+    }
+
+    if(ok) {
+        hal.stream.write(cached ? "[ESPSTORE:CACHED|" : "[ESPSTORE:OK|");
+        hal.stream.write(job_hash_str(hash));
+        hal.stream.write("]" ASCII_EOL);
+    } else
+        hal.stream.write("[ESPSTORE:FAILED]" ASCII_EOL);
+
+    return ok ? Status_OK : Status_FileReadError;
+}
+
+static void job_report (void *data)
+{
+    stream_disconnect(&job_stream);
+
+    hal.stream.write(job.failed ? "[ESPRUN:FAILED|" : "[ESPRUN:END|");
+    hal.stream.write(job.name);
+    hal.stream.write("|");
+    hal.stream.write(uitoa(job.read));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static void job_end (bool failed)
+{
+    if(!job_active)
+        return;
+
+    job.failed = failed;
+    job_active = false;
+
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_JobEnd, failed);
+
+    task_add_immediate(job_report, NULL);
+}
+
+/*
+  Chunks are fetched by a foreground task polling the AT command stream so that the protocol loop is
+  not blocked while waiting for the ESP. The next chunk is fetched while the current chunk is read.
+*/
+
+static void job_fetch (void *data);
+
+static void job_fetch_start (void)
+{
+    uint8_t buf = job.buf ^ 1;
+
+    if(job.fetch.state == Fetch_Idle && job.count[buf] == 0 && job.offset < job.size) {
+        job.fetch.retries = 2;
+        job.fetch.length = min(job.size - job.offset, ESP_AT_JOB_CHUNK);
+        job.fetch.state = Fetch_Reply;
+        job.fetch.timeout = hal.get_elapsed_ticks() + ESP_AT_JOB_TIMEOUT;
+        reply_match_init(&job.fetch.reply);
+        fs_command(2, job.name, false, job.offset, job.fetch.length);
+        task_add_delayed(job_fetch, NULL, 1);
+    }
+}
+
+static void job_fetch_error (void)
+{
+    if(job.fetch.retries--) {
+        job.fetch.state = Fetch_Reply;
+        job.fetch.timeout = hal.get_elapsed_ticks() + ESP_AT_JOB_TIMEOUT;
+        reply_match_init(&job.fetch.reply);
+        fs_command(2, job.name, false, job.offset, job.fetch.length);
+    } else
+        job.fetch.state = Fetch_Failed;
+}
+
+static void job_fetch (void *data)
+{
+    char term;
+    int16_t c;
+    int32_t value;
+    uint8_t buf = job.buf ^ 1;
+
+    if(!job_active)
+        return;
+
+    while(job.fetch.state > Fetch_Idle && job.fetch.state < Fetch_Failed && (c = at_cmd_stream.read()) != SERIAL_NO_DATA) {
+
+        switch(job.fetch.state) {
+
+            case Fetch_Reply:
+                if((value = reply_match(&job.fetch.reply, "+FS:", (char)c, &term)) == -1 ||
+                     (value >= 0 && (term != ',' || value == 0 || value > job.fetch.length)))
+                    job_fetch_error();
+                else if(value > 0) {
+                    job.fetch.length = (uint16_t)value;
+                    job.fetch.idx = 0;
+                    job.fetch.state = Fetch_Data;
+                }
+                break;
+
+            case Fetch_Data:
+                job.data[buf][job.fetch.idx++] = (char)c;
+                if(job.fetch.idx == job.fetch.length) {
+                    job.fetch.idx = 0;
+                    job.fetch.state = Fetch_Ok;
+                }
+                break;
+
+            case Fetch_Ok:
+                if(c == ASCII_LF) {
+                    job.fetch.line[job.fetch.idx] = '\0';
+                    job.fetch.idx = 0;
+                    if(!strcmp(job.fetch.line, "OK")) {
+                        job.offset += job.fetch.length;
+                        job.count[buf] = job.fetch.length;
+                        job.fetch.state = Fetch_Idle;
+                    } else if(!strncmp(job.fetch.line, "ERROR", 5))
+                        job_fetch_error();
+                } else if(c != ASCII_CR && job.fetch.idx < sizeof(job.fetch.line) - 1)
+                    job.fetch.line[job.fetch.idx++] = (char)c;
+                break;
+
+            default:
+                break;
+        }
+    }
+
+    if(job.fetch.state > Fetch_Idle && job.fetch.state < Fetch_Failed && hal.get_elapsed_ticks() > job.fetch.timeout)
+        job_fetch_error();
+
+    if(job.fetch.state > Fetch_Idle && job.fetch.state < Fetch_Failed)
+        task_add_delayed(job_fetch, NULL, 1);
+}
+
+static int16_t job_read (void)
+{
+    if(!job_active)
+        return SERIAL_NO_DATA;
+
+    if(job.head == job.count[job.buf]) {
+
+        if(job.count[job.buf ^ 1]) {
+            job.count[job.buf] = 0;
+            job.buf ^= 1;
+            job.head = 0;
+            job_fetch_start();
+        } else if(job.fetch.state == Fetch_Failed) {
+            // Discard the partial line and stop motion.
+            protocol_enqueue_realtime_command(CMD_FEED_HOLD);
+            job_end(true);
+            return ASCII_CAN;
+        } else if(job.offset == job.size) {
+            job_end(false);
+            return job.eol ? SERIAL_NO_DATA : ASCII_LF;
+        } else
+            return SERIAL_NO_DATA; // next chunk not yet fetched
+    }
+
+    job.read++;
+    job.eol = job.data[job.buf][job.head] == ASCII_LF;
+
+    return (int16_t)(uint8_t)job.data[job.buf][job.head++];
+}
+
+static status_code_t esp_at_run (sys_state_t state, char *args)
+{
+    int32_t size;
+
+    if(state != STATE_IDLE || job_active)
+        return Status_IdleError;
+
+    if(!(args && job_name_valid(args)) || session_lost)
+        return Status_InvalidStatement;
+
+    if(session_stream) {
+        close_session(NULL);
+        send_command("AT+CIPCLOSE=0");
+    }
+
+    if((size = fs_size(args, false)) <= 0)
+        return Status_FileNotFound;
+
+    strcpy(job.name, args);
+    job.size = (uint32_t)size;
+    job.offset = job.read = job.head = job.count[0] = job.count[1] = 0;
+    job.buf = 1;
+    job.eol = true;
+    job.fetch.state = Fetch_Idle;
+
+    // The job is replayed as a stream of its own so that read wrappers attached
+    // via on_stream_changed are attached on top of job_read.
+    memcpy(&job_stream, &hal.stream, sizeof(io_stream_t));
+    job_stream.type = StreamType_File;
+    job_stream.read = job_read;
+
+    if(!(job_active = stream_connect(&job_stream)))
+        return Status_InvalidStatement;
+
+    job_fetch_start();
+
+    FLIGHTREC(FlightRec_EspAt, FlightRecEsp_JobRun, 0);
+
+    return Status_OK;
+}
+
+static void esp_at_driver_reset (void)
+{
+    if(job_active)
+        job_end(true);
+
+    driver_reset();
+}
+
+#endif // ESP_AT_JOB_CACHE
+
+static const sys_command_t esp_at_command_list[] = {
+    {"ESPBENCH", esp_at_bench, {}, { .str = "run Wi-Fi throughput and latency test, $ESPBENCH=<kbytes>" } },
+#if ESP_AT_JOB_CACHE
+    {"ESPSTORE", esp_at_store, {}, { .str = "upload job to ESP flash, $ESPSTORE=<name>,<size>,<hash>" } },
+    {"ESPRUN", esp_at_run, {}, { .str = "run job from ESP flash, $ESPRUN=<name>" } },
+#endif
+};
+
+static sys_commands_t esp_at_commands = {
+    .n_commands = sizeof(esp_at_command_list) / sizeof(sys_command_t),
+    .commands = esp_at_command_list
+};
+
+static void report_options (bool newopt)
+{
+    on_report_options(newopt);
+
+    if(!newopt) {
+
+        char addr[18];
+
+        if(mac[0] | mac[1] | mac[2] | mac[3] | mac[4] | mac[5]) {
+            sprintf(addr, "%02x:%02x:%02x:%02x:%02x:%02x", mac[0], mac[1], mac[2], mac[3], mac[4], mac[5]);
+            hal.stream.write("[WIFI MAC:");
+            hal.stream.write(addr);
+            hal.stream.write("]" ASCII_EOL);
+        }
+
+        if(ip[0] | ip[1] | ip[2] | ip[3]) {
+            sprintf(addr, "%d.%d.%d.%d", ip[0], ip[1], ip[2], ip[3]);
+            hal.stream.write("[IP:");
+            hal.stream.write(addr);
+            hal.stream.write("]" ASCII_EOL);
+        }
+
+        report_plugin(esp_at_running ? "ESP-AT" : "ESP-AT (disabled)", "0.09");
+    }
+}
+
+static void esp_at_execute_realtime (sys_state_t state)
+{
+#if ESP_AT_DUAL_CORE
+    rx_ring_drain();
+#endif
+
+    if(session_stream) {
+        tx_pump();
+#if ESP_AT_WATCHDOG_INTERVAL && ESP_AT_STALL_TIMEOUT
+        if(esp_at_running && !session_lost)
+            stall_check();
+#endif
+    }
+
+    on_execute_realtime(state);
+}
+
+void esp_at_init (void)
+{
+    static setting_details_t setting_details = {
+        .groups = esp_at_groups,
+        .n_groups = sizeof(esp_at_groups) / sizeof(setting_group_detail_t),
+        .settings = xesp_at_settings,
+        .n_settings = sizeof(xesp_at_settings) / sizeof(setting_detail_t),
+#ifndef NO_SETTINGS_DESCRIPTIONS
+        .descriptions = esp_at_settings_descr,
+        .n_descriptions = sizeof(esp_at_settings_descr) / sizeof(setting_descr_t),
+#endif
+        .save = esp_at_settings_save,
+        .load = esp_at_settings_load,
+        .restore = esp_at_settings_restore,
+    };
+
+    static plugin_nvs_block_t nvs_block = {
+        .id = PluginNVS_EspAt,
+        .size = sizeof(esp_at_settings_t),
+        .address = &nvs_address,
+        .load = esp_at_settings_load
+    };
+
+    bool ok;
+
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EspAtInit);
+
+#if ESP_AT_TRANSPORT == ESP_AT_TRANSPORT_SPI
+#if ESP_AT_SPI_MOCK
+    io_stream_t const *stream = esp_at_spi_open(esp_at_spi_mock());
+#else
+    io_stream_t const *stream = esp_at_spi_open(NULL);
+#endif
+#else
+    io_stream_t const *stream = stream_open_instance(COPROC_STREAM, 115200, NULL, "ESP-AT");
+#endif
+    if((ok = stream != NULL)) {
+        memcpy(&at_cmd_stream, stream, sizeof(io_stream_t));
+        at_cmd_stream.set_enqueue_rt_handler(stream_buffer_all);
+    }
+
+    if(ok && (nvs_address = nvs_alloc(sizeof(esp_at_settings_t)))) {
+
+        on_report_options = grbl.on_report_options;
+        grbl.on_report_options = report_options;
+
+        on_execute_realtime = grbl.on_execute_realtime;
+        grbl.on_execute_realtime = esp_at_execute_realtime;
+
+#if ESP_AT_JOB_CACHE
+        driver_reset = hal.driver_reset;
+        hal.driver_reset = esp_at_driver_reset;
+#endif
+
+        settings_register(&setting_details);
+        system_register_commands(&esp_at_commands);
+        plugin_nvs_register(&nvs_block);
+
+        // WiFi is not needed for the controller to become ready, start it when idle.
+        plugin_defer(esp_at_startup, NULL);
+
+    } else
+        protocol_enqueue_foreground_task(report_warning, "ESP-AT plugin failed to initialize!");
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EspAtInit);
 }
 
 #endif
@@ -0,0 +1,483 @@
+/*
+
+  esp_at_spi.c - SPI transport for the ESP-AT plugin
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Implements the half duplex ESP-AT SPI protocol. Every transaction starts with
+  a command byte, an address byte and a dummy byte followed by data:
+
+  Master to slave: WR_BUF request {0xFE, seq, len} -> handshake asserted, RD_BUF status is writable
+                   -> WR_DMA data -> WR_DONE.
+  Slave to master: handshake asserted, RD_BUF status is readable {0x01, seq, len} -> RD_DMA data -> RD_DONE.
+
+  The transport is polled every ms and when reading from an empty or writing to a full buffer.
+
+  With ESP_AT_SPI_MOCK enabled a simulated peer is provided, it follows the slave side of the protocol
+  and answers each line received with OK. It can be used to test the transport and the plugin on a
+  controller without an ESP connected.
+
+  Dependencies:
+
+  Driver support for SPI, spi.h, a free aux output port for chip select and a free aux input port
+  for the handshake line.
+
+*/
+
+#include "driver.h"
+
+#include "esp_at_spi.h"
+
+#if ESP_AT_ENABLE == 1 && ESP_AT_TRANSPORT == ESP_AT_TRANSPORT_SPI
+
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/task.h"
+#include "grbl/protocol.h"
+
+#include "spi.h"
+
+#define SPI_WR_BUF      0x01
+#define SPI_RD_BUF      0x02
+#define SPI_WR_DMA      0x03
+#define SPI_RD_DMA      0x04
+#define SPI_WR_DONE     0x07
+#define SPI_RD_DONE     0x08
+
+#define SPI_STATUS_ADDR 0x04
+#define SPI_REQUEST     0xFE
+#define SPI_READABLE    0x01
+#define SPI_WRITABLE    0x02
+#define SPI_TIMEOUT     100 // ms to wait for the slave to accept a write request
+
+typedef struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t tail;
+    char data[ESP_AT_SPI_TX_BUFFER_SIZE];
+} spi_tx_buffer_t;
+
+static struct {
+    const esp_at_spi_port_t *port;
+    bool busy;
+    uint8_t seq;            // sequence number of last write request
+    uint16_t requested;     // number of bytes in pending write request, 0 if none
+    uint32_t request_ms;
+} spi = {0};
+
+static uint8_t cs_port = ESP_AT_SPI_CS_PORT, hs_port = ESP_AT_SPI_HANDSHAKE_PORT;
+static spi_tx_buffer_t txbuf = {0};
+static stream_rx_buffer_t rxbuf = {0};
+static enqueue_realtime_command_ptr enqueue_realtime_command = stream_buffer_all;
+
+// Driver SPI port
+
+static void port_select (bool on)
+{
+    hal.port.digital_out(cs_port, !on);
+}
+
+static uint8_t port_transfer (uint8_t byte)
+{
+    return spi_put_byte(byte);
+}
+
+static bool port_handshake (void)
+{
+    return hal.port.wait_on_input(Port_Digital, hs_port, WaitMode_Immediate, 0.0f) == 1;
+}
+
+static const esp_at_spi_port_t driver_port = {
+    .select = port_select,
+    .transfer = port_transfer,
+    .handshake = port_handshake
+};
+
+// Protocol
+
+static void spi_begin (uint8_t cmd, uint8_t addr)
+{
+    spi.port->select(true);
+    spi.port->transfer(cmd);
+    spi.port->transfer(addr);
+    spi.port->transfer(0); // dummy
+}
+
+static void spi_command (uint8_t cmd, uint8_t *data, uint8_t length)
+{
+    spi_begin(cmd, 0);
+    while(length--)
+        spi.port->transfer(*data++);
+    spi.port->select(false);
+}
+
+static void spi_request_write (void)
+{
+    uint16_t length = BUFCOUNT(txbuf.head, txbuf.tail, ESP_AT_SPI_TX_BUFFER_SIZE);
+    uint8_t request[4];
+
+    if(length > ESP_AT_SPI_CHUNK_SIZE)
+        length = ESP_AT_SPI_CHUNK_SIZE;
+
+    request[0] = SPI_REQUEST;
+    request[1] = ++spi.seq;
+    request[2] = length & 0xFF;
+    request[3] = length >> 8;
+
+    spi_command(SPI_WR_BUF, request, sizeof(request));
+
+    spi.requested = length;
+    spi.request_ms = hal.get_elapsed_ticks();
+}
+
+static void spi_transmit (void)
+{
+    uint_fast16_t tail = txbuf.tail;
+
+    spi_begin(SPI_WR_DMA, 0);
+    while(spi.requested) {
+        spi.port->transfer((uint8_t)txbuf.data[tail]);
+        tail = BUFNEXT(tail, txbuf);
+        spi.requested--;
+    }
+    spi.port->select(false);
+
+    txbuf.tail = tail;
+
+    spi_command(SPI_WR_DONE, NULL, 0);
+}
+
+static void spi_receive (uint16_t length)
+{
+    char c;
+    uint_fast16_t next_head;
+
+    spi_begin(SPI_RD_DMA, 0);
+    while(length--) {
+        c = (char)spi.port->transfer(0);
+        if(!enqueue_realtime_command(c)) {                  // Check and strip realtime commands...
+            next_head = BUFNEXT(rxbuf.head, rxbuf);         // Get and increment buffer pointer
+            if(next_head == rxbuf.tail)                     // If buffer full
+                rxbuf.overflow = 1;                         // flag overflow
+            else {
+                rxbuf.data[rxbuf.head] = c;                 // if not add data to buffer
+                rxbuf.head = next_head;                     // and update pointer
+            }
+        }
+    }
+    spi.port->select(false);
+
+    spi_command(SPI_RD_DONE, NULL, 0);
+}
+
+static void spi_poll (void *data)
+{
+    uint8_t status[4];
+
+    if(spi.busy)
+        return;
+
+    spi.busy = true;
+
+    if(spi.port->handshake()) {
+
+        spi_begin(SPI_RD_BUF, SPI_STATUS_ADDR);
+        status[0] = spi.port->transfer(0);
+        status[1] = spi.port->transfer(0);
+        status[2] = spi.port->transfer(0);
+        status[3] = spi.port->transfer(0);
+        spi.port->select(false);
+
+        if(status[0] == SPI_READABLE)
+            spi_receive(status[2] | (status[3] << 8));
+        else if(status[0] == SPI_WRITABLE && spi.requested)
+            spi_transmit();
+
+    } else if(spi.requested && hal.get_elapsed_ticks() - spi.request_ms > SPI_TIMEOUT)
+        spi.requested = 0; // no response, issue a new request
+
+    if(!spi.requested && txbuf.head != txbuf.tail)
+        spi_request_write();
+
+    spi.busy = false;
+}
+
+// Stream
+
+static int16_t spiStreamGetC (void)
+{
+    if(rxbuf.tail == rxbuf.head)
+        spi_poll(NULL);
+
+    uint_fast16_t tail = rxbuf.tail;    // Get buffer pointer
+
+    if(tail == rxbuf.head)
+        return SERIAL_NO_DATA; // no data available
+
+    char data = rxbuf.data[tail];       // Get next character
+    rxbuf.tail = BUFNEXT(tail, rxbuf);  // and update pointer
+
+    return (int16_t)data;
+}
+
+//
+// Writes a character to the output buffer, blocks if buffer full
+//
+static bool spiStreamPutC (const char c)
+{
+    uint_fast16_t next_head = BUFNEXT(txbuf.head, txbuf);
+
+    while(next_head == txbuf.tail) {
+        if(spi.busy)                    // Called from the receive path,
+            return false;               // cannot wait for the buffer to drain.
+        spi_poll(NULL);
+    }
+
+    txbuf.data[txbuf.head] = c;
+    txbuf.head = next_head;
+
+    return true;
+}
+
+static void spiStreamWriteS (const char *s)
+{
+    char c, *ptr = (char *)s;
+
+    while((c = *ptr++) != '\0')
+        spiStreamPutC(c);
+}
+
+static void spiStreamWrite (const char *s, uint16_t length)
+{
+    char *ptr = (char *)s;
+
+    while(length--)
+        spiStreamPutC(*ptr++);
+}
+
+static uint16_t spiStreamRxFree (void)
+{
+    uint16_t tail = rxbuf.tail, head = rxbuf.head;
+
+    return RX_BUFFER_SIZE - BUFCOUNT(head, tail, RX_BUFFER_SIZE);
+}
+
+static uint16_t spiStreamTxCount (void)
+{
+    uint16_t tail = txbuf.tail, head = txbuf.head;
+
+    return BUFCOUNT(head, tail, ESP_AT_SPI_TX_BUFFER_SIZE);
+}
+
+static void spiStreamRxFlush (void)
+{
+    rxbuf.tail = rxbuf.head;
+}
+
+static void spiStreamRxCancel (void)
+{
+    rxbuf.data[rxbuf.head] = ASCII_CAN;
+    rxbuf.tail = rxbuf.head;
+    rxbuf.head = BUFNEXT(rxbuf.head, rxbuf);
+}
+
+// Only data not yet announced to the slave can be discarded.
+static void spiStreamTxFlush (void)
+{
+    uint_fast16_t tail = txbuf.tail, count = spi.requested;
+
+    while(count--)
+        tail = BUFNEXT(tail, txbuf);
+
+    txbuf.head = tail;
+}
+
+static bool spiStreamSuspendInput (bool suspend)
+{
+    return stream_rx_suspend(&rxbuf, suspend);
+}
+
+static bool spiStreamEnqueueRtCommand (char c)
+{
+    return enqueue_realtime_command(c);
+}
+
+static enqueue_realtime_command_ptr spiStreamSetRtHandler (enqueue_realtime_command_ptr handler)
+{
+    enqueue_realtime_command_ptr prev = enqueue_realtime_command;
+
+    if(handler)
+        enqueue_realtime_command = handler;
+
+    return prev;
+}
+
+const io_stream_t *esp_at_spi_open (const esp_at_spi_port_t *port)
+{
+    static const io_stream_t stream = {
+        .type = StreamType_Serial,
+        .is_connected = stream_connected,
+        .read = spiStreamGetC,
+        .write = spiStreamWriteS,
+        .write_n = spiStreamWrite,
+        .write_char = spiStreamPutC,
+        .enqueue_rt_command = spiStreamEnqueueRtCommand,
+        .get_rx_buffer_free = spiStreamRxFree,
+        .get_tx_buffer_count = spiStreamTxCount,
+        .reset_read_buffer = spiStreamRxFlush,
+        .cancel_read_buffer = spiStreamRxCancel,
+        .reset_write_buffer = spiStreamTxFlush,
+        .suspend_read = spiStreamSuspendInput,
+        .set_enqueue_rt_handler = spiStreamSetRtHandler
+    };
+
+    if(port == NULL) {
+
+        if(!(ioport_claim(Port_Digital, Port_Output, &cs_port, "ESP-AT SPI CS") &&
+              ioport_claim(Port_Digital, Port_Input, &hs_port, "ESP-AT SPI handshake")))
+            return NULL;
+
+        spi_init();
+        hal.port.digital_out(cs_port, 1);
+        port = &driver_port;
+    }
+
+    spi.port = port;
+
+    return task_add_systick(spi_poll, NULL) ? &stream : NULL;
+}
+
+#if ESP_AT_SPI_MOCK
+
+// Simulated peer
+
+static struct {
+    bool selected;
+    uint8_t cmd;
+    uint_fast16_t idx;          // byte index in current transaction
+    uint8_t request[4];         // last write request
+    uint16_t writable;          // number of bytes granted to the master, 0 if none
+    uint16_t readable;          // number of bytes announced to the master, 0 if none
+    uint8_t seq;
+    uint_fast16_t line_len;
+    char line[64];
+    uint_fast16_t head, tail;
+    char reply[256];
+} mock = {0};
+
+static void mock_reply (const char *s)
+{
+    while(*s) {
+        mock.reply[mock.head] = *s++;
+        mock.head = (mock.head + 1) & (sizeof(mock.reply) - 1);
+    }
+}
+
+static void mock_line (char c)
+{
+    if(c == ASCII_LF) {
+        if(mock.line_len >= 2 && mock.line[0] == 'A' && mock.line[1] == 'T')
+            mock_reply(ASCII_EOL "OK" ASCII_EOL);
+        mock.line_len = 0;
+    } else if(c != ASCII_CR && mock.line_len < sizeof(mock.line))
+        mock.line[mock.line_len++] = c;
+}
+
+static void mock_select (bool on)
+{
+    if(on) {
+        mock.selected = true;
+        mock.idx = 0;
+    } else if(mock.selected) {
+        mock.selected = false;
+        switch(mock.cmd) {
+
+            case SPI_WR_BUF:
+                if(mock.idx == 7 && mock.request[0] == SPI_REQUEST) {
+                    mock.seq = mock.request[1];
+                    mock.writable = mock.request[2] | (mock.request[3] << 8);
+                }
+                break;
+
+            case SPI_WR_DONE:
+                mock.writable = 0;
+                break;
+
+            case SPI_RD_DONE:
+                mock.readable = 0;
+                break;
+        }
+    }
+}
+
+static uint8_t mock_transfer (uint8_t byte)
+{
+    uint8_t out = 0;
+    uint_fast16_t idx = mock.idx++;
+
+    if(!mock.selected)
+        return 0;
+
+    if(idx == 0)
+        mock.cmd = byte;
+    else if(idx >= 3) {
+
+        idx -= 3;
+
+        switch(mock.cmd) {
+
+            case SPI_WR_BUF:
+                if(idx < sizeof(mock.request))
+                    mock.request[idx] = byte;
+                break;
+
+            case SPI_RD_BUF:
+                if(mock.writable)
+                    out = idx == 0 ? SPI_WRITABLE : (idx == 1 ? mock.seq : 0);
+                else {
+                    if(idx == 0 && !mock.readable)
+                        mock.readable = (mock.head - mock.tail) & (sizeof(mock.reply) - 1);
+                    out = idx == 0 ? SPI_READABLE : (idx == 2 ? mock.readable & 0xFF : (idx == 3 ? mock.readable >> 8 : 0));
+                }
+                break;
+
+            case SPI_WR_DMA:
+                if(idx < mock.writable)
+                    mock_line((char)byte);
+                break;
+
+            case SPI_RD_DMA:
+                if(idx < mock.readable && mock.tail != mock.head) {
+                    out = (uint8_t)mock.reply[mock.tail];
+                    mock.tail = (mock.tail + 1) & (sizeof(mock.reply) - 1);
+                }
+                break;
+        }
+    }
+
+    return out;
+}
+
+static bool mock_handshake (void)
+{
+    return mock.writable || mock.readable || mock.head != mock.tail;
+}
+
+const esp_at_spi_port_t *esp_at_spi_mock (void)
+{
+    static const esp_at_spi_port_t mock_port = {
+        .select = mock_select,
+        .transfer = mock_transfer,
+        .handshake = mock_handshake
+    };
+
+    memset(&mock, 0, sizeof(mock));
+
+    return &mock_port;
+}
+
+#endif // ESP_AT_SPI_MOCK
+
+#endif // ESP_AT_TRANSPORT == ESP_AT_TRANSPORT_SPI
@@ -0,0 +1,71 @@
+/*
+
+  esp_at_spi.h - SPI transport for the ESP-AT plugin
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Select the transport by adding #define ESP_AT_TRANSPORT ESP_AT_TRANSPORT_SPI to my_machine.h,
+  default is the UART transport.
+
+*/
+
+#ifndef _ESP_AT_SPI_H_
+#define _ESP_AT_SPI_H_
+
+#define ESP_AT_TRANSPORT_UART 0
+#define ESP_AT_TRANSPORT_SPI  1
+
+#ifndef ESP_AT_TRANSPORT
+#define ESP_AT_TRANSPORT ESP_AT_TRANSPORT_UART
+#endif
+
+#ifndef ESP_AT_SPI_CS_PORT
+#define ESP_AT_SPI_CS_PORT 0 // Aux output port used for chip select
+#endif
+
+#ifndef ESP_AT_SPI_HANDSHAKE_PORT
+#define ESP_AT_SPI_HANDSHAKE_PORT 1 // Aux input port connected to the ESP-AT handshake line
+#endif
+
+#if ESP_AT_TRANSPORT == ESP_AT_TRANSPORT_SPI && ESP_AT_SPI_CS_PORT == ESP_AT_SPI_HANDSHAKE_PORT
+#error "ESP_AT_SPI_CS_PORT and ESP_AT_SPI_HANDSHAKE_PORT must be different!"
+#endif
+
+#ifndef ESP_AT_SPI_MOCK
+#define ESP_AT_SPI_MOCK 0 // Set to 1 to connect to a simulated ESP-AT peer instead of the SPI peripheral
+#endif
+
+#ifndef ESP_AT_SPI_TX_BUFFER_SIZE
+#define ESP_AT_SPI_TX_BUFFER_SIZE 256 // must be a power of 2
+#endif
+
+#ifndef ESP_AT_SPI_CHUNK_SIZE
+#define ESP_AT_SPI_CHUNK_SIZE 128 // Max. number of bytes sent per transfer, ESP-AT accepts up to 4092
+#endif
+
+//! Low level SPI access, replace with a mock peer for testing.
+typedef struct {
+    void (*select)(bool on);                //!< Assert (true) or release (false) chip select.
+    uint8_t (*transfer)(uint8_t byte);      //!< Clock out one byte, returns the byte clocked in.
+    bool (*handshake)(void);                //!< Returns true when the ESP-AT handshake line is asserted.
+} esp_at_spi_port_t;
+
+/*! \brief Opens the SPI transport stream.
+\param port pointer to a esp_at_spi_port_t struct, NULL to claim the configured ports and use the driver SPI peripheral.
+\returns pointer to a io_stream_t struct, NULL on failure.
+*/
+const io_stream_t *esp_at_spi_open (const esp_at_spi_port_t *port);
+
+#if ESP_AT_SPI_MOCK
+
+/*! \brief Returns a simulated ESP-AT SPI peer for testing the transport without hardware.
+The peer implements the SPI protocol handshake and answers each line received with OK.
+\returns pointer to a esp_at_spi_port_t struct.
+*/
+const esp_at_spi_port_t *esp_at_spi_mock (void);
+
+#endif
+
+#endif // _ESP_AT_SPI_H_
@@ -27,11 +27,21 @@
 
 #if EVENTOUT_ENABLE == 1
 
-#include <stdio.h>
 #include <string.h>
+#include <math.h>
 
 #include "grbl/nvs_buffer.h"
 #include "grbl/protocol.h"
+#include "grbl/planner.h"
+#include "grbl/task.h"
+
+#include "plugin_nvs.h"
+#include "plugin_prof.h"
+#include "flightrec.h"
+
+#ifndef EVENTOUT_STATIC
+#define EVENTOUT_STATIC 0 // Set to 1 for bindings fixed at compile time, see below.
+#endif
 
 #ifndef N_EVENTS
 #define N_EVENTS 4
@@ -43,6 +53,23 @@
 #define N_EVENTS 10
 #endif
 
+// Lead time in ms for outputs bound to mist or flood enable, see below.
+#ifndef EVENTOUT_1_LEAD
+#define EVENTOUT_1_LEAD 0
+#endif
+#ifndef EVENTOUT_2_LEAD
+#define EVENTOUT_2_LEAD 0
+#endif
+#ifndef EVENTOUT_3_LEAD
+#define EVENTOUT_3_LEAD 0
+#endif
+#ifndef EVENTOUT_4_LEAD
+#define EVENTOUT_4_LEAD 0
+#endif
+
+#define EVENTOUT_LEAD (EVENTOUT_1_LEAD || EVENTOUT_2_LEAD || EVENTOUT_3_LEAD || EVENTOUT_4_LEAD)
+#define EVENTOUT_LEAD_TIMEOUT 5000 // ms, output is restored if the command is not executed within this time after lead switch on
+
 #define EVENT_OPTS { .subgroups = Off, .increment = 1 }
 #define EVENT_OPTS_REBOOT { .subgroups = Off, .increment = 1, .reboot_required = On }
 #define EVENT_TRIGGERS "None,Spindle enable (M3/M4),Laser enable (M3/M4),Mist enable (M7),Flood enable (M8),Feed hold"
@@ -56,6 +83,209 @@ typedef enum {
     Event_FeedHold
 } event_trigger_t;
 
+#if EVENTOUT_STATIC
+
+/*
+  Static mode, bindings are fixed at compile time by EVENTOUT_<n>_PORT and EVENTOUT_<n>_ACTION, <n> = 1 - 4.
+  The hooks compiles to straight-line code for the bound events, no settings are registered.
+*/
+
+#if defined(EVENTOUT_1_PORT) != defined(EVENTOUT_1_ACTION)
+#error "EVENTOUT_1_PORT and EVENTOUT_1_ACTION must be defined together!"
+#elif defined(EVENTOUT_1_ACTION)
+#if EVENTOUT_1_PORT < 0 || EVENTOUT_1_PORT > 254
+#error "EVENTOUT_1_PORT is out of range!"
+#endif
+#if EVENTOUT_1_ACTION < 1 || EVENTOUT_1_ACTION > 5
+#error "EVENTOUT_1_ACTION is out of range, must be 1 - 5!"
+#endif
+#define EVENTOUT_1_TRIGGER EVENTOUT_1_ACTION
+#else
+#define EVENTOUT_1_TRIGGER Event_Ignore
+#define EVENTOUT_1_PORT 0
+#endif
+#if defined(EVENTOUT_2_PORT) != defined(EVENTOUT_2_ACTION)
+#error "EVENTOUT_2_PORT and EVENTOUT_2_ACTION must be defined together!"
+#elif defined(EVENTOUT_2_ACTION)
+#if EVENTOUT_2_PORT < 0 || EVENTOUT_2_PORT > 254
+#error "EVENTOUT_2_PORT is out of range!"
+#endif
+#if EVENTOUT_2_ACTION < 1 || EVENTOUT_2_ACTION > 5
+#error "EVENTOUT_2_ACTION is out of range, must be 1 - 5!"
+#endif
+#define EVENTOUT_2_TRIGGER EVENTOUT_2_ACTION
+#else
+#define EVENTOUT_2_TRIGGER Event_Ignore
+#define EVENTOUT_2_PORT 0
+#endif
+#if defined(EVENTOUT_3_PORT) != defined(EVENTOUT_3_ACTION)
+#error "EVENTOUT_3_PORT and EVENTOUT_3_ACTION must be defined together!"
+#elif defined(EVENTOUT_3_ACTION)
+#if EVENTOUT_3_PORT < 0 || EVENTOUT_3_PORT > 254
+#error "EVENTOUT_3_PORT is out of range!"
+#endif
+#if EVENTOUT_3_ACTION < 1 || EVENTOUT_3_ACTION > 5
+#error "EVENTOUT_3_ACTION is out of range, must be 1 - 5!"
+#endif
+#define EVENTOUT_3_TRIGGER EVENTOUT_3_ACTION
+#else
+#define EVENTOUT_3_TRIGGER Event_Ignore
+#define EVENTOUT_3_PORT 0
+#endif
+#if defined(EVENTOUT_4_PORT) != defined(EVENTOUT_4_ACTION)
+#error "EVENTOUT_4_PORT and EVENTOUT_4_ACTION must be defined together!"
+#elif defined(EVENTOUT_4_ACTION)
+#if EVENTOUT_4_PORT < 0 || EVENTOUT_4_PORT > 254
+#error "EVENTOUT_4_PORT is out of range!"
+#endif
+#if EVENTOUT_4_ACTION < 1 || EVENTOUT_4_ACTION > 5
+#error "EVENTOUT_4_ACTION is out of range, must be 1 - 5!"
+#endif
+#define EVENTOUT_4_TRIGGER EVENTOUT_4_ACTION
+#else
+#define EVENTOUT_4_TRIGGER Event_Ignore
+#define EVENTOUT_4_PORT 0
+#endif
+
+#if EVENTOUT_LEAD
+#warning "Event output lead time is not supported in static mode!"
+#endif
+
+// Constant expressions, code for unbound events is removed by the compiler.
+#define EVENT_BOUND(n, trigger) ((event_trigger_t)EVENTOUT_##n##_TRIGGER == (trigger))
+#define EVENT_USED(trigger) (EVENT_BOUND(1, trigger) || EVENT_BOUND(2, trigger) || EVENT_BOUND(3, trigger) || EVENT_BOUND(4, trigger))
+#define EVENT_OUT(n, trigger, value) if(EVENT_BOUND(n, trigger)) { FLIGHTREC(FlightRec_Output, EVENTOUT_##n##_PORT, value); hal.port.digital_out(EVENTOUT_##n##_PORT, value); }
+#define EVENT_OUT_ALL(trigger, value) { EVENT_OUT(1, trigger, value); EVENT_OUT(2, trigger, value); EVENT_OUT(3, trigger, value); EVENT_OUT(4, trigger, value); }
+#define EVENT_DESCR(n) if(!EVENT_BOUND(n, Event_Ignore)) hal.port.set_pin_description(Port_Digital, Port_Output, EVENTOUT_##n##_PORT, descr[EVENTOUT_##n##_TRIGGER])
+#define EVENT_PORT_OK(n, n_ports) (EVENT_BOUND(n, Event_Ignore) || EVENTOUT_##n##_PORT < (n_ports))
+
+static on_report_options_ptr on_report_options;
+static driver_reset_ptr driver_reset;
+static coolant_set_state_ptr coolant_set_state_;
+static on_spindle_programmed_ptr on_spindle_programmed;
+static on_state_change_ptr on_state_change;
+
+static void onReset (void)
+{
+    if(!EVENT_BOUND(1, Event_Ignore))
+        hal.port.digital_out(EVENTOUT_1_PORT, 0);
+    if(!EVENT_BOUND(2, Event_Ignore))
+        hal.port.digital_out(EVENTOUT_2_PORT, 0);
+    if(!EVENT_BOUND(3, Event_Ignore))
+        hal.port.digital_out(EVENTOUT_3_PORT, 0);
+    if(!EVENT_BOUND(4, Event_Ignore))
+        hal.port.digital_out(EVENTOUT_4_PORT, 0);
+
+    driver_reset();
+}
+
+static void onSpindleProgrammed (spindle_ptrs_t *spindle, spindle_state_t state, float rpm, spindle_rpm_mode_t mode)
+{
+    if(on_spindle_programmed)
+        on_spindle_programmed(spindle, state, rpm, mode);
+
+    PLUGIN_PROF_BEGIN(PluginProf_SpindleProgrammed);
+
+    if(spindle->cap.laser)
+        EVENT_OUT_ALL(Event_Laser, state.on)
+    else
+        EVENT_OUT_ALL(Event_Spindle, state.on)
+
+    PLUGIN_PROF_END(PluginProf_SpindleProgrammed);
+}
+
+static void onCoolantSetState (coolant_state_t state)
+{
+    coolant_set_state_(state);
+
+    PLUGIN_PROF_BEGIN(PluginProf_CoolantSetState);
+
+    EVENT_OUT_ALL(Event_Mist, state.mist);
+    EVENT_OUT_ALL(Event_Flood, state.flood);
+
+    PLUGIN_PROF_END(PluginProf_CoolantSetState);
+}
+
+static void onStateChanged (sys_state_t state)
+{
+    static sys_state_t last_state = STATE_IDLE;
+
+    PLUGIN_PROF_BEGIN(PluginProf_StateChange);
+
+    if(state != last_state) {
+        last_state = state;
+        EVENT_OUT_ALL(Event_FeedHold, state == STATE_HOLD);
+    }
+
+    PLUGIN_PROF_END(PluginProf_StateChange);
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+static void onReportOptions (bool newopt)
+{
+    on_report_options(newopt);
+
+    if(!newopt)
+        report_plugin("Events plugin (static)", "0.06");
+}
+
+void event_out_init (void)
+{
+    static const char *const descr[] = {
+        "Event: none",
+        "Event: Spindle enable",
+        "Event: Laser enable",
+        "Event: Mist enable",
+        "Event: Flood enable",
+        "Event: Feed hold"
+    };
+
+    uint8_t n_ports;
+
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EventOutInit);
+    PLUGIN_PROF_INIT();
+
+    n_ports = ioports_unclaimed(Port_Digital, Port_Output);
+
+    if(!(EVENT_PORT_OK(1, n_ports) && EVENT_PORT_OK(2, n_ports) && EVENT_PORT_OK(3, n_ports) && EVENT_PORT_OK(4, n_ports))) {
+        protocol_enqueue_foreground_task(report_warning, "Events plugin: output port out of range!");
+        PLUGIN_PROF_BOOT_END(PluginBoot_EventOutInit);
+        return;
+    }
+
+    on_report_options = grbl.on_report_options;
+    grbl.on_report_options = onReportOptions;
+
+    driver_reset = hal.driver_reset;
+    hal.driver_reset = onReset;
+
+    if(EVENT_USED(Event_Spindle) || EVENT_USED(Event_Laser)) {
+        on_spindle_programmed = grbl.on_spindle_programmed;
+        grbl.on_spindle_programmed = onSpindleProgrammed;
+    }
+
+    if(EVENT_USED(Event_Mist) || EVENT_USED(Event_Flood)) {
+        coolant_set_state_ = hal.coolant.set_state;
+        hal.coolant.set_state = onCoolantSetState;
+    }
+
+    if(EVENT_USED(Event_FeedHold)) {
+        on_state_change = grbl.on_state_change;
+        grbl.on_state_change = onStateChanged;
+    }
+
+    EVENT_DESCR(1);
+    EVENT_DESCR(2);
+    EVENT_DESCR(3);
+    EVENT_DESCR(4);
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EventOutInit);
+}
+
+#else // dynamic mode
+
 typedef struct {
     uint8_t port;
     event_trigger_t trigger;
@@ -79,13 +309,260 @@ static on_state_change_ptr on_state_change;
 static bool on_spindle_programmed_attached = false;
 static bool on_state_change_attached = false;
 
+static inline void event_out (uint8_t port, bool on)
+{
+    FLIGHTREC(FlightRec_Output, port, on);
+    hal.port.digital_out(port, on);
+}
+
+#if EVENTOUT_LEAD
+
+/*
+  Lead time: outputs bound to mist or flood enable can be switched on up to EVENTOUT_n_LEAD ms
+  before the M7/M8 command is executed. Lines read from the input stream are scanned for M7 and M8,
+  when found the output is armed. The parser waits for the planner to empty before executing the
+  command, so the output is switched on when the expected time to complete the blocks in the planner
+  drops to the lead time. The expected time is recalculated while armed from the remaining block
+  lengths, entry speeds, acceleration and the current overrides. Outputs switched on ahead are switched
+  back off and armed again on feed hold or if the expected time grows to more than twice the lead time.
+*/
+
+typedef enum {
+    Scan_Idle = 0,
+    Scan_MCode,
+    Scan_Comment,
+    Scan_LineComment
+} lead_scan_t;
+
+static const uint16_t lead_ms[4] = { EVENTOUT_1_LEAD, EVENTOUT_2_LEAD, EVENTOUT_3_LEAD, EVENTOUT_4_LEAD };
+
+static uint8_t lead_armed = 0;   // bitmap of events waiting for the planner to drain down to the lead time
+static uint8_t lead_pending = 0; // bitmap of events switched on ahead of command
+static stream_read_ptr stream_read = NULL;
+static on_stream_changed_ptr on_stream_changed;
+static on_execute_realtime_ptr on_execute_realtime;
+
+static bool lead_event (uint_fast16_t idx, coolant_state_t state)
+{
+    return idx < 4 && lead_ms[idx] && port[idx] != 0xFF &&
+            ((plugin_settings.event[idx].trigger == Event_Mist && state.mist) ||
+              (plugin_settings.event[idx].trigger == Event_Flood && state.flood));
+}
+
+// Switches the output back to the commanded state.
+static void lead_restore (uint_fast16_t idx)
+{
+    coolant_state_t state = hal.coolant.get_state();
+
+    lead_pending &= ~(1 << idx);
+    event_out(port[idx], plugin_settings.event[idx].trigger == Event_Mist ? state.mist : state.flood);
+}
+
+// Restores the output if the command was not executed.
+static void lead_verify (void *data)
+{
+    uint_fast16_t idx = (uint_fast16_t)(uintptr_t)data;
+
+    if(lead_pending & (1 << idx))
+        lead_restore(idx);
+}
+
+static void lead_on (uint_fast16_t idx)
+{
+    lead_armed &= ~(1 << idx);
+    lead_pending |= (1 << idx);
+    event_out(port[idx], 1);
+
+    task_add_delayed(lead_verify, (void *)(uintptr_t)idx, EVENTOUT_LEAD_TIMEOUT);
+}
+
+// Switches an output switched on ahead back off and arms it again.
+static void lead_rearm (uint_fast16_t idx)
+{
+    task_delete(lead_verify, (void *)(uintptr_t)idx);
+    lead_restore(idx);
+    lead_armed |= (1 << idx);
+}
+
+static void lead_cancel (void)
+{
+    uint_fast16_t idx;
+
+    for(idx = 0; idx < min(n_events, 4); idx++)
+        task_delete(lead_verify, (void *)(uintptr_t)idx);
+
+    lead_armed = lead_pending = 0;
+}
+
+// Returns expected time in ms to complete a block, exit_speed_sqr is the entry speed of the next block.
+// Speeds are in mm/min and acceleration in mm/min^2 as used by the planner.
+static float block_time_ms (plan_block_t *block, float exit_speed_sqr)
+{
+    float rate = block->programmed_rate * (float)(block->condition.rapid_motion ? sys.override.rapid_rate : sys.override.feed_rate) / 100.0f,
+          rate_sqr = rate * rate, accel2 = 2.0f * block->acceleration,
+          entry_sqr = min(block->entry_speed_sqr, rate_sqr), exit_sqr = min(exit_speed_sqr, rate_sqr),
+          ramps_mm, minutes;
+
+    if(rate <= 0.0f)
+        return 0.0f;
+
+    if(accel2 <= 0.0f)
+        return block->millimeters / rate * 60000.0f;
+
+    ramps_mm = (2.0f * rate_sqr - entry_sqr - exit_sqr) / accel2;
+
+    if(ramps_mm > block->millimeters) { // nominal rate is not reached
+        rate = sqrtf((block->millimeters * accel2 + entry_sqr + exit_sqr) / 2.0f);
+        minutes = (2.0f * rate - sqrtf(entry_sqr) - sqrtf(exit_sqr)) / block->acceleration;
+    } else
+        minutes = (2.0f * rate - sqrtf(entry_sqr) - sqrtf(exit_sqr)) / block->acceleration + (block->millimeters - ramps_mm) / rate;
+
+    return minutes * 60000.0f;
+}
+
+// Returns expected time in ms to complete the motions in the planner.
+static uint32_t planner_time_ms (void)
+{
+    float ms = 0.0f;
+    uint_fast16_t count = plan_get_block_buffer_count();
+    plan_block_t *block = plan_get_current_block();
+
+    while(block && count--) {
+        ms += block_time_ms(block, count && block->next ? block->next->entry_speed_sqr : 0.0f);
+        block = block->next;
+    }
+
+    return (uint32_t)ms;
+}
+
+static void lead_update (sys_state_t state)
+{
+    uint32_t ms = 0;
+    uint_fast16_t idx;
+
+    if(!(state & STATE_HOLD))
+        ms = planner_time_ms();
+
+    for(idx = 0; idx < min(n_events, 4); idx++) {
+        if(lead_pending & (1 << idx)) {
+            if((state & STATE_HOLD) || ms > 2 * lead_ms[idx])
+                lead_rearm(idx);
+        } else if((lead_armed & (1 << idx)) && !(state & STATE_HOLD) && ms <= lead_ms[idx])
+            lead_on(idx);
+    }
+}
+
+static void onExecuteRealtime (sys_state_t state)
+{
+    static uint32_t last_ms = 0;
+
+    uint32_t ms;
+
+    on_execute_realtime(state);
+
+    if((lead_armed | lead_pending) && (ms = hal.get_elapsed_ticks()) - last_ms >= 10) {
+        last_ms = ms;
+        lead_update(state);
+    }
+}
+
+static void lead_schedule (coolant_state_t state)
+{
+    uint_fast16_t idx;
+
+    state.value &= ~hal.coolant.get_state().value;
+
+    for(idx = 0; idx < min(n_events, 4); idx++) {
+        if(lead_event(idx, state) && !(lead_pending & (1 << idx)))
+            lead_armed |= (1 << idx);
+    }
+}
+
+static int16_t lead_stream_read (void)
+{
+    static lead_scan_t scan = Scan_Idle;
+    static uint_fast16_t mcode = 0;
+    static coolant_state_t found = {0};
+
+    int16_t c = stream_read();
+
+    if(c == SERIAL_NO_DATA)
+        return c;
+
+    if(scan == Scan_MCode && !(c >= '0' && c <= '9') && c != ' ') {
+        if(mcode == 7)
+            found.mist = On;
+        else if(mcode == 8)
+            found.flood = On;
+        scan = Scan_Idle;
+    }
+
+    switch(c) {
+
+        case ASCII_CR:
+        case ASCII_LF:
+            if(found.value)
+                lead_schedule(found);
+            found.value = 0;
+            scan = Scan_Idle;
+            break;
+
+        default:
+            switch(scan) {
+
+                case Scan_Idle:
+                    if(c == 'M' || c == 'm') {
+                        mcode = 0;
+                        scan = Scan_MCode;
+                    } else if(c == '(')
+                        scan = Scan_Comment;
+                    else if(c == ';')
+                        scan = Scan_LineComment;
+                    break;
+
+                case Scan_MCode:
+                    if(c != ' ')
+                        mcode = mcode * 10 + (c - '0');
+                    break;
+
+                case Scan_Comment:
+                    if(c == ')')
+                        scan = Scan_Idle;
+                    break;
+
+                default:
+                    break;
+            }
+            break;
+    }
+
+    return c;
+}
+
+static void onStreamChanged (stream_type_t type)
+{
+    if(on_stream_changed)
+        on_stream_changed(type);
+
+    if(hal.stream.read != lead_stream_read) {
+        stream_read = hal.stream.read;
+        hal.stream.read = lead_stream_read;
+    }
+}
+
+#endif // EVENTOUT_LEAD
+
 static void onReset (void)
 {
     uint_fast16_t idx = n_events;
 
+#if EVENTOUT_LEAD
+    lead_cancel();
+#endif
+
     do {
         if(port[--idx] != 0xFF && plugin_settings.event[idx].trigger)
-            hal.port.digital_out(port[idx], 0);
+            event_out(port[idx], 0);
     } while(idx);
 
     driver_reset();
@@ -98,10 +575,14 @@ static void onSpindleProgrammed (spindle_ptrs_t *spindle, spindle_state_t state,
     if(on_spindle_programmed)
         on_spindle_programmed(spindle, state, rpm, mode);
 
+    PLUGIN_PROF_BEGIN(PluginProf_SpindleProgrammed);
+
     do {
         if(port[--idx] != 0xFF && plugin_settings.event[idx].trigger == (spindle->cap.laser ? Event_Laser : Event_Spindle))
-            hal.port.digital_out(port[idx], state.on);
+            event_out(port[idx], state.on);
     } while(idx);
+
+    PLUGIN_PROF_END(PluginProf_SpindleProgrammed);
 }
 
 static void onCoolantSetState (coolant_state_t state)
@@ -110,28 +591,38 @@ static void onCoolantSetState (coolant_state_t state)
 
     coolant_set_state_(state);
 
+    PLUGIN_PROF_BEGIN(PluginProf_CoolantSetState);
+
+#if EVENTOUT_LEAD
+    lead_cancel();
+#endif
+
     do {
         if(port[--idx] != 0xFF)
           switch(plugin_settings.event[idx].trigger) {
 
             case Event_Mist:
-                hal.port.digital_out(port[idx], state.mist);
+                event_out(port[idx], state.mist);
                 break;
 
             case Event_Flood:
-                hal.port.digital_out(port[idx], state.flood);
+                event_out(port[idx], state.flood);
                 break;
 
             default:
                 break;
         }
     } while(idx);
+
+    PLUGIN_PROF_END(PluginProf_CoolantSetState);
 }
 
 static void onStateChanged (sys_state_t state)
 {
     static sys_state_t last_state = STATE_IDLE;
 
+    PLUGIN_PROF_BEGIN(PluginProf_StateChange);
+
     if(state != last_state) {
 
         uint_fast16_t idx = n_events;
@@ -140,17 +631,27 @@ static void onStateChanged (sys_state_t state)
 
         do {
             if(port[--idx] != 0xFF && plugin_settings.event[idx].trigger == Event_FeedHold)
-                hal.port.digital_out(port[idx], state == STATE_HOLD);
+                event_out(port[idx], state == STATE_HOLD);
         } while(idx);
     }
 
+    PLUGIN_PROF_END(PluginProf_StateChange);
+
     if(on_state_change)
         on_state_change(state);
 }
 
 static void register_handlers (void)
 {
-    static char descr[N_EVENTS][25] = {0};
+    // Pin descriptions are kept in flash, the port number is already part of the pin report.
+    static const char *const descr[] = {
+        "Event: none",
+        "Event: Spindle enable",
+        "Event: Laser enable",
+        "Event: Mist enable",
+        "Event: Flood enable",
+        "Event: Feed hold"
+    };
 
     uint_fast16_t idx = n_events;
 
@@ -159,7 +660,6 @@ static void register_handlers (void)
           switch(plugin_settings.event[idx].trigger) {
             case Event_Laser:
             case Event_Spindle:
-                sprintf(descr[idx], "P%d <- %s", port[idx], plugin_settings.event[idx].trigger == Event_Spindle ? "Spindle enable" : "Laser enable");
                 if(!on_spindle_programmed_attached) {
                     on_spindle_programmed_attached = true;
                     on_spindle_programmed = grbl.on_spindle_programmed;
@@ -169,15 +669,23 @@ static void register_handlers (void)
 
             case Event_Mist:
             case Event_Flood:
-                sprintf(descr[idx], "P%d <- %s", port[idx], plugin_settings.event[idx].trigger == Event_Mist ? "Mist enable" : "Flood enable");
                 if(coolant_set_state_ == NULL) {
                     coolant_set_state_ = hal.coolant.set_state;
                     hal.coolant.set_state = onCoolantSetState;
                 }
+#if EVENTOUT_LEAD
+                if(idx < 4 && lead_ms[idx] && stream_read == NULL) {
+                    stream_read = hal.stream.read;
+                    hal.stream.read = lead_stream_read;
+                    on_stream_changed = grbl.on_stream_changed;
+                    grbl.on_stream_changed = onStreamChanged;
+                    on_execute_realtime = grbl.on_execute_realtime;
+                    grbl.on_execute_realtime = onExecuteRealtime;
+                }
+#endif
                 break;
 
             case Event_FeedHold:
-                sprintf(descr[idx], "P%d <- %s", port[idx], "Feed hold");
                 if(!on_state_change_attached) {
                     on_state_change_attached = true;
                     on_state_change = grbl.on_state_change;
@@ -186,11 +694,10 @@ static void register_handlers (void)
                 break;
 
             default:
-                sprintf(descr[idx], "P%d", port[idx]);
                 break;
         }
 
-        hal.port.set_pin_description(Port_Digital, Port_Output, port[idx], descr[idx]);
+        hal.port.set_pin_description(Port_Digital, Port_Output, port[idx], descr[plugin_settings.event[idx].trigger > Event_FeedHold ? Event_Ignore : plugin_settings.event[idx].trigger]);
 
     } while(idx);
 }
@@ -272,7 +779,7 @@ static const setting_descr_t event_settings_descr[] = {
 
 static void event_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&plugin_settings, sizeof(event_settings_t), true);
+    plugin_nvs_write(nvs_address, &plugin_settings, sizeof(event_settings_t));
 }
 
 static void event_settings_restore (void)
@@ -315,7 +822,7 @@ static void event_settings_restore (void)
         plugin_settings.event[idx].port = n_ports < (idx + 1) ? 0xFF : idx;
     }
 
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&plugin_settings, sizeof(event_settings_t), true);
+    plugin_nvs_write(nvs_address, &plugin_settings, sizeof(event_settings_t));
 }
 
 static void event_settings_load (void)
@@ -339,11 +846,13 @@ static void onReportOptions (bool newopt)
     on_report_options(newopt);
 
     if(!newopt)
-        report_plugin("Events plugin", "0.05");
+        report_plugin("Events plugin", "0.06");
 }
 
 static void event_out_cfg (void *data)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EventOutCfg);
+
     if((n_ports = ioports_unclaimed(Port_Digital, Port_Output))) {
 
         n_events = min(n_ports, N_EVENTS);
@@ -359,6 +868,8 @@ static void event_out_cfg (void *data)
 
         register_handlers();
     }
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EventOutCfg);
 }
 
 void event_out_init (void)
@@ -376,9 +887,20 @@ void event_out_init (void)
         .iterator = event_settings_iterator
     };
 
+    static plugin_nvs_block_t nvs_block = {
+        .id = PluginNVS_EventOut,
+        .size = sizeof(event_settings_t),
+        .address = &nvs_address,
+        .load = event_settings_load
+    };
+
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_EventOutInit);
+    PLUGIN_PROF_INIT();
+
     if((nvs_address = nvs_alloc(sizeof(event_settings_t)))) {
 
         settings_register(&setting_details);
+        plugin_nvs_register(&nvs_block);
 
         on_report_options = grbl.on_report_options;
         grbl.on_report_options = onReportOptions;
@@ -389,6 +911,10 @@ void event_out_init (void)
         protocol_enqueue_foreground_task(event_out_cfg, NULL);
     } else
         protocol_enqueue_foreground_task(report_warning, "Events plugin failed to initialize!");
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_EventOutInit);
 }
 
+#endif // EVENTOUT_STATIC
+
 #endif // EVENTOUT_ENABLE
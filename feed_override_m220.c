@@ -16,6 +16,13 @@
 
   NOTE: M220RS<percentage> can be used to override the rapids rate, if R is not specified the feed rate will be overridden.
 
+  With FEED_OVERRIDE_STATS enabled the feed and rapid overrides are integrated over the motion time of each program
+  and a summary is output on program end (M2/M30):
+
+  [OVRSTATS:FEED:<mean %>|RAPID:<mean %>|BELOW:<s>|ABOVE:<s>|T:<s>]
+
+  BELOW and ABOVE is the feed motion time with the feed override below and above 100%, T is the total motion time.
+
   https://marlinfw.org/docs/gcode/M220.html
 */
 
@@ -27,6 +34,17 @@
 
 #include "grbl/hal.h"
 
+#ifndef FEED_OVERRIDE_STATS
+#define FEED_OVERRIDE_STATS 0
+#endif
+
+#if FEED_OVERRIDE_STATS
+#include "grbl/planner.h"
+#endif
+
+#include "plugin_prof.h"
+#include "flightrec.h"
+
 static override_t feed_rate = 0, rapid_rate = 0;
 static user_mcode_ptrs_t user_mcode;
 static on_report_options_ptr on_report_options;
@@ -40,6 +58,8 @@ static user_mcode_type_t mcode_check (user_mcode_t mcode)
 
 static status_code_t mcode_validate (parser_block_t *gc_block)
 {
+    PLUGIN_PROF_BEGIN(PluginProf_M220_Validate);
+
     status_code_t state = Status_OK;
 
     if((state = gc_block->user_mcode == SetFeedOverrides ? Status_OK : Status_Unhandled) == Status_OK) {
@@ -63,15 +83,25 @@ static status_code_t mcode_validate (parser_block_t *gc_block)
 
     }
 
+    PLUGIN_PROF_END(PluginProf_M220_Validate);
+
+    if(state == Status_OK)
+        PLUGIN_STALL_SYNC_BEGIN(PluginStall_FeedOverride);
+
     return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
 }
 
 static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
 {
+    PLUGIN_STALL_SYNC_END(PluginStall_FeedOverride);
+    PLUGIN_PROF_BEGIN(PluginProf_M220_Execute);
+
     bool handled;
 
     if((handled = (gc_block->user_mcode == SetFeedOverrides))) {
 
+        FLIGHTREC(FlightRec_MCode, 0, SetFeedOverrides);
+
         if(gc_block->words.b) {
             feed_rate = sys.override.feed_rate;
             rapid_rate = sys.override.rapid_rate;
@@ -86,20 +116,108 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
             plan_feed_override(feed_rate, rapid_rate);
     }
 
+    PLUGIN_PROF_END(PluginProf_M220_Execute);
+
     if(!handled && user_mcode.execute)
         user_mcode.execute(state, gc_block);
 }
 
+#if FEED_OVERRIDE_STATS
+
+typedef struct {
+    bool running;
+    uint32_t ms;            // timestamp of last sample
+    uint32_t feed_ms;       // time in feed motion
+    uint32_t rapid_ms;      // time in rapid motion
+    uint32_t below_ms;      // time in feed motion with override < 100%
+    uint32_t above_ms;      // time in feed motion with override > 100%
+    uint64_t feed_sum;      // override % * ms
+    uint64_t rapid_sum;
+} override_stats_t;
+
+static override_stats_t stats = {0};
+static on_execute_realtime_ptr on_execute_realtime;
+static on_program_completed_ptr on_program_completed;
+
+static inline void stats_sample (void)
+{
+    uint32_t ms = hal.get_elapsed_ticks(), dt = ms - stats.ms;
+    plan_block_t *block;
+
+    stats.ms = ms;
+
+    if(dt == 0 || !(state_get() & STATE_CYCLE) || (block = plan_get_current_block()) == NULL)
+        return;
+
+    if(block->condition.rapid_motion) {
+        stats.rapid_ms += dt;
+        stats.rapid_sum += (uint64_t)sys.override.rapid_rate * dt;
+    } else {
+        stats.feed_ms += dt;
+        stats.feed_sum += (uint64_t)sys.override.feed_rate * dt;
+        if(sys.override.feed_rate < DEFAULT_FEED_OVERRIDE)
+            stats.below_ms += dt;
+        else if(sys.override.feed_rate > DEFAULT_FEED_OVERRIDE)
+            stats.above_ms += dt;
+    }
+}
+
+static void stats_execute_realtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(stats.running) {
+        if(state & (STATE_ALARM|STATE_ESTOP))
+            stats.running = false; // program aborted
+        else
+            stats_sample();
+    } else if(state & STATE_CYCLE) { // first motion of a new program
+        memset(&stats, 0, sizeof(override_stats_t));
+        stats.ms = hal.get_elapsed_ticks();
+        stats.running = true;
+    }
+}
+
+static void stats_program_completed (program_flow_t program_flow, bool check_mode)
+{
+    if(stats.running && !check_mode) {
+
+        stats_sample();
+
+        hal.stream.write("[OVRSTATS:FEED:");
+        hal.stream.write(uitoa(stats.feed_ms ? (uint32_t)(stats.feed_sum / stats.feed_ms) : DEFAULT_FEED_OVERRIDE));
+        hal.stream.write("|RAPID:");
+        hal.stream.write(uitoa(stats.rapid_ms ? (uint32_t)(stats.rapid_sum / stats.rapid_ms) : DEFAULT_RAPID_OVERRIDE));
+        hal.stream.write("|BELOW:");
+        hal.stream.write(ftoa((float)stats.below_ms / 1000.0f, 1));
+        hal.stream.write("|ABOVE:");
+        hal.stream.write(ftoa((float)stats.above_ms / 1000.0f, 1));
+        hal.stream.write("|T:");
+        hal.stream.write(ftoa((float)(stats.feed_ms + stats.rapid_ms) / 1000.0f, 1));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    stats.running = false;
+
+    if(on_program_completed)
+        on_program_completed(program_flow, check_mode);
+}
+
+#endif // FEED_OVERRIDE_STATS
+
 static void onReportOptions (bool newopt)
 {
     on_report_options(newopt);
 
     if(!newopt)
-        report_plugin("Feed override", "0.01");
+        report_plugin("Feed override", "0.02");
 }
 
 void feed_override_init (void)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_FeedOverrideInit);
+    PLUGIN_PROF_INIT();
+
     memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
 
     grbl.user_mcode.check = mcode_check;
@@ -108,6 +226,16 @@ void feed_override_init (void)
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
+
+#if FEED_OVERRIDE_STATS
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = stats_execute_realtime;
+
+    on_program_completed = grbl.on_program_completed;
+    grbl.on_program_completed = stats_program_completed;
+#endif
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_FeedOverrideInit);
 }
 
 #endif // FEED_OVERRIDE_ENABLE
@@ -0,0 +1,268 @@
+/*
+
+  flightrec.c - post-mortem flight recorder for plugin events
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Plugin level events, M-code executions, BLTouch commands, output changes, ESP-AT link transitions
+  and override changes are logged as 8 byte records in a RAM ring buffer. When an alarm is raised
+  the ring is frozen and the most recent events are written to a reserved NVS region, recording
+  resumes when written. The record is only overwritten by later alarms if new events has been
+  logged in between so that alarms raised on startup does not replace the evidence.
+
+  $FLIGHTREC   - report the record saved on the last alarm.
+  $FLIGHTREC=L - report the live ring buffer.
+  $FLIGHTREC=C - clear the saved record.
+
+  Events are reported as [FR:<ms>|<type>|<a>|<b>] where ms is time since boot.
+
+*/
+
+#include "driver.h"
+
+#include "flightrec.h"
+
+#if FLIGHT_RECORDER_ENABLE
+
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/protocol.h"
+#include "grbl/nvs_buffer.h"
+#include "grbl/state_machine.h"
+
+#include "plugin_nvs.h"
+
+#if FLIGHTREC_SIZE < 2 || FLIGHTREC_SIZE > 32768 || (FLIGHTREC_SIZE & (FLIGHTREC_SIZE - 1))
+#error "FLIGHTREC_SIZE must be a power of 2 in the range 2 - 32768!"
+#endif
+
+#if FLIGHTREC_NVS_SIZE > FLIGHTREC_SIZE
+#error "FLIGHTREC_NVS_SIZE cannot be larger than FLIGHTREC_SIZE!"
+#endif
+
+typedef struct {
+    uint16_t count;
+    uint16_t seq;       // number of records saved
+    uint32_t alarm_ms;
+    flightrec_event_t event[FLIGHTREC_NVS_SIZE];
+} flightrec_record_t;
+
+static struct {
+    bool frozen;
+    uint16_t head;
+    uint16_t count;
+    uint16_t pending;   // events logged since last save
+    overrides_t override;
+    flightrec_event_t event[FLIGHTREC_SIZE];
+} ring = {0};
+
+static bool init_ok = false;
+static nvs_address_t nvs_address = 0;
+static flightrec_record_t record;
+static on_state_change_ptr on_state_change;
+static on_execute_realtime_ptr on_execute_realtime;
+static on_report_options_ptr on_report_options;
+
+static const char *type_names[FlightRec_NumTypes] = {
+    "-",
+    "BOOT",
+    "ALARM",
+    "MCODE",
+    "BLTOUCH",
+    "OUTPUT",
+    "SERVO",
+    "ESPAT",
+    "OVERRIDE"
+};
+
+static void ring_put (flightrec_type_t type, uint8_t a, uint16_t b)
+{
+    flightrec_event_t *event = &ring.event[ring.head];
+
+    event->ms = hal.get_elapsed_ticks();
+    event->type = type;
+    event->a = a;
+    event->b = b;
+
+    ring.head = (ring.head + 1) & (FLIGHTREC_SIZE - 1);
+    if(ring.count < FLIGHTREC_SIZE)
+        ring.count++;
+}
+
+void flightrec_log (flightrec_type_t type, uint8_t a, uint16_t b)
+{
+    if(!ring.frozen) {
+        ring_put(type, a, b);
+        ring.pending++;
+    }
+}
+
+static void flightrec_save (void *data)
+{
+    uint16_t idx, tail, seq = 0;
+
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&record, nvs_address, sizeof(flightrec_record_t), true) == NVS_TransferResult_OK)
+        seq = record.seq;
+
+    memset(&record, 0, sizeof(flightrec_record_t));
+
+    record.count = ring.count > FLIGHTREC_NVS_SIZE ? FLIGHTREC_NVS_SIZE : ring.count;
+    record.seq = seq + 1;
+
+    tail = (ring.head - record.count) & (FLIGHTREC_SIZE - 1);
+    for(idx = 0; idx < record.count; idx++)
+        record.event[idx] = ring.event[(tail + idx) & (FLIGHTREC_SIZE - 1)];
+
+    record.alarm_ms = record.count ? record.event[record.count - 1].ms : 0;
+
+    plugin_nvs_write(nvs_address, &record, sizeof(flightrec_record_t));
+
+    ring.pending = 0;
+    ring.frozen = false;
+}
+
+static void onStateChanged (sys_state_t state)
+{
+    static sys_state_t last_state = STATE_IDLE;
+
+    if((state & (STATE_ALARM|STATE_ESTOP)) && !(last_state & (STATE_ALARM|STATE_ESTOP)) && !ring.frozen) {
+        ring_put(FlightRec_Alarm, 0, (uint16_t)state);
+        if(nvs_address && ring.pending) {
+            ring.frozen = true;
+            protocol_enqueue_foreground_task(flightrec_save, NULL);
+        }
+    }
+
+    last_state = state;
+
+    if(on_state_change)
+        on_state_change(state);
+}
+
+// Override changes are not signalled by the core, poll.
+static void onExecuteRealtime (sys_state_t state)
+{
+    on_execute_realtime(state);
+
+    if(ring.override.feed_rate != sys.override.feed_rate || ring.override.rapid_rate != sys.override.rapid_rate) {
+        ring.override = sys.override;
+        flightrec_log(FlightRec_Override, ring.override.rapid_rate, ring.override.feed_rate);
+    }
+}
+
+static void report_event (flightrec_event_t *event)
+{
+    hal.stream.write("[FR:");
+    hal.stream.write(uitoa(event->ms));
+    hal.stream.write("|");
+    hal.stream.write(event->type < FlightRec_NumTypes ? type_names[event->type] : uitoa(event->type));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(event->a));
+    hal.stream.write("|");
+    hal.stream.write(uitoa(event->b));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static status_code_t flightrec_command (sys_state_t state, char *args)
+{
+    uint16_t idx;
+
+    if(args && args[1] == '\0' && (*args == 'L' || *args == 'l')) {
+
+        bool frozen = ring.frozen;
+        uint16_t tail = (ring.head - ring.count) & (FLIGHTREC_SIZE - 1), count = ring.count;
+
+        ring.frozen = true; // do not log while reporting
+        hal.stream.write("[FLIGHTREC:LIVE|N:");
+        hal.stream.write(uitoa(count));
+        hal.stream.write("]" ASCII_EOL);
+        for(idx = 0; idx < count; idx++)
+            report_event(&ring.event[(tail + idx) & (FLIGHTREC_SIZE - 1)]);
+        ring.frozen = frozen;
+
+        return Status_OK;
+    }
+
+    if(nvs_address == 0)
+        return Status_NVSFail;
+
+    if(args && args[1] == '\0' && (*args == 'C' || *args == 'c')) {
+        if(hal.nvs.memcpy_from_nvs((uint8_t *)&record, nvs_address, sizeof(flightrec_record_t), true) == NVS_TransferResult_OK)
+            idx = record.seq;
+        else
+            idx = 0;
+        memset(&record, 0, sizeof(flightrec_record_t));
+        record.seq = idx; // keep sequence number
+        plugin_nvs_write(nvs_address, &record, sizeof(flightrec_record_t));
+        return Status_OK;
+    }
+
+    if(args)
+        return Status_InvalidStatement;
+
+    if(hal.nvs.memcpy_from_nvs((uint8_t *)&record, nvs_address, sizeof(flightrec_record_t), true) != NVS_TransferResult_OK ||
+        record.count > FLIGHTREC_NVS_SIZE)
+        record.count = 0;
+
+    hal.stream.write("[FLIGHTREC:N:");
+    hal.stream.write(uitoa(record.count));
+    hal.stream.write("|SEQ:");
+    hal.stream.write(uitoa(record.seq));
+    hal.stream.write("|ALARM:");
+    hal.stream.write(uitoa(record.alarm_ms));
+    hal.stream.write("]" ASCII_EOL);
+
+    for(idx = 0; idx < record.count; idx++)
+        report_event(&record.event[idx]);
+
+    return Status_OK;
+}
+
+static void onReportOptions (bool newopt)
+{
+    on_report_options(newopt);
+
+    if(!newopt)
+        report_plugin(nvs_address ? "Flight recorder" : "Flight recorder (RAM)", "0.01");
+}
+
+// Called once via FLIGHTREC_INIT() from my_plugin_init(). The core calls my_plugin_init() after all other
+// plugins have been initialized so the recorder NVS space is always allocated last, enabling the recorder
+// does not move the settings of other plugins. Further calls has no effect.
+void flightrec_init (void)
+{
+    static const sys_command_t flightrec_command_list[] = {
+        {"FLIGHTREC", flightrec_command, {}, { .str = "report flight recorder events saved on last alarm, $FLIGHTREC=L for live events, $FLIGHTREC=C to clear" } }
+    };
+
+    static sys_commands_t flightrec_commands = {
+        .n_commands = sizeof(flightrec_command_list) / sizeof(sys_command_t),
+        .commands = flightrec_command_list
+    };
+
+    if(init_ok)
+        return;
+
+    init_ok = true;
+
+    nvs_address = nvs_alloc(sizeof(flightrec_record_t));
+
+    ring.override = sys.override;
+    ring_put(FlightRec_Boot, 0, 0);
+
+    on_state_change = grbl.on_state_change;
+    grbl.on_state_change = onStateChanged;
+
+    on_execute_realtime = grbl.on_execute_realtime;
+    grbl.on_execute_realtime = onExecuteRealtime;
+
+    on_report_options = grbl.on_report_options;
+    grbl.on_report_options = onReportOptions;
+
+    system_register_commands(&flightrec_commands);
+}
+
+#endif // FLIGHT_RECORDER_ENABLE
@@ -0,0 +1,77 @@
+/*
+
+  flightrec.h - post-mortem flight recorder for plugin events
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Enable by adding #define FLIGHT_RECORDER_ENABLE 1 to my_machine.h and a FLIGHTREC_INIT() call
+  to my_plugin_init(), when disabled the macros expands to nothing.
+
+*/
+
+#ifndef _FLIGHTREC_H_
+#define _FLIGHTREC_H_
+
+#ifndef FLIGHT_RECORDER_ENABLE
+#define FLIGHT_RECORDER_ENABLE 0
+#endif
+
+#if FLIGHT_RECORDER_ENABLE
+
+#ifndef FLIGHTREC_SIZE
+#define FLIGHTREC_SIZE 256      // events kept in RAM, must be a power of 2
+#endif
+#ifndef FLIGHTREC_NVS_SIZE
+#define FLIGHTREC_NVS_SIZE 64   // most recent events saved to NVS on alarm
+#endif
+
+// Event arguments in comments as a, b.
+typedef enum {
+    FlightRec_None = 0,
+    FlightRec_Boot,             // -, -
+    FlightRec_Alarm,            // -, state
+    FlightRec_MCode,            // -, M-code
+    FlightRec_BLTouch,          // BLTouch command (servo angle), -
+    FlightRec_Output,           // port, value
+    FlightRec_Servo,            // servo, angle
+    FlightRec_EspAt,            // flightrec_esp_at_t, -
+    FlightRec_Override,         // rapid override, feed override
+    FlightRec_NumTypes
+} flightrec_type_t;
+
+typedef enum {
+    FlightRecEsp_Connected = 0,
+    FlightRecEsp_Rebound,
+    FlightRecEsp_Closed,
+    FlightRecEsp_Lost,
+    FlightRecEsp_Expired,       // b is 1 if output was dropped
+    FlightRecEsp_Reset,
+    FlightRecEsp_JobStored,     // b is 1 if verified
+    FlightRecEsp_JobRun,
+    FlightRecEsp_JobEnd,        // b is 1 if failed
+    FlightRecEsp_Busy           // b is the assumed drain rate before the busy report
+} flightrec_esp_at_t;
+
+typedef struct {
+    uint32_t ms;
+    uint8_t type;
+    uint8_t a;
+    uint16_t b;
+} flightrec_event_t;
+
+void flightrec_init (void);
+void flightrec_log (flightrec_type_t type, uint8_t a, uint16_t b);
+
+#define FLIGHTREC_INIT() flightrec_init()
+#define FLIGHTREC(type, a, b) flightrec_log(type, a, b)
+
+#else
+
+#define FLIGHTREC_INIT()
+#define FLIGHTREC(type, a, b)
+
+#endif // FLIGHT_RECORDER_ENABLE
+
+#endif // _FLIGHTREC_H_
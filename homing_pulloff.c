@@ -25,6 +25,9 @@
 
 #include "grbl/nvs_buffer.h"
 
+#include "plugin_nvs.h"
+#include "plugin_prof.h"
+
 typedef struct {
     coord_data_t pulloff;
 } plugin_settings_t;
@@ -86,7 +89,7 @@ static const setting_descr_t plugin_settings_descr[] = {
 
 static void plugin_settings_save (void)
 {
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&homing, sizeof(plugin_settings_t), true);
+    plugin_nvs_write(nvs_address, &homing, sizeof(plugin_settings_t));
 }
 
 static void plugin_settings_restore (void)
@@ -99,7 +102,7 @@ static void plugin_settings_restore (void)
 
     limits_homing_pulloff(&homing.pulloff);
 
-    hal.nvs.memcpy_to_nvs(nvs_address, (uint8_t *)&homing, sizeof(plugin_settings_t), true);
+    plugin_nvs_write(nvs_address, &homing, sizeof(plugin_settings_t));
 }
 
 static void plugin_settings_load (void)
@@ -157,6 +160,15 @@ void homing_pulloff_init (void)
         .restore = plugin_settings_restore
     };
 
+    static plugin_nvs_block_t nvs_block = {
+        .id = PluginNVS_HomingPulloff,
+        .size = sizeof(plugin_settings_t),
+        .address = &nvs_address,
+        .load = plugin_settings_load
+    };
+
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_HomingPulloffInit);
+
     if((nvs_address = nvs_alloc(sizeof(plugin_settings_t)))) {
 
         settings_changed = hal.settings_changed;
@@ -166,7 +178,10 @@ void homing_pulloff_init (void)
         grbl.on_report_options = on_report_my_options;
 
         settings_register(&setting_details);
+        plugin_nvs_register(&nvs_block);
     }
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_HomingPulloffInit);
 }
 
 #endif // HOMING_PULLOFF_ENABLE
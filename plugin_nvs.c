@@ -0,0 +1,434 @@
+/*
+
+  plugin_nvs.c - shared NVS helpers for the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  plugin_nvs_write() replaces hal.nvs.memcpy_to_nvs() with checksum for saving plugin settings,
+  only the range of bytes that differs from the stored copy and the checksum are written.
+
+  Bulk export/import of plugin settings for provisioning, enabled by PLUGIN_NVS_BLOB_ENABLE:
+
+  $NVSEXPORT          - outputs all registered plugin settings blocks as one blob, base64 encoded
+                        in lines of up to 64 characters: [NVSBLOB:<data>], terminated by [NVSBLOB:END].
+  $NVSIMPORT=<data>   - appends base64 data to the import buffer, data length must be a multiple of 4.
+                        When the complete blob is received it is verified and all blocks are written
+                        in one go, if verification fails nothing is written.
+  $NVSIMPORT          - discards any partially received blob.
+
+  Blob format, all values little endian:
+
+    uint16_t magic 'P','N'
+    uint8_t  version
+    uint8_t  number of blocks
+    uint16_t total length, including header and CRC
+    { uint8_t id, uint16_t size, uint8_t data[size] } for each block
+    uint32_t CRC32 of all preceding bytes
+
+*/
+
+#include "driver.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/nvs_buffer.h"
+
+#include "plugin_nvs.h"
+
+static plugin_nvs_block_t *blocks = NULL;
+
+#if PLUGIN_NVS_BLOB_ENABLE
+
+#define BLOB_MAGIC0    'P'
+#define BLOB_MAGIC1    'N'
+#define BLOB_VERSION   1
+#define BLOB_HDR_SIZE  6
+#define BLOB_BLK_HDR   3
+#define BLOB_CRC_SIZE  4
+#define BLOB_LINE_DATA 48 // 64 characters when encoded
+
+typedef struct {
+    uint8_t *data;
+    uint16_t length;
+    uint16_t received;
+} import_t;
+
+static import_t import = {0};
+static on_report_options_ptr on_report_options;
+
+static const char b64chars[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+static uint32_t crc32_update (uint32_t crc, uint8_t data)
+{
+    uint_fast8_t bit = 8;
+
+    crc ^= data;
+
+    do {
+        crc = (crc >> 1) ^ (0xEDB88320 & -(crc & 1));
+    } while(--bit);
+
+    return crc;
+}
+
+static int_fast8_t b64value (char c)
+{
+    const char *s = strchr(b64chars, c);
+
+    return c && s ? (int_fast8_t)(s - b64chars) : -1;
+}
+
+static uint16_t blob_size (void)
+{
+    uint16_t size = BLOB_HDR_SIZE + BLOB_CRC_SIZE;
+    plugin_nvs_block_t *block = blocks;
+
+    while(block) {
+        size += BLOB_BLK_HDR + block->size;
+        block = block->next;
+    }
+
+    return size;
+}
+
+static plugin_nvs_block_t *get_block (plugin_nvs_id_t id)
+{
+    plugin_nvs_block_t *block = blocks;
+
+    while(block && block->id != id)
+        block = block->next;
+
+    return block;
+}
+
+// Export
+
+typedef struct {
+    uint8_t data[BLOB_LINE_DATA];
+    uint_fast8_t len;
+    uint32_t crc;
+} export_t;
+
+static void export_flush (export_t *out)
+{
+    char line[BLOB_LINE_DATA / 3 * 4 + 1], *s = line;
+    uint_fast8_t idx = 0;
+
+    while(idx < out->len) {
+
+        uint32_t triple = out->data[idx] << 16;
+
+        if(idx + 1 < out->len)
+            triple |= out->data[idx + 1] << 8;
+        if(idx + 2 < out->len)
+            triple |= out->data[idx + 2];
+
+        *s++ = b64chars[(triple >> 18) & 0x3F];
+        *s++ = b64chars[(triple >> 12) & 0x3F];
+        *s++ = idx + 1 < out->len ? b64chars[(triple >> 6) & 0x3F] : '=';
+        *s++ = idx + 2 < out->len ? b64chars[triple & 0x3F] : '=';
+
+        idx += 3;
+    }
+
+    *s = '\0';
+    out->len = 0;
+
+    hal.stream.write("[NVSBLOB:");
+    hal.stream.write(line);
+    hal.stream.write("]" ASCII_EOL);
+}
+
+static void export_byte (export_t *out, uint8_t data)
+{
+    out->crc = crc32_update(out->crc, data);
+    out->data[out->len++] = data;
+
+    if(out->len == BLOB_LINE_DATA)
+        export_flush(out);
+}
+
+static status_code_t nvs_export (sys_state_t state, char *args)
+{
+    uint_fast8_t n_blocks = 0;
+    uint16_t idx, size = blob_size();
+    export_t out = { .len = 0, .crc = 0xFFFFFFFF };
+    plugin_nvs_block_t *block = blocks;
+
+    if(args)
+        return Status_InvalidStatement;
+
+    while(block) {
+        n_blocks++;
+        block = block->next;
+    }
+
+    export_byte(&out, BLOB_MAGIC0);
+    export_byte(&out, BLOB_MAGIC1);
+    export_byte(&out, BLOB_VERSION);
+    export_byte(&out, n_blocks);
+    export_byte(&out, size & 0xFF);
+    export_byte(&out, size >> 8);
+
+    block = blocks;
+    while(block) {
+        export_byte(&out, (uint8_t)block->id);
+        export_byte(&out, block->size & 0xFF);
+        export_byte(&out, block->size >> 8);
+        for(idx = 0; idx < block->size; idx++)
+            export_byte(&out, hal.nvs.get_byte(*block->address + idx));
+        block = block->next;
+    }
+
+    out.crc = ~out.crc;
+    for(idx = 0; idx < BLOB_CRC_SIZE; idx++) {
+        uint8_t data = (uint8_t)(out.crc >> (idx * 8));
+        out.data[out.len++] = data; // CRC bytes are not part of the CRC
+        if(out.len == BLOB_LINE_DATA)
+            export_flush(&out);
+    }
+
+    if(out.len)
+        export_flush(&out);
+
+    hal.stream.write("[NVSBLOB:END]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+// Import
+
+static void import_reset (void)
+{
+    if(import.data)
+        free(import.data);
+
+    import.data = NULL;
+    import.length = import.received = 0;
+}
+
+// Verifies the complete blob before anything is written.
+static status_code_t import_verify (void)
+{
+    uint_fast8_t n_blocks = import.data[3];
+    uint16_t idx, pos = BLOB_HDR_SIZE, size;
+    uint32_t crc = 0xFFFFFFFF, blob_crc = 0;
+    plugin_nvs_block_t *block;
+
+    for(idx = 0; idx < import.length - BLOB_CRC_SIZE; idx++)
+        crc = crc32_update(crc, import.data[idx]);
+
+    for(idx = 0; idx < BLOB_CRC_SIZE; idx++)
+        blob_crc |= (uint32_t)import.data[import.length - BLOB_CRC_SIZE + idx] << (idx * 8);
+
+    if(~crc != blob_crc)
+        return Status_FileReadError;
+
+    while(n_blocks--) {
+
+        if(pos + BLOB_BLK_HDR > import.length - BLOB_CRC_SIZE)
+            return Status_FileReadError;
+
+        size = import.data[pos + 1] | (import.data[pos + 2] << 8);
+
+        // Block sizes must match the current firmware.
+        if((block = get_block((plugin_nvs_id_t)import.data[pos])) == NULL || block->size != size)
+            return Status_SettingValueOutOfRange;
+
+        pos += BLOB_BLK_HDR + size;
+    }
+
+    return pos == import.length - BLOB_CRC_SIZE ? Status_OK : Status_FileReadError;
+}
+
+static void import_commit (void)
+{
+    uint_fast8_t n_blocks = import.data[3];
+    uint16_t pos = BLOB_HDR_SIZE, size;
+    plugin_nvs_block_t *block;
+
+    // All blocks are written before any settings are reloaded, with the NVS buffer in use
+    // the changes are committed to physical storage in one operation.
+    while(n_blocks--) {
+        size = import.data[pos + 1] | (import.data[pos + 2] << 8);
+        block = get_block((plugin_nvs_id_t)import.data[pos]);
+        plugin_nvs_write(*block->address, &import.data[pos + BLOB_BLK_HDR], size);
+        pos += BLOB_BLK_HDR + size;
+    }
+
+    block = blocks;
+    while(block) {
+        if(block->load)
+            block->load();
+        block = block->next;
+    }
+}
+
+static status_code_t nvs_import (sys_state_t state, char *args)
+{
+    status_code_t status = Status_OK;
+
+    if(args == NULL) {
+        import_reset();
+        return Status_OK;
+    }
+
+    if(!(state == STATE_IDLE || state == STATE_ALARM))
+        return Status_IdleError;
+
+    size_t len = strlen(args);
+
+    if(len == 0 || (len & 0x03))
+        return Status_InvalidStatement;
+
+    if(import.data == NULL) {
+        import.length = blob_size();
+        if((import.data = malloc(import.length)) == NULL)
+            return Status_NVSFail;
+    }
+
+    while(*args && status == Status_OK) {
+
+        int_fast8_t v[4];
+        uint_fast8_t idx, n = 3;
+
+        for(idx = 0; idx < 4; idx++) {
+            if(args[idx] == '=' && idx >= 2) {
+                v[idx] = 0;
+                if(n == 3)
+                    n = idx - 1;
+            } else if(n < 3 || (v[idx] = b64value(args[idx])) < 0)
+                status = Status_InvalidStatement;
+        }
+
+        if(n < 3 && args[4]) // padding is only allowed at the end
+            status = Status_InvalidStatement;
+
+        if(status == Status_OK) {
+
+            uint32_t triple = (v[0] << 18) | (v[1] << 12) | (v[2] << 6) | v[3];
+
+            for(idx = 0; idx < n; idx++) {
+                if(import.received >= import.length)
+                    status = Status_InvalidStatement;
+                else
+                    import.data[import.received++] = (uint8_t)(triple >> (16 - idx * 8));
+            }
+        }
+
+        args += 4;
+    }
+
+    // Check header as soon as it is available.
+    if(status == Status_OK && import.received >= BLOB_HDR_SIZE) {
+        if(import.data[0] != BLOB_MAGIC0 || import.data[1] != BLOB_MAGIC1 || import.data[2] != BLOB_VERSION)
+            status = Status_InvalidStatement;
+        else if((import.data[4] | (import.data[5] << 8)) != import.length)
+            status = Status_SettingValueOutOfRange;
+    }
+
+    if(status == Status_OK && import.received == import.length) {
+        if((status = import_verify()) == Status_OK) {
+            import_commit();
+            report_message("Plugin settings imported, restart may be required", Message_Info);
+        }
+        import_reset();
+    }
+
+    if(status != Status_OK)
+        import_reset();
+
+    return status;
+}
+
+static void onReportOptions (bool newopt)
+{
+    on_report_options(newopt);
+
+    if(!newopt)
+        report_plugin("Plugin settings blob", "0.01");
+}
+
+static void plugin_nvs_blob_init (void)
+{
+    static const sys_command_t blob_command_list[] = {
+        {"NVSEXPORT", nvs_export, {}, { .str = "output plugin settings as base64 encoded blob" } },
+        {"NVSIMPORT", nvs_import, {}, { .str = "import base64 encoded plugin settings blob" } }
+    };
+
+    static sys_commands_t blob_commands = {
+        .n_commands = sizeof(blob_command_list) / sizeof(sys_command_t),
+        .commands = blob_command_list
+    };
+
+    system_register_commands(&blob_commands);
+
+    on_report_options = grbl.on_report_options;
+    grbl.on_report_options = onReportOptions;
+}
+
+#endif // PLUGIN_NVS_BLOB_ENABLE
+
+// Writes a settings struct followed by its checksum. Only the bytes from the first to the last one
+// that differs from the stored copy are written, the checksum is written separately if changed.
+// The NVS content is used as the shadow copy so no extra RAM is needed. Writes always go through
+// hal.nvs.memcpy_to_nvs() so that the core NVS buffer is flagged for commit to flash.
+nvs_transfer_result_t plugin_nvs_write (nvs_address_t address, void *data, uint16_t size)
+{
+    if(hal.nvs.get_byte) {
+
+        uint8_t *src = (uint8_t *)data, crc[NVS_CRC_BYTES];
+        uint_fast16_t first = 0, last = size;
+        nvs_crc_t checksum = calc_checksum(src, size);
+        nvs_transfer_result_t result = NVS_TransferResult_OK;
+
+        while(first < size && hal.nvs.get_byte(address + first) == src[first])
+            first++;
+
+        while(last > first && hal.nvs.get_byte(address + last - 1) == src[last - 1])
+            last--;
+
+        if(first < last)
+            result = hal.nvs.memcpy_to_nvs(address + first, src + first, last - first, false);
+
+        crc[0] = checksum & 0xFF;
+#if NVS_CRC_BYTES > 1
+        crc[1] = checksum >> 8;
+#endif
+
+        if(result == NVS_TransferResult_OK && (hal.nvs.get_byte(address + size) != crc[0]
+#if NVS_CRC_BYTES > 1
+            || hal.nvs.get_byte(address + size + 1) != crc[1]
+#endif
+          ))
+            result = hal.nvs.memcpy_to_nvs(address + size, crc, NVS_CRC_BYTES, false);
+
+        return result;
+    }
+
+    return hal.nvs.memcpy_to_nvs(address, (uint8_t *)data, size, true);
+}
+
+void plugin_nvs_register (plugin_nvs_block_t *block)
+{
+    plugin_nvs_block_t *last = blocks;
+
+#if PLUGIN_NVS_BLOB_ENABLE
+    if(blocks == NULL)
+        plugin_nvs_blob_init();
+#endif
+
+    block->next = NULL;
+
+    if(last == NULL)
+        blocks = block;
+    else {
+        while(last->next)
+            last = last->next;
+        last->next = block;
+    }
+}
@@ -0,0 +1,37 @@
+/*
+
+  plugin_nvs.h - shared NVS helpers for the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+*/
+
+#ifndef _PLUGIN_NVS_H_
+#define _PLUGIN_NVS_H_
+
+#ifndef PLUGIN_NVS_BLOB_ENABLE
+#define PLUGIN_NVS_BLOB_ENABLE 0
+#endif
+
+// Block ids are part of the exported blob format, do not renumber!
+typedef enum {
+    PluginNVS_EspAt = 1,
+    PluginNVS_EventOut = 2,
+    PluginNVS_HomingPulloff = 3,
+    PluginNVS_BLTouchMesh = 4
+} plugin_nvs_id_t;
+
+typedef struct plugin_nvs_block {
+    plugin_nvs_id_t id;
+    uint16_t size;                  //!< Size of settings struct, excluding checksum.
+    const nvs_address_t *address;   //!< Pointer to plugin NVS address as returned by nvs_alloc().
+    void (*load)(void);             //!< Called after import to (re)load and apply settings.
+    struct plugin_nvs_block *next;
+} plugin_nvs_block_t;
+
+void plugin_nvs_register (plugin_nvs_block_t *block);
+nvs_transfer_result_t plugin_nvs_write (nvs_address_t address, void *data, uint16_t size);
+
+#endif // _PLUGIN_NVS_H_
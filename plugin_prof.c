@@ -0,0 +1,1081 @@
+/*
+
+  plugin_prof.c - optional hook latency instrumentation for the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Records min, max and mean execution time plus a log2 histogram for each
+  hook instrumented with PLUGIN_PROF_BEGIN()/PLUGIN_PROF_END().
+
+  Time is measured in CPU cycles when the DWT cycle counter is available,
+  in microseconds otherwise.
+
+  $PLUGINPROF   - report hook statistics.
+  $PLUGINPROF=R - reset hook statistics.
+  $PLUGINBOOT   - report plugin init and startup task timing.
+  $PLUGINTASKS  - report plugin background task run time and lateness.
+  $PLUGINTASKS=R - reset task statistics.
+
+  Tasks are instrumented by queueing a trampoline in place of the task function, the trampoline records
+  how late the task was run and its run time in microseconds. Tasks running longer than PLUGIN_TASK_BUDGET
+  are counted as over budget. If no trampoline slot is free the task is queued uninstrumented.
+
+  $PLUGINSTALLS - report time the protocol loop is stalled by each plugin.
+  $PLUGINSTALLS=R - reset stall statistics.
+
+  Two kinds of stalls are accounted, in ms: planner syncs caused by M-codes, timed from validation to execution
+  of the block as the core waits for the planner to drain in between, and blocking delays and waits in the plugin code.
+
+  $PLUGINTRACE  - report HAL call trace counters and digest.
+  $PLUGINTRACE=R - reset and start HAL call tracing.
+  $PLUGINTRACE=D - dump the logged port and NVS writes.
+  $PLUGINTRACE=S - stop HAL call tracing and remove the wrappers.
+  $PLUGINTRACE=<digest> - compare trace digest with a golden digest, 8 hex digits.
+
+  Tracing wraps hal.port.digital_out(), hal.port.analog_out(), hal.nvs.memcpy_to_nvs() and the stream write functions
+  when started. Calls are counted and port and NVS writes, including arguments and the data written to NVS, are hashed (FNV-1a) into a digest
+  that can be compared with the digest from a reference run of the same job to detect added or changed I/O.
+  The first PLUGIN_TRACE_SIZE port and NVS writes are also logged, the dump can be diffed against a reference run
+  to find the first call that differs. Wrappers that have been chained over by other code when the trace is stopped
+  are left in place and pass calls through.
+  Stream output is counted but not hashed as it contains timing dependent reports. Ticks is the sum of the time spent in
+  the hooks instrumented with PLUGIN_PROF_BEGIN()/PLUGIN_PROF_END() since trace start.
+
+  $MCODEBENCH[=<iterations>] - benchmark M-code dispatch through the user M-code chain.
+
+  Times the check and validate calls for M150, M220, M280, M401, M402 and an unhandled M-code with 0 - 8 pass-through
+  links added on top of the chain, the same copy-and-chain pattern the plugins use. Execute is only timed for the
+  unhandled M-code since executing the others has side effects, e.g. deploying the BLTouch probe.
+  Results are mean time per call for each number of added links. Hook statistics are reset when done.
+
+  Deferred startup tasks, always available:
+
+  Tasks queued by plugin_defer() are run one at a time from the task scheduler when the
+  controller is ready, i.e. in Idle, Alarm or E-Stop state. Used for non-critical startup
+  work that would otherwise hold up boot, such as WiFi initialization or probe stowing.
+
+*/
+
+#include "driver.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "grbl/hal.h"
+#include "grbl/task.h"
+#include "grbl/state_machine.h"
+
+#include "plugin_prof.h"
+
+typedef struct {
+    foreground_task_ptr fn;
+    void *data;
+} deferred_task_t;
+
+static uint_fast8_t n_deferred = 0;
+static deferred_task_t deferred[PLUGIN_DEFER_MAX];
+
+static void run_deferred (void *data)
+{
+    sys_state_t state = state_get();
+
+    if(n_deferred && (state == STATE_IDLE || (state & (STATE_ALARM|STATE_ESTOP)))) {
+
+        deferred_task_t task = deferred[0];
+
+        if(--n_deferred)
+            memmove(&deferred[0], &deferred[1], n_deferred * sizeof(deferred_task_t));
+
+        task.fn(task.data);
+    }
+
+    if(n_deferred)
+        task_add_delayed(run_deferred, NULL, 10);
+}
+
+// Queues a startup task to be run when the controller is ready, falls back to
+// a foreground task if the queue is full.
+bool plugin_defer (foreground_task_ptr fn, void *data)
+{
+    if(n_deferred == PLUGIN_DEFER_MAX)
+        return protocol_enqueue_foreground_task(fn, data);
+
+    deferred[n_deferred].fn = fn;
+    deferred[n_deferred].data = data;
+
+    if(n_deferred++ == 0)
+        task_add_delayed(run_deferred, NULL, 10);
+
+    return true;
+}
+
+#if PLUGIN_PROFILE_ENABLE
+
+typedef struct {
+    uint32_t start_ms;
+    uint32_t start;
+    uint32_t duration;
+    uint16_t count;
+} plugin_boot_stats_t;
+
+static const char *boot_names[PluginBoot_NumItems] = {
+    "bltouch_init",
+    "bltouch_stow",
+    "esp_at_init",
+    "esp_at_startup",
+    "esp_at_initialize",
+    "event_out_init",
+    "event_out_cfg",
+    "feed_override_init",
+    "homing_pulloff_init",
+    "pwm_servo_init",
+    "rgb_led_init"
+};
+
+static plugin_boot_stats_t boot[PluginBoot_NumItems];
+
+typedef struct {
+    uint32_t count;
+    uint32_t min;
+    uint32_t max;
+    uint64_t sum;
+    uint32_t histogram[PLUGIN_PROF_HIST_BUCKETS];
+} plugin_prof_stats_t;
+
+static const char *hook_names[PluginProf_NumHooks] = {
+    "on_spindle_programmed",
+    "coolant.set_state",
+    "on_state_change",
+    "on_probe_start",
+    "on_probe_completed",
+    "M150 validate",
+    "M150 execute",
+    "M220 validate",
+    "M220 execute",
+    "M280 validate",
+    "M280 execute",
+    "M401/M402 validate",
+    "M401/M402 execute"
+};
+
+static bool init_ok = false;
+static plugin_prof_stats_t stats[PluginProf_NumHooks];
+static on_report_options_ptr on_report_options;
+
+uint32_t plugin_prof_ticks (void)
+{
+#if PLUGIN_PROF_DWT
+    return PLUGIN_PROF_CYCCNT;
+#else
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+#endif
+}
+
+void plugin_prof_record (plugin_prof_hook_t hook, uint32_t start)
+{
+    uint32_t elapsed = plugin_prof_ticks() - start, bucket = 0, limit = 64;
+    plugin_prof_stats_t *hs = &stats[hook];
+
+    if(hs->count == 0 || elapsed < hs->min)
+        hs->min = elapsed;
+    if(elapsed > hs->max)
+        hs->max = elapsed;
+
+    hs->sum += elapsed;
+    hs->count++;
+
+    // Bucket 0 is < 64 ticks, each following bucket doubles the upper limit.
+    while(elapsed >= limit && bucket < PLUGIN_PROF_HIST_BUCKETS - 1) {
+        bucket++;
+        limit <<= 1;
+    }
+
+    hs->histogram[bucket]++;
+}
+
+void plugin_prof_boot_begin (plugin_boot_item_t item)
+{
+    plugin_prof_init(); // ensure cycle counter is running
+
+    boot[item].start_ms = hal.get_elapsed_ticks();
+    boot[item].start = plugin_prof_ticks();
+}
+
+// Only the first run is timed, later runs are counted.
+void plugin_prof_boot_end (plugin_boot_item_t item)
+{
+    if(boot[item].count++ == 0)
+        boot[item].duration = plugin_prof_ticks() - boot[item].start;
+}
+
+static void plugin_prof_reset (void)
+{
+    memset(stats, 0, sizeof(stats));
+}
+
+static status_code_t plugin_prof_report (sys_state_t state, char *args)
+{
+    uint_fast8_t idx, bucket;
+
+    if(args) {
+        if((*args == 'R' || *args == 'r') && args[1] == '\0') {
+            plugin_prof_reset();
+            return Status_OK;
+        }
+        return Status_InvalidStatement;
+    }
+
+    hal.stream.write("[PROFUNIT:" PLUGIN_PROF_UNIT "]" ASCII_EOL);
+
+    for(idx = 0; idx < PluginProf_NumHooks; idx++) {
+
+        if(stats[idx].count == 0)
+            continue;
+
+        hal.stream.write("[PROF:");
+        hal.stream.write(hook_names[idx]);
+        hal.stream.write("|N:");
+        hal.stream.write(uitoa(stats[idx].count));
+        hal.stream.write("|MIN:");
+        hal.stream.write(uitoa(stats[idx].min));
+        hal.stream.write("|AVG:");
+        hal.stream.write(uitoa((uint32_t)(stats[idx].sum / stats[idx].count)));
+        hal.stream.write("|MAX:");
+        hal.stream.write(uitoa(stats[idx].max));
+        hal.stream.write("|HIST:");
+        for(bucket = 0; bucket < PLUGIN_PROF_HIST_BUCKETS; bucket++) {
+            if(bucket)
+                hal.stream.write(",");
+            hal.stream.write(uitoa(stats[idx].histogram[bucket]));
+        }
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+static status_code_t plugin_boot_report (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    hal.stream.write("[PROFUNIT:" PLUGIN_PROF_UNIT "]" ASCII_EOL);
+
+    for(idx = 0; idx < PluginBoot_NumItems; idx++) {
+
+        if(boot[idx].count == 0)
+            continue;
+
+        hal.stream.write("[BOOT:");
+        hal.stream.write(boot_names[idx]);
+        hal.stream.write("|AT:");
+        hal.stream.write(uitoa(boot[idx].start_ms));
+        hal.stream.write("ms|TIME:");
+        hal.stream.write(uitoa(boot[idx].duration));
+        hal.stream.write("|N:");
+        hal.stream.write(uitoa(boot[idx].count));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+// Background tasks
+
+typedef struct {
+    foreground_task_ptr fn;
+    const char *name;
+    uint32_t count;
+    uint32_t run_max;       // us
+    uint64_t run_sum;
+    uint32_t late_max;      // ms
+    uint32_t late_sum;
+    uint32_t over_budget;
+} plugin_task_stats_t;
+
+typedef struct {
+    foreground_task_ptr fn;     // NULL if slot is free
+    void *data;
+    uint32_t due;               // ms
+    plugin_task_stats_t *stats;
+} plugin_task_pending_t;
+
+static uint32_t tasks_dropped = 0;
+static plugin_task_stats_t tasks[PLUGIN_TASK_MAX];
+static plugin_task_pending_t pending[PLUGIN_TASK_PENDING_MAX];
+
+static inline uint32_t task_micros (void)
+{
+    return hal.get_micros ? hal.get_micros() : hal.get_elapsed_ticks() * 1000;
+}
+
+static plugin_task_stats_t *task_stats (foreground_task_ptr fn, const char *name)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < PLUGIN_TASK_MAX; idx++) {
+        if(tasks[idx].fn == fn)
+            return &tasks[idx];
+        if(tasks[idx].fn == NULL) {
+            tasks[idx].fn = fn;
+            tasks[idx].name = name;
+            return &tasks[idx];
+        }
+    }
+
+    return NULL;
+}
+
+static void task_trampoline (void *data)
+{
+    plugin_task_pending_t *task = (plugin_task_pending_t *)data;
+    plugin_task_stats_t *ts = task->stats;
+    foreground_task_ptr fn = task->fn;
+    uint32_t late = hal.get_elapsed_ticks() - task->due, start;
+
+    data = task->data;
+    task->fn = NULL; // free slot before running, the task may requeue itself
+
+    start = task_micros();
+    fn(data);
+    start = task_micros() - start;
+
+    if(start > ts->run_max)
+        ts->run_max = start;
+    if(start > PLUGIN_TASK_BUDGET)
+        ts->over_budget++;
+    if(late > ts->late_max)
+        ts->late_max = late;
+
+    ts->run_sum += start;
+    ts->late_sum += late;
+    ts->count++;
+}
+
+// May be called from interrupt context, slots are claimed with interrupts disabled.
+// Tasks are not instrumented if the driver does not provide interrupt control.
+static plugin_task_pending_t *task_pending (foreground_task_ptr fn, void *data, uint32_t delay, const char *name)
+{
+    uint_fast8_t idx;
+    plugin_task_stats_t *ts;
+    plugin_task_pending_t *task = NULL;
+
+    if(hal.irq_disable == NULL || hal.irq_enable == NULL)
+        return NULL;
+
+    hal.irq_disable();
+
+    if((ts = task_stats(fn, name))) for(idx = 0; idx < PLUGIN_TASK_PENDING_MAX; idx++) {
+        if(pending[idx].fn == NULL) {
+            task = &pending[idx];
+            task->fn = fn;
+            task->data = data;
+            task->due = hal.get_elapsed_ticks() + delay;
+            task->stats = ts;
+            break;
+        }
+    }
+
+    if(task == NULL)
+        tasks_dropped++;
+
+    hal.irq_enable();
+
+    return task;
+}
+
+bool plugin_task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay, const char *name)
+{
+    bool ok;
+    plugin_task_pending_t *task;
+
+    if((task = task_pending(fn, data, delay, name)) == NULL)
+        return (task_add_delayed)(fn, data, delay);
+
+    if(!(ok = (task_add_delayed)(task_trampoline, task, delay)))
+        task->fn = NULL;
+
+    return ok;
+}
+
+bool plugin_task_add_immediate (foreground_task_ptr fn, void *data, const char *name)
+{
+    bool ok;
+    plugin_task_pending_t *task;
+
+    if((task = task_pending(fn, data, 0, name)) == NULL)
+        return (task_add_immediate)(fn, data);
+
+    if(!(ok = (task_add_immediate)(task_trampoline, task)))
+        task->fn = NULL;
+
+    return ok;
+}
+
+void plugin_task_delete (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < PLUGIN_TASK_PENDING_MAX; idx++) {
+        if(pending[idx].fn == fn && pending[idx].data == data) {
+            (task_delete)(task_trampoline, &pending[idx]);
+            pending[idx].fn = NULL; // single store, safe against concurrent claims
+        }
+    }
+
+    (task_delete)(fn, data); // may have been queued uninstrumented
+}
+
+static status_code_t plugin_task_report (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args) {
+        if((*args == 'R' || *args == 'r') && args[1] == '\0') {
+            for(idx = 0; idx < PLUGIN_TASK_MAX; idx++) {
+                tasks[idx].count = tasks[idx].run_max = tasks[idx].late_max = tasks[idx].late_sum = tasks[idx].over_budget = 0;
+                tasks[idx].run_sum = 0;
+            }
+            tasks_dropped = 0;
+            return Status_OK;
+        }
+        return Status_InvalidStatement;
+    }
+
+    hal.stream.write("[TASKBUDGET:");
+    hal.stream.write(uitoa(PLUGIN_TASK_BUDGET));
+    hal.stream.write("us|UNTRACKED:");
+    hal.stream.write(uitoa(tasks_dropped));
+    hal.stream.write("]" ASCII_EOL);
+
+    for(idx = 0; idx < PLUGIN_TASK_MAX && tasks[idx].fn; idx++) {
+
+        if(tasks[idx].count == 0)
+            continue;
+
+        hal.stream.write("[TASK:");
+        hal.stream.write(tasks[idx].name);
+        hal.stream.write("|N:");
+        hal.stream.write(uitoa(tasks[idx].count));
+        hal.stream.write("|AVG:");
+        hal.stream.write(uitoa((uint32_t)(tasks[idx].run_sum / tasks[idx].count)));
+        hal.stream.write("|MAX:");
+        hal.stream.write(uitoa(tasks[idx].run_max));
+        hal.stream.write("|LATE:");
+        hal.stream.write(uitoa(tasks[idx].late_sum / tasks[idx].count));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(tasks[idx].late_max));
+        hal.stream.write("|OVER:");
+        hal.stream.write(uitoa(tasks[idx].over_budget));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+// Stalls
+
+typedef struct {
+    bool validated;
+    uint32_t validated_ms;
+    uint32_t syncs;
+    uint32_t sync_ms;
+    uint32_t delays;
+    uint32_t delay_ms;
+} plugin_stall_stats_t;
+
+static const char *stall_names[PluginStall_NumPlugins] = {
+    "BLTouch",
+    "ESP-AT",
+    "Feed override",
+    "PWM servo",
+    "RGB LED"
+};
+
+static plugin_stall_stats_t stalls[PluginStall_NumPlugins];
+
+// Called when a plugin has validated an M-code, only one block is in flight.
+void plugin_stall_sync_begin (plugin_stall_t plugin)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < PluginStall_NumPlugins; idx++)
+        stalls[idx].validated = false;
+
+    stalls[plugin].validated = true;
+    stalls[plugin].validated_ms = hal.get_elapsed_ticks();
+}
+
+// Called on M-code execution, no-op if the plugin did not validate the block.
+void plugin_stall_sync_end (plugin_stall_t plugin)
+{
+    if(stalls[plugin].validated) {
+        stalls[plugin].validated = false;
+        stalls[plugin].sync_ms += hal.get_elapsed_ticks() - stalls[plugin].validated_ms;
+        stalls[plugin].syncs++;
+    }
+}
+
+void plugin_stall_delay (plugin_stall_t plugin, uint32_t ms)
+{
+    stalls[plugin].delay_ms += ms;
+    stalls[plugin].delays++;
+}
+
+static status_code_t plugin_stall_report (sys_state_t state, char *args)
+{
+    uint_fast8_t idx;
+
+    if(args) {
+        if((*args == 'R' || *args == 'r') && args[1] == '\0') {
+            memset(stalls, 0, sizeof(stalls));
+            return Status_OK;
+        }
+        return Status_InvalidStatement;
+    }
+
+    for(idx = 0; idx < PluginStall_NumPlugins; idx++) {
+
+        if(stalls[idx].syncs == 0 && stalls[idx].delays == 0)
+            continue;
+
+        hal.stream.write("[STALL:");
+        hal.stream.write(stall_names[idx]);
+        hal.stream.write("|SYNC:");
+        hal.stream.write(uitoa(stalls[idx].syncs));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(stalls[idx].sync_ms));
+        hal.stream.write("|DELAY:");
+        hal.stream.write(uitoa(stalls[idx].delays));
+        hal.stream.write(",");
+        hal.stream.write(uitoa(stalls[idx].delay_ms));
+        hal.stream.write("|TOTAL:");
+        hal.stream.write(uitoa(stalls[idx].sync_ms + stalls[idx].delay_ms));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    return Status_OK;
+}
+
+// HAL call trace
+
+typedef enum {
+    Trace_DigitalOut = 0,
+    Trace_AnalogOut,
+    Trace_NVSWrite,
+    Trace_StreamWrite,
+    Trace_NumKinds
+} trace_kind_t;
+
+#if PLUGIN_TRACE_SIZE
+
+typedef struct {
+    uint8_t kind;
+    uint16_t a;     // port or NVS address
+    uint32_t b;     // value, float bits for analog out, or NVS write size
+} trace_call_t;
+
+static const char *trace_names[] = { "DOUT", "AOUT", "NVS" };
+
+#endif
+
+static struct {
+    bool started;
+    bool valid;     // a trace has been run, results are kept when stopped
+    struct {
+        bool digital_out;
+        bool analog_out;
+        bool memcpy_to_nvs;
+        bool stream_changed;
+        bool stream_write;
+        bool stream_write_n;
+    } hooked;       // set while the wrapper is in the call chain
+    uint32_t digest;
+    uint32_t count[Trace_NumKinds];
+    uint32_t stream_bytes;
+    digital_out_ptr digital_out;
+    analog_out_ptr analog_out;
+    nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+    void (*stream_write)(const char *s);
+    void (*stream_write_n)(const char *s, uint16_t length);
+    on_stream_changed_ptr on_stream_changed;
+#if PLUGIN_TRACE_SIZE
+    uint16_t n_calls;   // the first PLUGIN_TRACE_SIZE calls are kept, later calls are only hashed
+    trace_call_t call[PLUGIN_TRACE_SIZE];
+#endif
+} trace = {0};
+
+static void trace_hash (trace_kind_t kind, uint32_t a, uint32_t b)
+{
+    uint_fast8_t idx;
+    uint8_t data[9] = { kind, a, a >> 8, a >> 16, a >> 24, b, b >> 8, b >> 16, b >> 24 };
+
+    for(idx = 0; idx < sizeof(data); idx++)
+        trace.digest = (trace.digest ^ data[idx]) * 16777619UL;
+
+    trace.count[kind]++;
+
+#if PLUGIN_TRACE_SIZE
+    if(trace.n_calls < PLUGIN_TRACE_SIZE) {
+        trace.call[trace.n_calls].kind = kind;
+        trace.call[trace.n_calls].a = (uint16_t)a;
+        trace.call[trace.n_calls++].b = b;
+    }
+#endif
+}
+
+// Wrappers pass calls through uninstrumented when the trace is stopped but could not be removed from the chain.
+
+static void trace_digital_out (uint8_t port, bool on)
+{
+    if(trace.started)
+        trace_hash(Trace_DigitalOut, port, on);
+
+    trace.digital_out(port, on);
+}
+
+static bool trace_analog_out (uint8_t port, float value)
+{
+    union {
+        float f;
+        uint32_t u;
+    } v = { .f = value };
+
+    if(trace.started)
+        trace_hash(Trace_AnalogOut, port, v.u);
+
+    return trace.analog_out(port, value);
+}
+
+static nvs_transfer_result_t trace_memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    if(trace.started) {
+        uint32_t idx;
+
+        trace_hash(Trace_NVSWrite, dest, size);
+
+        // Fold in the content so that writing changed data to the same location changes the digest.
+        for(idx = 0; idx < size; idx++)
+            trace.digest = (trace.digest ^ source[idx]) * 16777619UL;
+        trace.digest = (trace.digest ^ with_checksum) * 16777619UL;
+    }
+
+    return trace.memcpy_to_nvs(dest, source, size, with_checksum);
+}
+
+static void trace_stream_write (const char *s)
+{
+    if(trace.started) {
+        trace.count[Trace_StreamWrite]++;
+        trace.stream_bytes += strlen(s);
+    }
+
+    trace.stream_write(s);
+}
+
+static void trace_stream_write_n (const char *s, uint16_t length)
+{
+    if(trace.started) {
+        trace.count[Trace_StreamWrite]++;
+        trace.stream_bytes += length;
+    }
+
+    trace.stream_write_n(s, length);
+}
+
+static void trace_stream_attach (void)
+{
+    if(!trace.hooked.stream_write) {
+        trace.hooked.stream_write = true;
+        trace.stream_write = hal.stream.write;
+        hal.stream.write = trace_stream_write;
+    }
+    if(hal.stream.write_n && !trace.hooked.stream_write_n) {
+        trace.hooked.stream_write_n = true;
+        trace.stream_write_n = hal.stream.write_n;
+        hal.stream.write_n = trace_stream_write_n;
+    }
+}
+
+// hal.stream is replaced on stream changes, reattach while tracing.
+static void trace_stream_changed (stream_type_t type)
+{
+    if(trace.on_stream_changed)
+        trace.on_stream_changed(type);
+
+    trace.hooked.stream_write = trace.hooked.stream_write_n = false;
+
+    if(trace.started)
+        trace_stream_attach();
+}
+
+static void trace_start (void)
+{
+    if(!trace.started) {
+
+        trace.started = true;
+
+        if(hal.port.digital_out && !trace.hooked.digital_out) {
+            trace.hooked.digital_out = true;
+            trace.digital_out = hal.port.digital_out;
+            hal.port.digital_out = trace_digital_out;
+        }
+
+        if(hal.port.analog_out && !trace.hooked.analog_out) {
+            trace.hooked.analog_out = true;
+            trace.analog_out = hal.port.analog_out;
+            hal.port.analog_out = trace_analog_out;
+        }
+
+        if(hal.nvs.memcpy_to_nvs && !trace.hooked.memcpy_to_nvs) {
+            trace.hooked.memcpy_to_nvs = true;
+            trace.memcpy_to_nvs = hal.nvs.memcpy_to_nvs;
+            hal.nvs.memcpy_to_nvs = trace_memcpy_to_nvs;
+        }
+
+        if(!trace.hooked.stream_changed) {
+            trace.hooked.stream_changed = true;
+            trace.on_stream_changed = grbl.on_stream_changed;
+            grbl.on_stream_changed = trace_stream_changed;
+        }
+
+        trace_stream_attach();
+    }
+
+    trace.valid = true;
+    trace.digest = 2166136261UL; // FNV offset basis
+    trace.stream_bytes = 0;
+    memset(trace.count, 0, sizeof(trace.count));
+#if PLUGIN_TRACE_SIZE
+    trace.n_calls = 0;
+#endif
+
+    plugin_prof_reset();
+}
+
+// Removes the wrappers that are still at the top of their call chain, wrappers
+// chained over by other code stay in place and pass calls through.
+// Returns false if any wrapper could not be removed.
+static bool trace_stop (void)
+{
+    trace.started = false;
+
+    if(trace.hooked.digital_out && hal.port.digital_out == trace_digital_out) {
+        hal.port.digital_out = trace.digital_out;
+        trace.hooked.digital_out = false;
+    }
+
+    if(trace.hooked.analog_out && hal.port.analog_out == trace_analog_out) {
+        hal.port.analog_out = trace.analog_out;
+        trace.hooked.analog_out = false;
+    }
+
+    if(trace.hooked.memcpy_to_nvs && hal.nvs.memcpy_to_nvs == trace_memcpy_to_nvs) {
+        hal.nvs.memcpy_to_nvs = trace.memcpy_to_nvs;
+        trace.hooked.memcpy_to_nvs = false;
+    }
+
+    if(trace.hooked.stream_changed && grbl.on_stream_changed == trace_stream_changed) {
+        grbl.on_stream_changed = trace.on_stream_changed;
+        trace.hooked.stream_changed = false;
+    }
+
+    if(trace.hooked.stream_write && hal.stream.write == trace_stream_write) {
+        hal.stream.write = trace.stream_write;
+        trace.hooked.stream_write = false;
+    }
+
+    if(trace.hooked.stream_write_n && hal.stream.write_n == trace_stream_write_n) {
+        hal.stream.write_n = trace.stream_write_n;
+        trace.hooked.stream_write_n = false;
+    }
+
+    return !(trace.hooked.digital_out || trace.hooked.analog_out || trace.hooked.memcpy_to_nvs ||
+              trace.hooked.stream_changed || trace.hooked.stream_write || trace.hooked.stream_write_n);
+}
+
+#if PLUGIN_TRACE_SIZE
+
+// Outputs the logged calls one per line, for diffing against a reference run.
+static void trace_dump (void)
+{
+    uint_fast16_t idx;
+    union {
+        float f;
+        uint32_t u;
+    } v;
+
+    for(idx = 0; idx < trace.n_calls; idx++) {
+        hal.stream.write("[TRACE:");
+        hal.stream.write(uitoa(idx));
+        hal.stream.write("|");
+        hal.stream.write(trace_names[trace.call[idx].kind]);
+        hal.stream.write("|");
+        hal.stream.write(uitoa(trace.call[idx].a));
+        hal.stream.write("|");
+        if(trace.call[idx].kind == Trace_AnalogOut) {
+            v.u = trace.call[idx].b;
+            hal.stream.write(ftoa(v.f, 3));
+        } else
+            hal.stream.write(uitoa(trace.call[idx].b));
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    hal.stream.write("[TRACE:CALLS:");
+    hal.stream.write(uitoa(trace.count[Trace_DigitalOut] + trace.count[Trace_AnalogOut] + trace.count[Trace_NVSWrite]));
+    hal.stream.write("|LOGGED:");
+    hal.stream.write(uitoa(trace.n_calls));
+    hal.stream.write("]" ASCII_EOL);
+}
+
+#endif
+
+static status_code_t plugin_trace_report (sys_state_t state, char *args)
+{
+    static const char hex[] = "0123456789ABCDEF";
+
+    char digest[9], *end;
+    uint_fast8_t idx;
+    uint32_t ticks = 0;
+
+    if(args && args[1] == '\0') switch(*args) {
+
+        case 'R':
+        case 'r':
+            trace_start();
+            return Status_OK;
+
+        case 'S':
+        case 's':
+            if(!trace_stop())
+                hal.stream.write("[MSG:Trace stopped, some wrappers are chained over and left in place]" ASCII_EOL);
+            return Status_OK;
+
+#if PLUGIN_TRACE_SIZE
+        case 'D':
+        case 'd':
+            if(!trace.valid)
+                return Status_InvalidStatement;
+            trace_dump();
+            return Status_OK;
+#endif
+    }
+
+    if(!trace.valid)
+        return Status_InvalidStatement;
+
+    for(idx = 0; idx < 8; idx++)
+        digest[idx] = hex[(trace.digest >> (28 - idx * 4)) & 0x0F];
+    digest[8] = '\0';
+
+    if(args) {
+
+        uint32_t golden = strtoul(args, &end, 16);
+
+        if(end == args || *end != '\0' || strlen(args) != 8)
+            return Status_BadNumberFormat;
+
+        hal.stream.write("[TRACE:");
+        hal.stream.write(golden == trace.digest ? "PASS|" : "FAIL|");
+        hal.stream.write(digest);
+        hal.stream.write("]" ASCII_EOL);
+
+        return Status_OK;
+    }
+
+    for(idx = 0; idx < PluginProf_NumHooks; idx++)
+        ticks += (uint32_t)stats[idx].sum;
+
+    hal.stream.write("[TRACE:DIGEST:");
+    hal.stream.write(digest);
+    hal.stream.write("|DOUT:");
+    hal.stream.write(uitoa(trace.count[Trace_DigitalOut]));
+    hal.stream.write("|AOUT:");
+    hal.stream.write(uitoa(trace.count[Trace_AnalogOut]));
+    hal.stream.write("|NVS:");
+    hal.stream.write(uitoa(trace.count[Trace_NVSWrite]));
+    hal.stream.write("|STREAM:");
+    hal.stream.write(uitoa(trace.count[Trace_StreamWrite]));
+    hal.stream.write(",");
+    hal.stream.write(uitoa(trace.stream_bytes));
+    hal.stream.write("|TICKS:");
+    hal.stream.write(uitoa(ticks));
+    hal.stream.write("]" ASCII_EOL);
+
+    return Status_OK;
+}
+
+// M-code dispatch benchmark
+
+#define MCODEBENCH_LINKS 8
+#define MCODEBENCH_UNHANDLED ((user_mcode_t)9999)
+
+static user_mcode_ptrs_t bench_next[MCODEBENCH_LINKS];
+
+#define BENCH_LINK(n) \
+static user_mcode_type_t bench_check_##n (user_mcode_t mcode) \
+{ \
+    return bench_next[n].check ? bench_next[n].check(mcode) : UserMCode_Unsupported; \
+} \
+static status_code_t bench_validate_##n (parser_block_t *gc_block) \
+{ \
+    return bench_next[n].validate ? bench_next[n].validate(gc_block) : Status_Unhandled; \
+} \
+static void bench_execute_##n (uint_fast16_t state, parser_block_t *gc_block) \
+{ \
+    if(bench_next[n].execute) \
+        bench_next[n].execute(state, gc_block); \
+}
+
+BENCH_LINK(0)
+BENCH_LINK(1)
+BENCH_LINK(2)
+BENCH_LINK(3)
+BENCH_LINK(4)
+BENCH_LINK(5)
+BENCH_LINK(6)
+BENCH_LINK(7)
+
+static const user_mcode_ptrs_t bench_links[MCODEBENCH_LINKS] = {
+    { bench_check_0, bench_validate_0, bench_execute_0 },
+    { bench_check_1, bench_validate_1, bench_execute_1 },
+    { bench_check_2, bench_validate_2, bench_execute_2 },
+    { bench_check_3, bench_validate_3, bench_execute_3 },
+    { bench_check_4, bench_validate_4, bench_execute_4 },
+    { bench_check_5, bench_validate_5, bench_execute_5 },
+    { bench_check_6, bench_validate_6, bench_execute_6 },
+    { bench_check_7, bench_validate_7, bench_execute_7 }
+};
+
+static void bench_write (uint32_t ticks, uint32_t iterations, bool first)
+{
+    if(!first)
+        hal.stream.write(",");
+    hal.stream.write(ftoa((float)ticks / (float)iterations, 2));
+}
+
+static status_code_t mcode_bench (sys_state_t state, char *args)
+{
+    static const user_mcode_t mcodes[] = { RGB_WriteLEDs, SetFeedOverrides, PWMServo_SetPosition, Probe_Deploy, Probe_Stow, MCODEBENCH_UNHANDLED };
+
+    char *end;
+    uint32_t iterations = 1000, i, start, check[MCODEBENCH_LINKS + 1], validate[MCODEBENCH_LINKS + 1], execute[MCODEBENCH_LINKS + 1];
+    uint_fast8_t idx, links;
+    parser_block_t block;
+    user_mcode_ptrs_t user_mcode;
+
+    if(state != STATE_IDLE)
+        return Status_IdleError;
+
+    if(args) {
+        iterations = strtoul(args, &end, 10);
+        if(end == args || *end != '\0' || iterations == 0 || iterations > 100000)
+            return Status_BadNumberFormat;
+    }
+
+    memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+
+    hal.stream.write("[PROFUNIT:" PLUGIN_PROF_UNIT "]" ASCII_EOL);
+
+    for(idx = 0; idx < sizeof(mcodes) / sizeof(user_mcode_t); idx++) {
+
+        for(links = 0; links <= MCODEBENCH_LINKS; links++) {
+
+            if(links) {
+                memcpy(&bench_next[links - 1], &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
+                memcpy(&grbl.user_mcode, &bench_links[links - 1], sizeof(user_mcode_ptrs_t));
+            }
+
+            memset(&block, 0, sizeof(parser_block_t));
+            block.user_mcode = mcodes[idx];
+
+            start = plugin_prof_ticks();
+            if(grbl.user_mcode.check) for(i = 0; i < iterations; i++)
+                grbl.user_mcode.check(mcodes[idx]);
+            check[links] = plugin_prof_ticks() - start;
+
+            start = plugin_prof_ticks();
+            if(grbl.user_mcode.validate) for(i = 0; i < iterations; i++)
+                grbl.user_mcode.validate(&block);
+            validate[links] = plugin_prof_ticks() - start;
+
+            if(mcodes[idx] == MCODEBENCH_UNHANDLED) {
+                start = plugin_prof_ticks();
+                if(grbl.user_mcode.execute) for(i = 0; i < iterations; i++)
+                    grbl.user_mcode.execute(state, &block);
+                execute[links] = plugin_prof_ticks() - start;
+            }
+        }
+
+        memcpy(&grbl.user_mcode, &user_mcode, sizeof(user_mcode_ptrs_t));
+
+        hal.stream.write("[MCODEBENCH:M");
+        hal.stream.write(uitoa((uint32_t)mcodes[idx]));
+        hal.stream.write("|CHECK:");
+        for(links = 0; links <= MCODEBENCH_LINKS; links++)
+            bench_write(check[links], iterations, links == 0);
+        hal.stream.write("|VALIDATE:");
+        for(links = 0; links <= MCODEBENCH_LINKS; links++)
+            bench_write(validate[links], iterations, links == 0);
+        if(mcodes[idx] == MCODEBENCH_UNHANDLED) {
+            hal.stream.write("|EXECUTE:");
+            for(links = 0; links <= MCODEBENCH_LINKS; links++)
+                bench_write(execute[links], iterations, links == 0);
+        }
+        hal.stream.write("]" ASCII_EOL);
+    }
+
+    plugin_prof_reset();
+
+    for(idx = 0; idx < PluginStall_NumPlugins; idx++)
+        stalls[idx].validated = false;
+
+    return Status_OK;
+}
+
+static void onReportOptions (bool newopt)
+{
+    on_report_options(newopt);
+
+    if(!newopt)
+        report_plugin("Plugin profiler", "0.05");
+}
+
+void plugin_prof_init (void)
+{
+    static const sys_command_t prof_command_list[] = {
+        {"PLUGINPROF", plugin_prof_report, {}, { .str = "report plugin hook latencies, $PLUGINPROF=R to reset" } },
+        {"PLUGINBOOT", plugin_boot_report, {}, { .str = "report plugin init and startup timing" } },
+        {"PLUGINTASKS", plugin_task_report, {}, { .str = "report plugin task run time and lateness, $PLUGINTASKS=R to reset" } },
+        {"PLUGINSTALLS", plugin_stall_report, {}, { .str = "report protocol loop stalls per plugin, $PLUGINSTALLS=R to reset" } },
+        {"PLUGINTRACE", plugin_trace_report, {}, { .str = "report HAL call trace, $PLUGINTRACE=R to start, =D to dump, =S to stop, =<digest> to compare" } },
+        {"MCODEBENCH", mcode_bench, {}, { .str = "benchmark M-code dispatch through the plugin chain, $MCODEBENCH=<iterations>" } }
+    };
+
+    static sys_commands_t prof_commands = {
+        .n_commands = sizeof(prof_command_list) / sizeof(sys_command_t),
+        .commands = prof_command_list
+    };
+
+    if(init_ok)
+        return;
+
+    init_ok = true;
+
+#if PLUGIN_PROF_DWT
+    *(volatile uint32_t *)0xE000EDFC |= (1 << 24);  // CoreDebug->DEMCR |= TRCENA
+    PLUGIN_PROF_CYCCNT = 0;
+    *(volatile uint32_t *)0xE0001000 |= 1;          // DWT->CTRL |= CYCCNTENA
+#endif
+
+    plugin_prof_reset();
+    memset(stalls, 0, sizeof(stalls));
+
+    system_register_commands(&prof_commands);
+
+    on_report_options = grbl.on_report_options;
+    grbl.on_report_options = onReportOptions;
+}
+
+#endif // PLUGIN_PROFILE_ENABLE
@@ -0,0 +1,156 @@
+/*
+
+  plugin_prof.h - optional hook latency instrumentation for the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Enable by adding #define PLUGIN_PROFILE_ENABLE 1 to my_machine.h,
+  when disabled the instrumentation macros expands to nothing.
+
+  $PLUGINPROF   - report hook statistics.
+  $PLUGINPROF=R - reset hook statistics.
+  $PLUGINBOOT   - report plugin init and startup task timing.
+  $PLUGINTASKS  - report plugin background task run time and lateness.
+  $PLUGINTASKS=R - reset task statistics.
+  $PLUGINSTALLS - report time the protocol loop is stalled by each plugin.
+  $PLUGINSTALLS=R - reset stall statistics.
+  $PLUGINTRACE  - report HAL call trace counters and digest.
+  $PLUGINTRACE=R - reset and start HAL call tracing.
+  $PLUGINTRACE=<digest> - compare trace digest with a golden digest.
+  $MCODEBENCH[=<iterations>] - benchmark M-code dispatch through the user M-code chain.
+
+  When enabled task_add_delayed(), task_add_immediate() and task_delete() calls in files including
+  this header are redirected to instrumented wrappers.
+
+  plugin_defer() is always available, it is used for queueing non-critical startup work
+  to be run after the controller is ready rather than as a foreground task at boot.
+
+*/
+
+#ifndef _PLUGIN_PROF_H_
+#define _PLUGIN_PROF_H_
+
+#ifndef PLUGIN_PROFILE_ENABLE
+#define PLUGIN_PROFILE_ENABLE 0
+#endif
+
+#ifndef PLUGIN_DEFER_MAX
+#define PLUGIN_DEFER_MAX 4
+#endif
+
+bool plugin_defer (foreground_task_ptr fn, void *data);
+
+#if PLUGIN_PROFILE_ENABLE
+
+#include <stdint.h>
+
+// Use the DWT cycle counter where available, fall back to microseconds if not.
+#if defined(__ARM_ARCH_7M__) || defined(__ARM_ARCH_7EM__) || defined(__ARM_ARCH_8M_MAIN__)
+#define PLUGIN_PROF_DWT 1
+#define PLUGIN_PROF_CYCCNT (*(volatile uint32_t *)0xE0001004)
+#define PLUGIN_PROF_UNIT "cycles"
+#else
+#define PLUGIN_PROF_DWT 0
+#define PLUGIN_PROF_UNIT "us"
+#endif
+
+#define PLUGIN_PROF_HIST_BUCKETS 12
+
+#ifndef PLUGIN_TASK_MAX
+#define PLUGIN_TASK_MAX 24          // number of task functions tracked
+#endif
+#ifndef PLUGIN_TASK_PENDING_MAX
+#define PLUGIN_TASK_PENDING_MAX 16  // number of instrumented tasks that can be queued at the same time
+#endif
+#ifndef PLUGIN_TASK_BUDGET
+#define PLUGIN_TASK_BUDGET 1000     // us, tasks running longer are counted as over budget
+#endif
+#ifndef PLUGIN_TRACE_SIZE
+#define PLUGIN_TRACE_SIZE 128       // number of port and NVS writes logged for $PLUGINTRACE=D, 0 to disable
+#endif
+
+typedef enum {
+    PluginProf_SpindleProgrammed = 0,
+    PluginProf_CoolantSetState,
+    PluginProf_StateChange,
+    PluginProf_ProbeStart,
+    PluginProf_ProbeCompleted,
+    PluginProf_M150_Validate,
+    PluginProf_M150_Execute,
+    PluginProf_M220_Validate,
+    PluginProf_M220_Execute,
+    PluginProf_M280_Validate,
+    PluginProf_M280_Execute,
+    PluginProf_M401_Validate,
+    PluginProf_M401_Execute,
+    PluginProf_NumHooks
+} plugin_prof_hook_t;
+
+typedef enum {
+    PluginBoot_BLTouchInit = 0,
+    PluginBoot_BLTouchStow,
+    PluginBoot_EspAtInit,
+    PluginBoot_EspAtStartup,
+    PluginBoot_EspAtInitialize,
+    PluginBoot_EventOutInit,
+    PluginBoot_EventOutCfg,
+    PluginBoot_FeedOverrideInit,
+    PluginBoot_HomingPulloffInit,
+    PluginBoot_PWMServoInit,
+    PluginBoot_RGBLedInit,
+    PluginBoot_NumItems
+} plugin_boot_item_t;
+
+typedef enum {
+    PluginStall_BLTouch = 0,
+    PluginStall_EspAt,
+    PluginStall_FeedOverride,
+    PluginStall_PWMServo,
+    PluginStall_RGBLed,
+    PluginStall_NumPlugins
+} plugin_stall_t;
+
+uint32_t plugin_prof_ticks (void);
+void plugin_prof_record (plugin_prof_hook_t hook, uint32_t start);
+void plugin_prof_boot_begin (plugin_boot_item_t item);
+void plugin_prof_boot_end (plugin_boot_item_t item);
+void plugin_prof_init (void);
+void plugin_stall_sync_begin (plugin_stall_t plugin);
+void plugin_stall_sync_end (plugin_stall_t plugin);
+void plugin_stall_delay (plugin_stall_t plugin, uint32_t ms);
+
+#define PLUGIN_PROF_INIT() plugin_prof_init()
+#define PLUGIN_PROF_BEGIN(hook) const uint32_t prof_##hook = plugin_prof_ticks()
+#define PLUGIN_PROF_END(hook) plugin_prof_record(hook, prof_##hook)
+#define PLUGIN_PROF_BOOT_BEGIN(item) plugin_prof_boot_begin(item)
+#define PLUGIN_PROF_BOOT_END(item) plugin_prof_boot_end(item)
+#define PLUGIN_STALL_SYNC_BEGIN(plugin) plugin_stall_sync_begin(plugin)
+#define PLUGIN_STALL_SYNC_END(plugin) plugin_stall_sync_end(plugin)
+#define PLUGIN_STALL_DELAY(plugin, ms) plugin_stall_delay(plugin, ms)
+
+#include "grbl/task.h"
+
+bool plugin_task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay, const char *name);
+bool plugin_task_add_immediate (foreground_task_ptr fn, void *data, const char *name);
+void plugin_task_delete (foreground_task_ptr fn, void *data);
+
+#define task_add_delayed(fn, data, delay) plugin_task_add_delayed(fn, data, delay, #fn)
+#define task_add_immediate(fn, data) plugin_task_add_immediate(fn, data, #fn)
+#define task_delete(fn, data) plugin_task_delete(fn, data)
+
+#else
+
+#define PLUGIN_PROF_INIT()
+#define PLUGIN_PROF_BEGIN(hook)
+#define PLUGIN_PROF_END(hook)
+#define PLUGIN_PROF_BOOT_BEGIN(item)
+#define PLUGIN_PROF_BOOT_END(item)
+#define PLUGIN_STALL_SYNC_BEGIN(plugin)
+#define PLUGIN_STALL_SYNC_END(plugin)
+#define PLUGIN_STALL_DELAY(plugin, ms)
+
+#endif // PLUGIN_PROFILE_ENABLE
+
+#endif // _PLUGIN_PROF_H_
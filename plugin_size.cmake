@@ -0,0 +1,67 @@
+# plugin_size.cmake - reports .text, .data and .bss usage per misc. plugin.
+#
+# Invoked as a post build step by misc_plugins_memory_report(), see CMakeLists.txt.
+#
+#  OBJ_DIR   - object directory of the firmware target.
+#  SIZE_TOOL - size utility matching the toolchain, e.g. arm-none-eabi-size.
+#  PLUGINS   - comma separated list of plugin source file names.
+#
+# The sizes are saved to misc_plugins_size.txt in OBJ_DIR, when a previous build has saved sizes
+# the change per plugin is reported as well. E.g. build with and without EVENTOUT_STATIC to get the
+# flash (.text + .data) and RAM (.data + .bss) saved by the static mode.
+
+set(objects "")
+string(REPLACE "," ";" PLUGINS "${PLUGINS}")
+
+foreach(plugin IN LISTS PLUGINS)
+    file(GLOB_RECURSE found "${OBJ_DIR}/*${plugin}.o" "${OBJ_DIR}/*${plugin}.obj")
+    list(APPEND objects ${found})
+endforeach()
+
+if(NOT objects)
+    message(STATUS "Misc. plugins memory usage: no plugin objects found in ${OBJ_DIR}")
+    return()
+endif()
+
+execute_process(COMMAND ${SIZE_TOOL} -B -t ${objects} OUTPUT_VARIABLE report)
+message(STATUS "Misc. plugins memory usage:\n${report}")
+
+set(saved "${OBJ_DIR}/misc_plugins_size.txt")
+set(sizes "")
+
+string(REPLACE "\n" ";" lines "${report}")
+foreach(line IN LISTS lines)
+    if(line MATCHES "^[ \t]*([0-9]+)[ \t]+([0-9]+)[ \t]+([0-9]+)[ \t]+[0-9]+[ \t]+[0-9a-fA-F]+[ \t]+(.+)$")
+        get_filename_component(name "${CMAKE_MATCH_4}" NAME)
+        string(STRIP "${name}" name)
+        string(APPEND sizes "${name} ${CMAKE_MATCH_1} ${CMAKE_MATCH_2} ${CMAKE_MATCH_3}\n")
+    endif()
+endforeach()
+
+if(EXISTS "${saved}")
+    file(STRINGS "${saved}" previous)
+    set(changes "")
+    string(REPLACE "\n" ";" current "${sizes}")
+    foreach(entry IN LISTS current)
+        if(entry MATCHES "^([^ ]+) ([0-9]+) ([0-9]+) ([0-9]+)$")
+            set(name ${CMAKE_MATCH_1})
+            set(text ${CMAKE_MATCH_2})
+            set(data ${CMAKE_MATCH_3})
+            set(bss ${CMAKE_MATCH_4})
+            foreach(old IN LISTS previous)
+                if(old MATCHES "^([^ ]+) ([0-9]+) ([0-9]+) ([0-9]+)$" AND CMAKE_MATCH_1 STREQUAL name)
+                    math(EXPR flash "(${text} + ${data}) - (${CMAKE_MATCH_2} + ${CMAKE_MATCH_3})")
+                    math(EXPR ram "(${data} + ${bss}) - (${CMAKE_MATCH_3} + ${CMAKE_MATCH_4})")
+                    if(NOT (flash EQUAL 0 AND ram EQUAL 0))
+                        string(APPEND changes "  ${name}: flash ${flash}, RAM ${ram}\n")
+                    endif()
+                endif()
+            endforeach()
+        endif()
+    endforeach()
+    if(changes)
+        message(STATUS "Misc. plugins memory usage change from previous build (bytes):\n${changes}")
+    endif()
+endif()
+
+file(WRITE "${saved}" "${sizes}")
@@ -32,6 +32,9 @@
 #include "grbl/protocol.h"
 #include "grbl/ioports.h"
 
+#include "plugin_prof.h"
+#include "flightrec.h"
+
 #ifndef N_PWM_SERVOS
 #define N_PWM_SERVOS 1
 #endif
@@ -51,7 +54,6 @@
 
 typedef struct {
     uint8_t port; //Port number, referring to (analog) HAL port number
-    xbar_t xport; //Handle to ioport xbar object, obtained at init
     float min_angle;
     float max_angle;
     float angle; //Current setpoint for the angle. (degrees)
@@ -81,7 +83,16 @@ static bool pwm_servo_set_angle(uint8_t servo, float angle)
 
 static float pwm_servo_get_angle(uint8_t servo)
 {
-    return servo < n_servos ? (servos[servo].xport.get_value ? servos[servo].xport.get_value(&servos[servo].xport) : servos[servo].angle) : -1.0f;
+    xbar_t *pwm_pin;
+
+    if(servo >= n_servos)
+        return -1.0f;
+
+    // Fetch pin info on demand rather than keeping a copy of the xbar_t struct per servo.
+    if(hal.port.get_pin_info && (pwm_pin = hal.port.get_pin_info(Port_Analog, Port_Output, servos[servo].port)) && pwm_pin->get_value)
+        return pwm_pin->get_value(pwm_pin);
+
+    return servos[servo].angle;
 }
 
 static user_mcode_type_t mcode_check (user_mcode_t mcode)
@@ -93,6 +104,8 @@ static user_mcode_type_t mcode_check (user_mcode_t mcode)
 
 static status_code_t mcode_validate (parser_block_t *gc_block)
 {
+    PLUGIN_PROF_BEGIN(PluginProf_M280_Validate);
+
     status_code_t state = Status_OK;
 
     if(gc_block->user_mcode == PWMServo_SetPosition) {
@@ -102,12 +115,17 @@ static status_code_t mcode_validate (parser_block_t *gc_block)
             else if(gc_block->words.p && ((uint8_t)gc_block->values.p >= n_servos))
                 state = Status_GcodeValueOutOfRange;
         }
-        if(gc_block->words.s && (gc_block->values.s < servos[(uint32_t)gc_block->values.p].min_angle || gc_block->values.s > servos[(uint32_t)gc_block->values.p].max_angle))
+        if(state == Status_OK && gc_block->words.s && (gc_block->values.s < servos[(uint32_t)gc_block->values.p].min_angle || gc_block->values.s > servos[(uint32_t)gc_block->values.p].max_angle))
             state = Status_GcodeValueOutOfRange;
         gc_block->words.s = gc_block->words.p = Off;
     } else
         state = Status_Unhandled;
 
+    PLUGIN_PROF_END(PluginProf_M280_Validate);
+
+    if(state == Status_OK)
+        PLUGIN_STALL_SYNC_BEGIN(PluginStall_PWMServo);
+
     return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
 }
 
@@ -115,13 +133,19 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
 {
     if(gc_block->user_mcode == PWMServo_SetPosition) {
 
+        PLUGIN_STALL_SYNC_END(PluginStall_PWMServo);
+        PLUGIN_PROF_BEGIN(PluginProf_M280_Execute);
+
         uint8_t servo = (uint8_t)gc_block->values.p;
 
+        FLIGHTREC(FlightRec_MCode, 0, PWMServo_SetPosition);
+
         if(gc_block->words.s) {
 #ifdef DEBUGOUT
             debug_print("Setting servo position");
 #endif
             pwm_servo_set_angle(servo, gc_block->values.s);
+            FLIGHTREC(FlightRec_Servo, servo, (uint16_t)gc_block->values.s);
         } else {
             //Reads the position/pwm
             float value = pwm_servo_get_angle(servo);
@@ -139,6 +163,9 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
                 hal.stream.write(buf);
             }
         }
+
+        PLUGIN_PROF_END(PluginProf_M280_Execute);
+
     } else if(user_mcode.execute)
         user_mcode.execute(state, gc_block);
 }
@@ -189,9 +216,6 @@ static bool servo_attach (xbar_t *pwm_pin, uint8_t port, void *data)
 
             if(pwm_pin->config(pwm_pin, &config, false)) {
 
-                if(pwm_pin->get_value)
-                    memcpy(&servos[n_servos].xport, pwm_pin, sizeof(xbar_t));
-
                 if(hal.port.set_pin_description)
                     hal.port.set_pin_description(Port_Analog, Port_Output, port, descr[n_servos]);
 
@@ -205,6 +229,9 @@ static bool servo_attach (xbar_t *pwm_pin, uint8_t port, void *data)
 
 void pwm_servo_init (void)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_PWMServoInit);
+    PLUGIN_PROF_INIT();
+
     memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
 
     grbl.user_mcode.check = mcode_check;
@@ -215,6 +242,8 @@ void pwm_servo_init (void)
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_PWMServoInit);
 }
 
 #endif // PWM_SERVO_ENABLE
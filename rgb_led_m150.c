@@ -62,6 +62,8 @@ static status_code_t parameter_validate (float *value)
 
 static status_code_t mcode_validate (parser_block_t *gc_block)
 {
+    PLUGIN_PROF_BEGIN(PluginProf_M150_Validate);
+
     status_code_t state = Status_OK;
 
     switch(gc_block->user_mcode) {
@@ -69,25 +71,29 @@ static status_code_t mcode_validate (parser_block_t *gc_block)
         case RGB_WriteLEDs:
 
             if(gc_block->words.b && (state = parameter_validate(&gc_block->values.b)) != Status_OK)
-                return state;
+                break;
 
             if(gc_block->words.r && (state = parameter_validate(&gc_block->values.r)) != Status_OK)
-                return state;
+                break;
 
             if(gc_block->words.u && (state = parameter_validate(&gc_block->values.u)) != Status_OK)
-                return state;
+                break;
 
             if(gc_block->words.w && (state = parameter_validate(&gc_block->values.w)) != Status_OK)
-                return state;
+                break;
 
             if(gc_block->words.p && is_neopixels && (state = parameter_validate(&gc_block->values.p)) != Status_OK)
-                return state;
+                break;
 
-            if(!(gc_block->words.r || gc_block->words.u || gc_block->words.b || gc_block->words.w || gc_block->words.p))
-                return Status_GcodeValueWordMissing;
+            if(!(gc_block->words.r || gc_block->words.u || gc_block->words.b || gc_block->words.w || gc_block->words.p)) {
+                state = Status_GcodeValueWordMissing;
+                break;
+            }
 
-            if(gc_block->words.s && !(gc_block->values.s == 0.0f || (gc_block->values.s == 1.0f && !!hal.rgb1.out)))
-                return Status_GcodeValueOutOfRange;
+            if(gc_block->words.s && !(gc_block->values.s == 0.0f || (gc_block->values.s == 1.0f && !!hal.rgb1.out))) {
+                state = Status_GcodeValueOutOfRange;
+                break;
+            }
 
             rgb_ptr_t *strip = gc_block->words.s && gc_block->values.s == 1.0f ? &hal.rgb1 : &hal.rgb0;
 
@@ -109,6 +115,11 @@ static status_code_t mcode_validate (parser_block_t *gc_block)
             break;
     }
 
+    PLUGIN_PROF_END(PluginProf_M150_Validate);
+
+    if(state == Status_OK)
+        PLUGIN_STALL_SYNC_BEGIN(PluginStall_RGBLed);
+
     return state == Status_Unhandled && user_mcode.validate ? user_mcode.validate(gc_block) : state;
 }
 
@@ -116,6 +127,9 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
 {
     static rgb_color_t color = {0}; // TODO: allocate for all leds?
 
+    PLUGIN_STALL_SYNC_END(PluginStall_RGBLed);
+    PLUGIN_PROF_BEGIN(PluginProf_M150_Execute);
+
     bool handled = true;
 
     if(state != STATE_CHECK_MODE) {
@@ -126,6 +140,8 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
 
              case RGB_WriteLEDs:;
 
+                 FLIGHTREC(FlightRec_MCode, 0, RGB_WriteLEDs);
+
                  bool set_colors;
                  uint16_t device = gc_block->words.i ? (uint16_t)gc_block->values.ijk[0] : 0;
                  rgb_color_mask_t mask = { .value = 0xFF };
@@ -195,6 +211,8 @@ static void mcode_execute (uint_fast16_t state, parser_block_t *gc_block)
         }
     }
 
+    PLUGIN_PROF_END(PluginProf_M150_Execute);
+
     if(!handled && user_mcode.execute)
         user_mcode.execute(state, gc_block);
 }
@@ -211,6 +229,9 @@ static void onReportOptions (bool newopt)
 
 void rgb_led_init (void)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_RGBLedInit);
+    PLUGIN_PROF_INIT();
+
     if(hal.rgb0.out) {
 
         memcpy(&user_mcode, &grbl.user_mcode, sizeof(user_mcode_ptrs_t));
@@ -224,6 +245,8 @@ void rgb_led_init (void)
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_RGBLedInit);
 }
 
 #endif // RGB_LED_ENABLE
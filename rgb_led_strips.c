@@ -15,6 +15,9 @@
 
 #if RGB_LED_ENABLE
 
+#include "plugin_prof.h"
+#include "flightrec.h"
+
 static bool is_setting_available (const setting_detail_t *setting, uint_fast16_t offset)
 {
     bool available = false;
@@ -76,11 +79,15 @@ static void onReportOptions (bool newopt)
 
 void rgb_led_init (void)
 {
+    PLUGIN_PROF_BOOT_BEGIN(PluginBoot_RGBLedInit);
+
     if((led_enabled = hal.rgb0.flags.is_strip || hal.rgb1.flags.is_strip))
         settings_register(&setting_details);
 
     on_report_options = grbl.on_report_options;
     grbl.on_report_options = onReportOptions;
+
+    PLUGIN_PROF_BOOT_END(PluginBoot_RGBLedInit);
 }
 
 #else
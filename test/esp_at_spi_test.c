@@ -0,0 +1,313 @@
+/*
+
+  esp_at_spi_test.c - host test of the ESP-AT SPI transport against the simulated peer
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  The transport is opened with esp_at_spi_open(esp_at_spi_mock()) through a pass-through port that records
+  each transaction, command, address and the bytes clocked out and in, from chip select to release.
+  Checks the write request handshake, chunking of writes larger than ESP_AT_SPI_CHUNK_SIZE with a new
+  sequence number per chunk, WR_DONE after each write, the readable status -> RD_DMA -> RD_DONE read path
+  and that the write request is repeated when the peer does not respond within the timeout.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock/mock.h"
+#include "esp_at_spi.h"
+
+#define SPI_WR_BUF      0x01
+#define SPI_RD_BUF      0x02
+#define SPI_WR_DMA      0x03
+#define SPI_RD_DMA      0x04
+#define SPI_WR_DONE     0x07
+#define SPI_RD_DONE     0x08
+
+#define SPI_STATUS_ADDR 0x04
+#define SPI_REQUEST     0xFE
+#define SPI_READABLE    0x01
+#define SPI_WRITABLE    0x02
+#define SPI_TIMEOUT     100
+
+#define MAX_TRANSACTIONS 64
+#define MAX_DATA 512
+
+#define CHECK(cond) check(cond, #cond, __LINE__)
+
+typedef struct {
+    uint32_t ms;
+    uint8_t cmd;
+    uint8_t addr;
+    uint16_t len;           // number of data bytes after the command, address and dummy bytes
+    uint8_t out[MAX_DATA];
+    uint8_t in[MAX_DATA];
+} transaction_t;
+
+static struct {
+    const esp_at_spi_port_t *peer;
+    bool deaf;              // drop transactions and keep the handshake released, simulates a peer not responding
+    bool selected;
+    bool overrun;           // more than MAX_TRANSACTIONS recorded, the excess is dropped
+    uint16_t idx;
+    uint16_t n;
+    transaction_t t[MAX_TRANSACTIONS];
+} bus;
+
+static uint32_t failures = 0;
+
+// Driver SPI, referenced by the transport when opened with the configured ports.
+
+void spi_init (void)
+{
+}
+
+uint8_t spi_put_byte (uint8_t byte)
+{
+    return 0;
+}
+
+static void check (bool ok, const char *cond, int line)
+{
+    if(!ok) {
+        fprintf(stderr, "esp_at_spi_test.c:%d: check failed: %s\n", line, cond);
+        failures++;
+    }
+}
+
+// Recording port
+
+static void bus_select (bool on)
+{
+    if(on) {
+        bus.selected = true;
+        bus.idx = 0;
+        if(bus.n < MAX_TRANSACTIONS) {
+            memset(&bus.t[bus.n], 0, sizeof(transaction_t));
+            bus.t[bus.n].ms = mock.ms;
+        }
+    } else if(bus.selected) {
+        bus.selected = false;
+        if(bus.n < MAX_TRANSACTIONS)
+            bus.n++;
+        else
+            bus.overrun = true;
+    }
+
+    if(!bus.deaf)
+        bus.peer->select(on);
+}
+
+static uint8_t bus_transfer (uint8_t byte)
+{
+    uint8_t in = bus.deaf ? 0 : bus.peer->transfer(byte);
+    transaction_t *t = &bus.t[bus.n];
+
+    if(bus.selected && bus.n < MAX_TRANSACTIONS) {
+        if(bus.idx == 0)
+            t->cmd = byte;
+        else if(bus.idx == 1)
+            t->addr = byte;
+        else if(bus.idx >= 3 && t->len < MAX_DATA) {
+            t->out[t->len] = byte;
+            t->in[t->len++] = in;
+        }
+        bus.idx++;
+    }
+
+    return in;
+}
+
+static bool bus_handshake (void)
+{
+    return !bus.deaf && bus.peer->handshake();
+}
+
+static const esp_at_spi_port_t bus_port = {
+    .select = bus_select,
+    .transfer = bus_transfer,
+    .handshake = bus_handshake
+};
+
+// Helpers
+
+static transaction_t *find (uint16_t *from, uint8_t cmd)
+{
+    while(*from < bus.n) {
+        if(bus.t[(*from)++].cmd == cmd)
+            return &bus.t[*from - 1];
+    }
+
+    return NULL;
+}
+
+static bool is_request (const transaction_t *t, uint8_t seq, uint16_t len)
+{
+    return t && t->cmd == SPI_WR_BUF && t->addr == 0 && t->len == 4 &&
+            t->out[0] == SPI_REQUEST && t->out[1] == seq && (t->out[2] | (t->out[3] << 8)) == len;
+}
+
+static uint16_t read_all (const io_stream_t *stream, char *buf, uint16_t size)
+{
+    int16_t c;
+    uint16_t len = 0;
+
+    while(len < size - 1 && (c = stream->read()) != SERIAL_NO_DATA)
+        buf[len++] = (char)c;
+
+    buf[len] = '\0';
+
+    return len;
+}
+
+// Tests
+
+// AT\r\n: write request, writable status, WR_DMA, WR_DONE, then the reply: readable status, RD_DMA, RD_DONE.
+static void test_handshake (const io_stream_t *stream, uint8_t *seq)
+{
+    char reply[32];
+    transaction_t *t;
+
+    bus.n = 0;
+
+    mock_run(5);
+    CHECK(bus.n == 0); // idle: handshake released and nothing to write
+
+    stream->write("AT" ASCII_EOL);
+    CHECK(stream->get_tx_buffer_count() == 4);
+    mock_run(1);
+
+    CHECK(bus.n == 1);
+    CHECK(is_request(&bus.t[0], ++*seq, 4));
+
+    mock_run(1);
+
+    CHECK(bus.n == 4);
+    t = &bus.t[1];
+    CHECK(t->cmd == SPI_RD_BUF && t->addr == SPI_STATUS_ADDR && t->len == 4);
+    CHECK(t->in[0] == SPI_WRITABLE && t->in[1] == *seq);
+    t = &bus.t[2];
+    CHECK(t->cmd == SPI_WR_DMA && t->len == 4 && !memcmp(t->out, "AT" ASCII_EOL, 4));
+    CHECK(bus.t[3].cmd == SPI_WR_DONE && bus.t[3].len == 0);
+    CHECK(stream->get_tx_buffer_count() == 0);
+
+    mock_run(1);
+
+    CHECK(bus.n == 7);
+    t = &bus.t[4];
+    CHECK(t->cmd == SPI_RD_BUF && t->addr == SPI_STATUS_ADDR && t->len == 4);
+    CHECK(t->in[0] == SPI_READABLE && (t->in[2] | (t->in[3] << 8)) == 6);
+    t = &bus.t[5];
+    CHECK(t->cmd == SPI_RD_DMA && t->len == 6 && !memcmp(t->in, ASCII_EOL "OK" ASCII_EOL, 6));
+    CHECK(bus.t[6].cmd == SPI_RD_DONE && bus.t[6].len == 0);
+
+    CHECK(read_all(stream, reply, sizeof(reply)) == 6 && !strcmp(reply, ASCII_EOL "OK" ASCII_EOL));
+
+    mock_run(5);
+    CHECK(bus.n == 7); // idle again
+}
+
+// A write larger than the TX buffer is sent in chunks of at most ESP_AT_SPI_CHUNK_SIZE bytes, each with
+// a new sequence number, its own request and WR_DONE. The first chunk is full as the write blocks on a full buffer.
+static void test_chunking (const io_stream_t *stream, uint8_t *seq)
+{
+    char data[ESP_AT_SPI_TX_BUFFER_SIZE + 43 + 1], sent[sizeof(data)], reply[32];
+    uint16_t from = 0, len = 0, chunks = 0, size;
+    transaction_t *t;
+
+    memset(data, 'x', sizeof(data) - 1);
+    data[sizeof(data) - 1] = '\0';
+    memcpy(data, "AT", 2);
+    memcpy(&data[sizeof(data) - 3], ASCII_EOL, 2);
+
+    bus.n = 0;
+
+    stream->write(data); // blocks, polling the transport, until the rest fits in the TX buffer
+    mock_run(10);
+
+    while((t = find(&from, SPI_WR_BUF))) {
+        size = t->out[2] | (t->out[3] << 8);
+        CHECK(is_request(t, ++*seq, size));
+        CHECK(size > 0 && size <= ESP_AT_SPI_CHUNK_SIZE);
+        CHECK(chunks > 0 || size == ESP_AT_SPI_CHUNK_SIZE);
+        t = find(&from, SPI_RD_BUF);
+        CHECK(t && t->in[0] == SPI_WRITABLE && t->in[1] == *seq);
+        t = find(&from, SPI_WR_DMA);
+        CHECK(t && t->len == size);
+        if(t && len + t->len < sizeof(sent)) {
+            memcpy(&sent[len], t->out, t->len);
+            len += t->len;
+        }
+        CHECK(from < bus.n && bus.t[from].cmd == SPI_WR_DONE); // immediately after the data
+        chunks++;
+    }
+
+    CHECK(chunks == (sizeof(data) - 1 + ESP_AT_SPI_CHUNK_SIZE - 1) / ESP_AT_SPI_CHUNK_SIZE);
+    CHECK(len == sizeof(data) - 1 && !memcmp(sent, data, len));
+
+    from = 0;
+    CHECK(find(&from, SPI_RD_DMA) && from < bus.n && bus.t[from].cmd == SPI_RD_DONE);
+    CHECK(read_all(stream, reply, sizeof(reply)) == 6 && !strcmp(reply, ASCII_EOL "OK" ASCII_EOL));
+}
+
+// The write request is repeated with a new sequence number when the peer does not respond within SPI_TIMEOUT ms.
+static void test_timeout (const io_stream_t *stream, uint8_t *seq)
+{
+    char reply[32];
+    uint32_t request_ms;
+    uint16_t from = 0;
+
+    bus.n = 0;
+    bus.deaf = true;
+
+    stream->write("AT" ASCII_EOL);
+    mock_run(1);
+
+    CHECK(bus.n == 1 && is_request(&bus.t[0], ++*seq, 4));
+    request_ms = bus.t[0].ms;
+
+    mock_run(SPI_TIMEOUT);
+    CHECK(bus.n == 1); // still waiting
+
+    mock_run(1);
+    CHECK(bus.n == 2 && is_request(&bus.t[1], ++*seq, 4) && bus.t[1].ms == request_ms + SPI_TIMEOUT + 1);
+
+    bus.deaf = false;
+    bus.n = 0;
+
+    // The peer did not see the first request, the second one has to be issued again to reach it.
+    mock_run(SPI_TIMEOUT + 10);
+
+    CHECK(is_request(find(&from, SPI_WR_BUF), ++*seq, 4));
+    CHECK(find(&from, SPI_WR_DMA) && from < bus.n && bus.t[from].cmd == SPI_WR_DONE);
+    CHECK(read_all(stream, reply, sizeof(reply)) == 6 && !strcmp(reply, ASCII_EOL "OK" ASCII_EOL));
+    CHECK(stream->get_tx_buffer_count() == 0);
+}
+
+int main (int argc, char **argv)
+{
+    uint8_t seq = 0;
+    const io_stream_t *stream;
+
+    mock_init();
+
+    bus.peer = esp_at_spi_mock();
+
+    CHECK((stream = esp_at_spi_open(&bus_port)) != NULL);
+
+    if(stream) {
+        test_handshake(stream, &seq);
+        test_chunking(stream, &seq);
+        test_timeout(stream, &seq);
+    }
+
+    CHECK(!bus.overrun);
+
+    if(failures)
+        fprintf(stderr, "%u check(s) failed\n", (unsigned)failures);
+
+    return failures ? 1 : 0;
+}
@@ -0,0 +1 @@
+#include "grbl/hal.h"
@@ -0,0 +1,699 @@
+/*
+
+  hal.h - minimal grblHAL core API for host testing the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Only the types, symbols and HAL entry points used by the plugins are declared, struct layouts and
+  enum values does not match the core. The core side is implemented by mock.c, see mock.h.
+
+*/
+
+#ifndef _MOCK_GRBL_HAL_H_
+#define _MOCK_GRBL_HAL_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <string.h>
+#include <math.h>
+
+#define ISR_CODE
+#define ISR_FUNC(f) f
+
+#define ASCII_EOL "\r\n"
+#define ASCII_CR 13
+#define ASCII_LF 10
+#define ASCII_CAN 0x18
+
+#define CMD_FEED_HOLD 0x21
+#define CMD_STATUS_REPORT 0x80
+#define CMD_STATUS_REPORT_LEGACY 0x3F
+
+#define SERIAL_NO_DATA -1
+#define RX_BUFFER_SIZE 1024
+
+#define N_AXIS 3
+#define X_AXIS 0
+#define Y_AXIS 1
+#define Z_AXIS 2
+
+#define On 1
+#define Off 0
+
+#define MM_PER_INCH (25.40f)
+#define N_DECIMAL_COORDVALUE_MM 3
+
+#define MIN_FEED_RATE_OVERRIDE 10
+#define MAX_FEED_RATE_OVERRIDE 200
+#define DEFAULT_FEED_OVERRIDE 100
+#define DEFAULT_RAPID_OVERRIDE 100
+
+#define NVS_SIZE 2048
+#define NVS_CRC_BYTES 1
+
+#define BUFCOUNT(head, tail, size) ((head >= tail) ? (head - tail) : (size - tail + head))
+#define BUFNEXT(ptr, buffer) ((ptr + 1) & (sizeof(buffer.data) - 1))
+
+#ifndef min
+#define min(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef max
+#define max(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+#define debug_printf(...)
+
+#define STATE_IDLE          0
+#define STATE_ALARM         (1 << 0)
+#define STATE_CHECK_MODE    (1 << 1)
+#define STATE_HOMING        (1 << 2)
+#define STATE_CYCLE         (1 << 3)
+#define STATE_HOLD          (1 << 4)
+#define STATE_JOG           (1 << 5)
+#define STATE_ESTOP         (1 << 6)
+#define STATE_TOOL_CHANGE   (1 << 7)
+
+typedef uint_fast16_t sys_state_t;
+typedef uint8_t override_t;
+typedef uint8_t nvs_crc_t;
+typedef uint32_t nvs_address_t;
+
+typedef char ssid_t[65];
+typedef char password_t[33];
+typedef char hostname_t[65];
+
+typedef enum {
+    IpMode_Static,
+    IpMode_DHCP
+} ip_mode_t;
+
+typedef enum {
+    WiFiMode_NULL,
+    WiFiMode_STA,
+    WiFiMode_AP
+} grbl_wifi_mode_t;
+
+typedef enum {
+    Status_OK = 0,
+    Status_Unhandled,
+    Status_BadNumberFormat,
+    Status_GcodeValueOutOfRange,
+    Status_SettingDisabled,
+    Status_InvalidStatement,
+    Status_GcodeValueWordMissing,
+    Status_IdleError,
+    Status_SystemGClock,
+    Status_SettingValueOutOfRange,
+    Status_InvalidPlugin,
+    Status_ExpectedCommandLetter,
+    Status_GcodeUnsupportedCommand,
+    Status_NVSFail = 100,
+    Status_AuxiliaryPortUnavailable,
+    Status_FileReadError,
+    Status_FileNotFound,
+    Status_Reset
+} status_code_t;
+
+typedef enum {
+    Message_Plain,
+    Message_Info,
+    Message_Warning
+} message_type_t;
+
+// Parser
+
+typedef enum {
+    MotionMode_Seek = 0,
+    MotionMode_Linear = 1,
+    MotionMode_CwArc = 2,
+    MotionMode_CcwArc = 3,
+    MotionMode_None = 80,
+    MotionMode_ProbeToward = 140
+} motion_mode_t;
+
+typedef enum {
+    UserMCode_Unsupported = 0,
+    UserMCode_Normal,
+    UserMCode_NoValueWords
+} user_mcode_type_t;
+
+typedef enum {
+    UserMCode_Ignore = 0,
+    RGB_WriteLEDs = 150,
+    SetFeedOverrides = 220,
+    PWMServo_SetPosition = 280,
+    Probe_Deploy = 401,
+    Probe_Stow = 402
+} user_mcode_t;
+
+// One member per letter in alphabetical order, the mock parser sets them by index.
+typedef struct {
+    uint32_t a, b, c, d, e, f, g, h, i, j, k, l, m, n, o, p, q, r, s, t, u, v, w, x, y, z;
+} word_flags_t;
+
+typedef struct {
+    float a, b, c, d, e, f, h, p, q, r, s, t, u, v, w, x, y, z;
+    float ijk[3];
+    float xyz[3];
+    uint32_t n;
+} values_t;
+
+typedef struct {
+    user_mcode_t user_mcode;
+    word_flags_t words;
+    values_t values;
+} parser_block_t;
+
+typedef struct {
+    bool file_run;
+    float feed_rate;
+    struct {
+        motion_mode_t motion;
+        bool units_imperial;
+        bool distance_incremental;
+    } modal;
+} parser_state_t;
+
+typedef user_mcode_type_t (*user_mcode_check_ptr)(user_mcode_t mcode);
+typedef status_code_t (*user_mcode_validate_ptr)(parser_block_t *gc_block);
+typedef void (*user_mcode_execute_ptr)(uint_fast16_t state, parser_block_t *gc_block);
+
+typedef struct {
+    user_mcode_check_ptr check;
+    user_mcode_validate_ptr validate;
+    user_mcode_execute_ptr execute;
+} user_mcode_ptrs_t;
+
+// Spindle, coolant and probing
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t on  :1,
+                ccw :1;
+    };
+} spindle_state_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t flood :1,
+                mist  :1;
+    };
+} coolant_state_t;
+
+typedef struct {
+    struct {
+        uint8_t laser :1;
+    } cap;
+} spindle_ptrs_t;
+
+typedef int spindle_rpm_mode_t;
+
+typedef union {
+    uint8_t mask;
+    struct {
+        uint8_t x :1,
+                y :1,
+                z :1;
+    };
+} axes_signals_t;
+
+typedef struct {
+    float feed_rate;
+    struct {
+        uint8_t rapid_motion :1;
+    } condition;
+} plan_line_data_t;
+
+// Planner, speeds are in mm/min and acceleration in mm/min^2
+
+typedef struct plan_block {
+    struct plan_block *prev, *next;
+    float millimeters;
+    float programmed_rate;
+    float acceleration;
+    float entry_speed_sqr;
+    float max_entry_speed_sqr;
+    struct {
+        uint8_t rapid_motion :1;
+    } condition;
+} plan_block_t;
+
+// Streams
+
+typedef enum {
+    StreamType_Serial,
+    StreamType_Telnet,
+    StreamType_File
+} stream_type_t;
+
+typedef bool (*enqueue_realtime_command_ptr)(char c);
+typedef int16_t (*stream_read_ptr)(void);
+typedef void (*stream_write_ptr)(const char *s);
+
+typedef struct io_stream {
+    stream_type_t type;
+    bool (*is_connected)(void);
+    int16_t (*read)(void);
+    void (*write)(const char *s);
+    void (*write_n)(const char *s, uint16_t length);
+    bool (*write_char)(const char c);
+    bool (*enqueue_rt_command)(char c);
+    uint16_t (*get_rx_buffer_free)(void);
+    uint16_t (*get_tx_buffer_count)(void);
+    void (*reset_read_buffer)(void);
+    void (*cancel_read_buffer)(void);
+    bool (*suspend_read)(bool suspend);
+    enqueue_realtime_command_ptr (*set_enqueue_rt_handler)(enqueue_realtime_command_ptr handler);
+    void (*reset_write_buffer)(void);
+    bool (*set_baud_rate)(uint32_t baud_rate);
+    bool (*disable_rx)(bool disable);
+} io_stream_t;
+
+typedef struct {
+    volatile uint_fast16_t head;
+    volatile uint_fast16_t tail;
+    bool overflow;
+    bool rts_state;
+    bool backup;
+    char data[RX_BUFFER_SIZE];
+} stream_rx_buffer_t;
+
+// Tasks
+
+typedef void (*foreground_task_ptr)(void *data);
+
+// Settings
+
+typedef int setting_id_t;
+
+enum {
+    Setting_RGB_StripLengt0 = 536,
+    Setting_RGB_StripLengt1,
+    Setting_WifiMode,
+    Setting_WiFi_STA_SSID,
+    Setting_WiFi_STA_Password,
+    Setting_Hostname,
+    Setting_IpMode,
+    Setting_IpAddress3,
+    Setting_Gateway3,
+    Setting_NetMask3,
+    Setting_TelnetPort,
+    Setting_TelnetPort3,
+    Setting_WiFi_AP_SSID,
+    Setting_WiFi_AP_Password,
+    Setting_Wifi_AP_Channel,
+    Setting_Hostname2,
+    Setting_IpAddress2,
+    Setting_Gateway2,
+    Setting_NetMask2,
+    Setting_ActionBase = 750,
+    Setting_ActionPortBase = 760,
+    Setting_AxisExtended9 = 900
+};
+
+enum {
+    Group_Root,
+    Group_Axis0,
+    Group_AuxPorts,
+    Group_Networking,
+    Group_Networking_Wifi,
+    Group_Probing
+};
+
+enum {
+    Format_Bool,
+    Format_Decimal,
+    Format_Int8,
+    Format_Int16,
+    Format_Integer,
+    Format_RadioButtons,
+    Format_String,
+    Format_Password,
+    Format_IPv4
+};
+
+enum {
+    Setting_NonCore,
+    Setting_NonCoreFn,
+    Setting_IsLegacyFn
+};
+
+typedef struct {
+    uint8_t subgroups;
+    uint8_t increment;
+    uint8_t reboot_required;
+    uint8_t allow_null;
+} setting_detail_flags_t;
+
+typedef struct setting_detail {
+    setting_id_t id;
+    int group;
+    const char *name;
+    const char *unit;
+    int datatype;
+    const char *format;
+    const char *min_value;
+    const char *max_value;
+    int type;
+    const void *value;
+    const void *get_value;
+    const void *is_available;
+    setting_detail_flags_t flags;
+} setting_detail_t;
+
+typedef struct {
+    setting_id_t id;
+    const char *description;
+} setting_descr_t;
+
+typedef struct {
+    int parent;
+    int id;
+    const char *name;
+} setting_group_detail_t;
+
+typedef struct {
+    uint8_t value;
+} settings_changed_flags_t;
+
+typedef struct {
+    struct {
+        float steps_per_mm;
+    } axis[N_AXIS];
+    struct {
+        float pulloff;
+    } homing;
+    struct {
+        uint8_t length0;
+        uint8_t length1;
+    } rgb_strip;
+    uint16_t report_interval;
+} settings_t;
+
+typedef struct {
+    float values[N_AXIS];
+} coord_data_t;
+
+typedef void (*setting_output_ptr)(const setting_detail_t *setting, uint_fast16_t offset, void *data);
+typedef void (*settings_changed_ptr)(settings_t *settings, settings_changed_flags_t changed);
+
+typedef struct setting_details {
+    const setting_group_detail_t *groups;
+    uint8_t n_groups;
+    const setting_detail_t *settings;
+    uint8_t n_settings;
+    const setting_descr_t *descriptions;
+    uint8_t n_descriptions;
+    void (*save)(void);
+    void (*load)(void);
+    void (*restore)(void);
+    bool (*iterator)(const setting_detail_t *setting, setting_output_ptr callback, void *data);
+    void (*on_changed)(settings_t *settings, settings_changed_flags_t changed);
+    struct setting_details *next; // used by the mock settings registry
+} setting_details_t;
+
+// System commands
+
+typedef struct {
+    uint8_t noargs;
+    uint8_t allow_blocking;
+} sysflags_t;
+
+typedef struct {
+    const char *command;
+    status_code_t (*execute)(sys_state_t state, char *args);
+    sysflags_t flags;
+    struct {
+        const char *str;
+    } help;
+} sys_command_t;
+
+typedef struct sys_commands_str {
+    uint8_t n_commands;
+    const sys_command_t *commands;
+    struct sys_commands_str *next;
+} sys_commands_t;
+
+// Auxiliary ports
+
+typedef enum {
+    Port_Analog,
+    Port_Digital
+} io_port_type_t;
+
+typedef enum {
+    Port_Input,
+    Port_Output
+} io_port_direction_t;
+
+typedef enum {
+    WaitMode_Immediate = 0,
+    WaitMode_Rise,
+    WaitMode_Fall
+} wait_mode_t;
+
+typedef struct {
+    uint32_t servo_pwm :1,
+             claimable :1,
+             pwm       :1,
+             output    :1,
+             input     :1,
+             external  :1;
+} pin_cap_t;
+
+typedef enum {
+    Output_CoProc_Reset = 1,
+    Output_CoProc_Boot0
+} pin_function_t;
+
+typedef struct {
+    float freq_hz;
+    float min;
+    float max;
+    float off_value;
+    float min_value;
+    float max_value;
+    bool invert;
+    bool servo_mode;
+} pwm_config_t;
+
+typedef struct xbar {
+    pin_function_t function;
+    uint8_t port;
+    pin_cap_t cap;
+    float (*get_value)(struct xbar *pin);
+    bool (*config)(struct xbar *pin, pwm_config_t *config, bool persistent);
+} xbar_t;
+
+typedef bool (*ioports_enumerate_callback_ptr)(xbar_t *pin, uint8_t port, void *data);
+typedef void (*digital_out_ptr)(uint8_t port, bool on);
+typedef bool (*analog_out_ptr)(uint8_t port, float value);
+
+// RGB LEDs
+
+typedef union {
+    uint32_t value;
+    struct {
+        uint8_t R, G, B, W;
+    };
+} rgb_color_t;
+
+typedef union {
+    uint8_t value;
+    struct {
+        uint8_t R :1,
+                G :1,
+                B :1,
+                W :1;
+    };
+} rgb_color_mask_t;
+
+typedef struct {
+    void (*out)(uint16_t device, rgb_color_t color);
+    void (*out_masked)(uint16_t device, rgb_color_t color, rgb_color_mask_t mask);
+    void (*write)(void);
+    uint8_t (*set_intensity)(uint8_t intensity);
+    uint16_t num_devices;
+    struct {
+        uint8_t W :1;
+    } cap;
+    struct {
+        uint8_t is_strip :1;
+    } flags;
+} rgb_ptr_t;
+
+// NVS
+
+typedef enum {
+    NVS_TransferResult_Failed,
+    NVS_TransferResult_Busy,
+    NVS_TransferResult_OK
+} nvs_transfer_result_t;
+
+// Delays
+
+typedef enum {
+    DelayMode_Dwell,
+    DelayMode_SysSuspend
+} delaymode_t;
+
+typedef void (*delay_callback_ptr)(void);
+
+// HAL and core event hooks
+
+typedef void (*on_report_options_ptr)(bool newopt);
+typedef void (*on_state_change_ptr)(sys_state_t state);
+typedef void (*on_execute_realtime_ptr)(sys_state_t state);
+typedef void (*on_spindle_programmed_ptr)(spindle_ptrs_t *spindle, spindle_state_t state, float rpm, spindle_rpm_mode_t mode);
+typedef void (*coolant_set_state_ptr)(coolant_state_t state);
+typedef void (*driver_reset_ptr)(void);
+typedef bool (*on_probe_start_ptr)(axes_signals_t axes, float *target, plan_line_data_t *pl_data);
+typedef void (*on_probe_completed_ptr)(void);
+typedef void (*on_stream_changed_ptr)(stream_type_t type);
+
+typedef enum {
+    ProgramFlow_Running,
+    ProgramFlow_Paused,
+    ProgramFlow_CompletedM2,
+    ProgramFlow_CompletedM30
+} program_flow_t;
+
+typedef void (*on_program_completed_ptr)(program_flow_t program_flow, bool check_mode);
+
+typedef struct {
+    uint32_t (*get_elapsed_ticks)(void);
+    uint32_t (*get_micros)(void);
+    bool (*stream_blocking_callback)(void);
+    void (*irq_enable)(void);
+    void (*irq_disable)(void);
+    void (*delay_ms)(uint32_t ms, delay_callback_ptr callback);
+    uint32_t f_step_timer;
+    struct {
+        digital_out_ptr digital_out;
+        analog_out_ptr analog_out;
+        int32_t (*wait_on_input)(io_port_type_t type, uint8_t port, wait_mode_t wait_mode, float timeout);
+        void (*set_pin_description)(io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *description);
+        xbar_t *(*get_pin_info)(io_port_type_t type, io_port_direction_t dir, uint8_t port);
+    } port;
+    struct {
+        nvs_transfer_result_t (*memcpy_to_nvs)(nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum);
+        nvs_transfer_result_t (*memcpy_from_nvs)(uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum);
+        uint8_t (*get_byte)(uint32_t addr);
+        void (*put_byte)(uint32_t addr, uint8_t new_value);
+    } nvs;
+    struct {
+        coolant_set_state_ptr set_state;
+        coolant_state_t (*get_state)(void);
+    } coolant;
+    io_stream_t stream;
+    rgb_ptr_t rgb0;
+    rgb_ptr_t rgb1;
+    settings_changed_ptr settings_changed;
+    driver_reset_ptr driver_reset;
+    struct {
+        void (*enable)(void);
+    } irq;
+} grbl_hal_t;
+
+typedef struct {
+    user_mcode_ptrs_t user_mcode;
+    on_report_options_ptr on_report_options;
+    on_state_change_ptr on_state_change;
+    on_spindle_programmed_ptr on_spindle_programmed;
+    on_probe_start_ptr on_probe_start;
+    on_probe_completed_ptr on_probe_completed;
+    on_program_completed_ptr on_program_completed;
+    on_execute_realtime_ptr on_execute_realtime;
+    on_execute_realtime_ptr on_execute_delay;
+    on_stream_changed_ptr on_stream_changed;
+    struct {
+        void (*status_message)(status_code_t status_code);
+    } report;
+} grbl_t;
+
+typedef struct {
+    float *(*segment_line)(float *target, float *position, plan_line_data_t *pl_data, bool init);
+    float *(*transform_steps_to_cartesian)(float *position, int32_t *steps);
+    void (*transform_from_cartesian)(int32_t *target, float *position);
+} kinematics_t;
+
+typedef struct {
+    uint8_t feed_rate;
+    uint8_t rapid_rate;
+} overrides_t;
+
+typedef struct {
+    overrides_t override;
+    int32_t position[N_AXIS];
+    int32_t probe_position[N_AXIS];
+    struct {
+        uint8_t probe_succeeded :1;
+    } flags;
+} system_t;
+
+extern grbl_hal_t hal;
+extern grbl_t grbl;
+extern system_t sys;
+extern settings_t settings;
+extern parser_state_t gc_state;
+extern kinematics_t kinematics;
+
+// Core functions
+
+bool isintf (float value);
+char *uitoa (uint32_t n);
+char *ftoa (float n, uint8_t decimal_places);
+bool read_float (char *line, uint_fast8_t *char_counter, float *float_ptr);
+status_code_t read_uint (char *line, uint_fast8_t *char_counter, uint32_t *uint_ptr);
+void delay_sec (float seconds, delaymode_t mode);
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay);
+bool task_add_immediate (foreground_task_ptr fn, void *data);
+bool task_add_systick (foreground_task_ptr fn, void *data);
+void task_delete (foreground_task_ptr fn, void *data);
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data);
+bool protocol_enqueue_gcode (char *data);
+bool protocol_buffer_synchronize (void);
+bool protocol_enqueue_realtime_command (char c);
+bool protocol_execute_realtime (void);
+
+void report_warning (void *message);
+void report_plugin (const char *name, const char *version);
+void report_message (const char *msg, message_type_t type);
+
+bool stream_buffer_all (char c);
+bool stream_connected (void);
+bool stream_connect (const io_stream_t *stream);
+void stream_disconnect (const io_stream_t *stream);
+const io_stream_t *stream_open_instance (uint8_t instance, uint32_t baud_rate, void *rx_handler, const char *description);
+bool stream_rx_suspend (stream_rx_buffer_t *rxbuffer, bool suspend);
+
+nvs_address_t nvs_alloc (size_t size);
+nvs_crc_t calc_checksum (uint8_t *data, uint32_t size);
+
+void settings_register (setting_details_t *details);
+void settings_write_global (void);
+int settings_get_axis_base (setting_id_t id, uint_fast8_t *idx);
+void limits_homing_pulloff (coord_data_t *pulloff);
+void system_register_commands (sys_commands_t *commands);
+
+bool ioports_enumerate (io_port_type_t type, io_port_direction_t dir, pin_cap_t filter, ioports_enumerate_callback_ptr callback, void *data);
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description);
+uint8_t ioports_unclaimed (io_port_type_t type, io_port_direction_t dir);
+
+sys_state_t state_get (void);
+void plan_feed_override (override_t feed_override, override_t rapid_override);
+plan_block_t *plan_get_current_block (void);
+uint_fast16_t plan_get_block_buffer_count (void);
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps);
+rgb_color_t rgb_set_intensity (rgb_color_t color, uint8_t intensity);
+void gc_sync_position (void);
+void debug_print (const char *format, ...);
+
+#endif // _MOCK_GRBL_HAL_H_
@@ -0,0 +1 @@
+#include "hal.h"
@@ -0,0 +1,1557 @@
+/*
+
+  mock.c - simulated grblHAL core and HAL for host testing the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  See mock.h for an overview.
+
+  The planner joins consecutive blocks at the lower of their nominal rates, junction deviation is not
+  modelled. Block execution time is calculated from the entry and exit speeds, acceleration and the current
+  overrides with the same trapezoid as the lead time estimate in eventout.c.
+
+  Probing is along the Z axis only, the probe makes contact at mock_machine.probe_z if that is between
+  the start and target positions.
+
+*/
+
+#include <ctype.h>
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <strings.h>
+
+#include "mock.h"
+
+#if BLTOUCH_ENABLE == 1
+extern void bltouch_init (void);
+#endif
+#if EVENTOUT_ENABLE == 1
+extern void event_out_init (void);
+#endif
+#if FEED_OVERRIDE_ENABLE == 1
+extern void feed_override_init (void);
+#endif
+#if PWM_SERVO_ENABLE == 1
+extern void pwm_servo_init (void);
+#endif
+#if RGB_LED_ENABLE
+extern void rgb_led_init (void);
+#endif
+
+static const mock_plugin_t plugins[] = {
+#if BLTOUCH_ENABLE == 1
+    { "bltouch", bltouch_init },
+#endif
+#if EVENTOUT_ENABLE == 1
+    { "eventout", event_out_init },
+#endif
+#if FEED_OVERRIDE_ENABLE == 1
+    { "feed_override", feed_override_init },
+#endif
+#if PWM_SERVO_ENABLE == 1
+    { "pwm_servo", pwm_servo_init },
+#endif
+#if RGB_LED_ENABLE
+    { "rgb_led", rgb_led_init },
+#endif
+    { NULL, NULL }
+};
+
+grbl_hal_t hal;
+grbl_t grbl;
+system_t sys;
+settings_t settings;
+parser_state_t gc_state;
+kinematics_t kinematics;
+
+mock_machine_t mock_machine = {
+    .acceleration = 500.0f,
+    .rapid_rate = 5000.0f,
+    .rgb_devices = 1
+};
+
+mock_status_t mock;
+
+void (*mock_on_stop_loss)(uint32_t mcode, float ms) = NULL;
+void (*mock_on_output)(const char *line) = NULL;
+
+#define MOCK_TASKS 64
+
+typedef enum {
+    Task_Free = 0,
+    Task_Immediate,
+    Task_Delayed,
+    Task_Systick
+} mock_task_type_t;
+
+typedef struct {
+    mock_task_type_t type;
+    foreground_task_ptr fn;
+    void *data;
+    uint32_t due;
+    uint32_t seq;
+} mock_task_t;
+
+static struct {
+    uint32_t seq;
+    mock_task_t task[MOCK_TASKS];
+} tasks;
+
+static struct {
+    uint_fast8_t tail;
+    uint_fast8_t count;
+    float target[MOCK_PLANNER_SIZE][N_AXIS];
+    plan_block_t block[MOCK_PLANNER_SIZE];
+    float position[N_AXIS];                 // end position of the last planned block
+    uint32_t restart_mcode;                 // user M-code that stopped motion, 0 if none
+} planner;
+
+static struct {
+    uint_fast16_t head;
+    uint_fast16_t tail;
+    char data[1024];
+} rx;
+
+static struct {
+    uint_fast16_t len;
+    char line[256];
+} input;
+
+static struct {
+    uint_fast16_t len;
+    char data[512];
+} output;
+
+static struct {
+    bool claimed;
+    bool on;
+} dout[MOCK_DOUT_PORTS];
+
+static struct {
+    bool claimed;
+    float value;
+    xbar_t pin;
+} aout[MOCK_AOUT_PORTS];
+
+static uint8_t nvs[NVS_SIZE];
+static nvs_address_t nvs_next = MOCK_NVS_FIRST;
+static uint32_t work_us = 0;
+static bool executing = false;
+static char queued_gcode[256];
+static coolant_state_t coolant = {0};
+static spindle_ptrs_t spindle = {0};
+static setting_details_t *setting_details = NULL;
+static sys_commands_t *commands = NULL;
+
+static void tick (void);
+static status_code_t execute_line (char *line);
+
+void mock_log (const char *kind, const char *format, ...)
+{
+    va_list args;
+
+    if(mock.log) {
+        fprintf(mock.log, "%6u %s", (unsigned)mock.ms, kind);
+        if(*format) {
+            fputc(' ', mock.log);
+            va_start(args, format);
+            vfprintf(mock.log, format, args);
+            va_end(args);
+        }
+        fputc('\n', mock.log);
+    }
+}
+
+static inline void hal_call (void)
+{
+    work_us += MOCK_CALL_US;
+}
+
+// Clock
+
+static uint32_t get_elapsed_ticks (void)
+{
+    return mock.ms;
+}
+
+static uint32_t get_micros (void)
+{
+    return mock.ms * 1000 + work_us;
+}
+
+static void irq_enable (void)
+{
+}
+
+static void irq_disable (void)
+{
+}
+
+static void delay_ms (uint32_t ms, delay_callback_ptr callback)
+{
+    while(ms--)
+        tick();
+
+    if(callback)
+        callback();
+}
+
+void delay_sec (float seconds, delaymode_t mode)
+{
+    uint32_t ms = (uint32_t)ceilf(seconds * 1000.0f);
+
+    mock_log("DELAY", "%u", (unsigned)ms);
+
+    while(ms--)
+        tick();
+}
+
+// Tasks
+
+static bool task_add (mock_task_type_t type, foreground_task_ptr fn, void *data, uint32_t delay)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < MOCK_TASKS; idx++) {
+        if(tasks.task[idx].type == Task_Free) {
+            tasks.task[idx].type = type;
+            tasks.task[idx].fn = fn;
+            tasks.task[idx].data = data;
+            tasks.task[idx].due = mock.ms + delay;
+            tasks.task[idx].seq = tasks.seq++;
+            return true;
+        }
+    }
+
+    return false;
+}
+
+bool task_add_delayed (foreground_task_ptr fn, void *data, uint32_t delay)
+{
+    return task_add(Task_Delayed, fn, data, delay);
+}
+
+bool task_add_immediate (foreground_task_ptr fn, void *data)
+{
+    return task_add(Task_Immediate, fn, data, 0);
+}
+
+bool task_add_systick (foreground_task_ptr fn, void *data)
+{
+    return task_add(Task_Systick, fn, data, 0);
+}
+
+void task_delete (foreground_task_ptr fn, void *data)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < MOCK_TASKS; idx++) {
+        if(tasks.task[idx].type != Task_Free && tasks.task[idx].fn == fn && tasks.task[idx].data == data)
+            tasks.task[idx].type = Task_Free;
+    }
+}
+
+bool protocol_enqueue_foreground_task (foreground_task_ptr fn, void *data)
+{
+    return task_add(Task_Immediate, fn, data, 0);
+}
+
+// Runs the tasks that are due in the order they were added, tasks added while running are run on the next tick.
+static void run_tasks (void)
+{
+    uint_fast8_t idx;
+    uint32_t seq = tasks.seq;
+    mock_task_t task;
+
+    for(idx = 0; idx < MOCK_TASKS; idx++) {
+
+        task = tasks.task[idx];
+
+        if(task.type == Task_Free || task.seq >= seq || (task.type == Task_Delayed && (int32_t)(mock.ms - task.due) < 0))
+            continue;
+
+        if(task.type != Task_Systick)
+            tasks.task[idx].type = Task_Free;
+
+        task.fn(task.data);
+    }
+}
+
+// Planner
+
+static inline plan_block_t *planner_block (uint_fast8_t offset)
+{
+    return &planner.block[(planner.tail + offset) % MOCK_PLANNER_SIZE];
+}
+
+static float block_rate (plan_block_t *block)
+{
+    return block->programmed_rate * (float)(block->condition.rapid_motion ? sys.override.rapid_rate : sys.override.feed_rate) / 100.0f;
+}
+
+// Returns time in ms to execute a block, see block_time_ms() in eventout.c.
+static float block_time (plan_block_t *block, float exit_speed_sqr)
+{
+    float rate = block_rate(block), rate_sqr = rate * rate, accel2 = 2.0f * block->acceleration,
+          entry_sqr = min(block->entry_speed_sqr, rate_sqr), exit_sqr = min(exit_speed_sqr, rate_sqr),
+          ramps_mm, minutes;
+
+    if(rate <= 0.0f)
+        return 0.0f;
+
+    ramps_mm = (2.0f * rate_sqr - entry_sqr - exit_sqr) / accel2;
+
+    if(ramps_mm > block->millimeters) {
+        rate = sqrtf((block->millimeters * accel2 + entry_sqr + exit_sqr) / 2.0f);
+        minutes = (2.0f * rate - sqrtf(entry_sqr) - sqrtf(exit_sqr)) / block->acceleration;
+    } else
+        minutes = (2.0f * rate - sqrtf(entry_sqr) - sqrtf(exit_sqr)) / block->acceleration + (block->millimeters - ramps_mm) / rate;
+
+    return minutes * 60000.0f;
+}
+
+// Returns the speed squared a block can reach from its entry speed when decelerating to a stop at the end
+// is not required.
+static float block_peak_sqr (plan_block_t *block)
+{
+    float rate = block_rate(block);
+
+    return min(rate * rate, block->entry_speed_sqr + 2.0f * block->acceleration * block->millimeters);
+}
+
+// Replans entry speeds for all but the executing block, the last block always exits at standstill.
+static void planner_recalculate (void)
+{
+    uint_fast8_t idx;
+    float exit_sqr = 0.0f;
+    plan_block_t *block, *prev;
+
+    for(idx = planner.count - 1; idx > 0; idx--) {
+        block = planner_block(idx);
+        block->entry_speed_sqr = min(block->max_entry_speed_sqr, exit_sqr + 2.0f * block->acceleration * block->millimeters);
+        exit_sqr = block->entry_speed_sqr;
+    }
+
+    for(idx = 1; idx < planner.count; idx++) {
+        prev = planner_block(idx - 1);
+        block = planner_block(idx);
+        block->entry_speed_sqr = min(block->entry_speed_sqr, prev->entry_speed_sqr + 2.0f * prev->acceleration * prev->millimeters);
+    }
+}
+
+// Moves the executing block ms along its velocity profile. As the stepper does in the core the remaining
+// distance and the current speed, as the entry speed, are updated so that the block reflects what is left.
+static void block_advance (plan_block_t *block, float exit_speed_sqr, float ms)
+{
+    float rate = block_rate(block), minutes = ms / 60000.0f,
+          speed = sqrtf(block->entry_speed_sqr), exit_sqr = min(exit_speed_sqr, rate * rate), new_speed;
+
+    if(block->entry_speed_sqr - exit_sqr >= 2.0f * block->acceleration * block->millimeters)
+        new_speed = max(speed - block->acceleration * minutes, sqrtf(exit_sqr));
+    else if(speed < rate)
+        new_speed = min(speed + block->acceleration * minutes, rate);
+    else
+        new_speed = rate;
+
+    block->millimeters = max(block->millimeters - (speed + new_speed) / 2.0f * minutes, 0.0f);
+    block->entry_speed_sqr = new_speed * new_speed;
+}
+
+static void planner_step (void)
+{
+    uint_fast8_t idx;
+    float ms = 1.0f, remaining, exit_sqr;
+    plan_block_t *block;
+
+    while(ms > 0.0f && planner.count && !(mock.state & (STATE_HOLD|STATE_ALARM|STATE_ESTOP))) {
+
+        block = planner_block(0);
+        exit_sqr = planner.count > 1 ? planner_block(1)->entry_speed_sqr : 0.0f;
+        remaining = block_time(block, exit_sqr);
+
+        if(remaining > ms) {
+            block_advance(block, exit_sqr, ms);
+            break;
+        }
+
+        ms -= remaining;
+
+        for(idx = 0; idx < N_AXIS; idx++) {
+            mock.position[idx] = planner.target[planner.tail][idx];
+            sys.position[idx] = lroundf(mock.position[idx] * MOCK_STEPS_PER_MM);
+        }
+
+        mock.blocks++;
+        planner.count--;
+        planner.tail = (planner.tail + 1) % MOCK_PLANNER_SIZE;
+
+        if(planner.count == 0 && mock.state == STATE_CYCLE)
+            mock_set_state(STATE_IDLE);
+    }
+}
+
+static bool plan_line (float *target, float rate, bool rapid)
+{
+    uint_fast8_t idx;
+    float mm = 0.0f, delta;
+    plan_block_t *block, *prev;
+
+    for(idx = 0; idx < N_AXIS; idx++) {
+        delta = target[idx] - planner.position[idx];
+        mm += delta * delta;
+    }
+
+    if((mm = sqrtf(mm)) == 0.0f)
+        return true;
+
+    while(planner.count == MOCK_PLANNER_SIZE)
+        tick();
+
+    prev = planner.count ? planner_block(planner.count - 1) : NULL;
+    block = planner_block(planner.count);
+
+    memset(block, 0, sizeof(plan_block_t));
+    block->prev = prev;
+    block->millimeters = mm;
+    block->programmed_rate = rate;
+    block->acceleration = mock_machine.acceleration * 3600.0f;
+    block->condition.rapid_motion = rapid;
+
+    if(prev) {
+        prev->next = block;
+        delta = min(prev->programmed_rate, rate);
+        block->max_entry_speed_sqr = delta * delta;
+    }
+
+    memcpy(planner.target[(planner.tail + planner.count) % MOCK_PLANNER_SIZE], target, sizeof(float) * N_AXIS);
+    memcpy(planner.position, target, sizeof(float) * N_AXIS);
+
+    if(planner.count++ == 0) {
+        if(planner.restart_mcode && mock_on_stop_loss)
+            mock_on_stop_loss(planner.restart_mcode, sqrtf(block_peak_sqr(block)) / (2.0f * block->acceleration) * 60000.0f);
+    }
+
+    planner.restart_mcode = 0;
+
+    planner_recalculate();
+
+    if(mock.state == STATE_IDLE)
+        mock_set_state(STATE_CYCLE);
+
+    return true;
+}
+
+plan_block_t *plan_get_current_block (void)
+{
+    return planner.count ? planner_block(0) : NULL;
+}
+
+uint_fast16_t plan_get_block_buffer_count (void)
+{
+    return planner.count;
+}
+
+void plan_feed_override (override_t feed_override, override_t rapid_override)
+{
+    sys.override.feed_rate = max(min(feed_override, MAX_FEED_RATE_OVERRIDE), MIN_FEED_RATE_OVERRIDE);
+    sys.override.rapid_rate = min(rapid_override, DEFAULT_RAPID_OVERRIDE);
+
+    mock_log("OVERRIDE", "%u %u", sys.override.feed_rate, sys.override.rapid_rate);
+}
+
+bool protocol_buffer_synchronize (void)
+{
+    while(planner.count && !(mock.state & (STATE_HOLD|STATE_ALARM|STATE_ESTOP)))
+        tick();
+
+    return planner.count == 0;
+}
+
+// Synchronizes the planner for a user M-code. If motion is stopped the time lost decelerating to standstill
+// is reported to mock_on_stop_loss, the time lost accelerating again is reported when the next block is planned.
+static bool mcode_synchronize (uint32_t mcode)
+{
+    if(planner.count) {
+        if(mock_on_stop_loss) {
+            plan_block_t *block = planner_block(planner.count - 1);
+            mock_on_stop_loss(mcode, sqrtf(block_peak_sqr(block)) / (2.0f * block->acceleration) * 60000.0f);
+        }
+        planner.restart_mcode = mcode;
+    }
+
+    mock.syncs++;
+
+    return protocol_buffer_synchronize();
+}
+
+// Core syncs are not charged to plugins.
+static bool core_synchronize (void)
+{
+    if(planner.count)
+        planner.restart_mcode = 0;
+
+    return protocol_buffer_synchronize();
+}
+
+void system_convert_array_steps_to_mpos (float *position, int32_t *steps)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        position[idx] = (float)steps[idx] / MOCK_STEPS_PER_MM;
+}
+
+// State
+
+sys_state_t state_get (void)
+{
+    return mock.state;
+}
+
+void mock_set_state (sys_state_t state)
+{
+    if(state != mock.state) {
+
+        mock.state = state;
+
+        mock_log("STATE", "%u", (unsigned)state);
+
+        if(grbl.on_state_change)
+            grbl.on_state_change(state);
+    }
+}
+
+// Ports
+
+static void digital_out (uint8_t port, bool on)
+{
+    hal_call();
+
+    if(port < MOCK_DOUT_PORTS) {
+        dout[port].on = on;
+        mock_log("DOUT", "%u %u", port, on);
+    }
+}
+
+static bool analog_out (uint8_t port, float value)
+{
+    hal_call();
+
+    if(port < MOCK_AOUT_PORTS) {
+        aout[port].value = value;
+        mock_log("AOUT", "%u %.3f", port, value);
+    }
+
+    return port < MOCK_AOUT_PORTS;
+}
+
+static float pin_get_value (xbar_t *pin)
+{
+    hal_call();
+
+    return aout[pin->port].value;
+}
+
+static bool pin_config (xbar_t *pin, pwm_config_t *config, bool persistent)
+{
+    hal_call();
+
+    return config->max > config->min;
+}
+
+static xbar_t *get_pin_info (io_port_type_t type, io_port_direction_t dir, uint8_t port)
+{
+    hal_call();
+
+    return type == Port_Analog && dir == Port_Output && port < MOCK_AOUT_PORTS ? &aout[port].pin : NULL;
+}
+
+static void set_pin_description (io_port_type_t type, io_port_direction_t dir, uint8_t port, const char *description)
+{
+}
+
+bool ioports_enumerate (io_port_type_t type, io_port_direction_t dir, pin_cap_t filter, ioports_enumerate_callback_ptr callback, void *data)
+{
+    uint_fast8_t port;
+    pin_cap_t cap;
+
+    if(type != Port_Analog || dir != Port_Output)
+        return false;
+
+    for(port = 0; port < MOCK_AOUT_PORTS; port++) {
+
+        if(filter.claimable && aout[port].claimed)
+            continue;
+
+        cap = aout[port].pin.cap;
+
+        if((filter.servo_pwm && !cap.servo_pwm) || (filter.pwm && !cap.pwm))
+            continue;
+
+        if(callback(&aout[port].pin, port, data))
+            return true;
+    }
+
+    return false;
+}
+
+bool ioport_claim (io_port_type_t type, io_port_direction_t dir, uint8_t *port, const char *description)
+{
+    bool ok = false;
+
+    if(dir == Port_Output) {
+        if(type == Port_Analog && *port < MOCK_AOUT_PORTS && !aout[*port].claimed)
+            ok = aout[*port].claimed = true;
+        else if(type == Port_Digital && *port < MOCK_DOUT_PORTS && !dout[*port].claimed)
+            ok = dout[*port].claimed = true;
+    }
+
+    return ok;
+}
+
+uint8_t ioports_unclaimed (io_port_type_t type, io_port_direction_t dir)
+{
+    uint_fast8_t port, count = 0;
+
+    if(dir == Port_Output) {
+        if(type == Port_Digital) {
+            for(port = 0; port < MOCK_DOUT_PORTS; port++)
+                count += !dout[port].claimed;
+        } else for(port = 0; port < MOCK_AOUT_PORTS; port++)
+            count += !aout[port].claimed;
+    }
+
+    return count;
+}
+
+// Coolant and RGB
+
+static void coolant_set_state (coolant_state_t state)
+{
+    hal_call();
+
+    coolant = state;
+    mock_log("COOLANT", "%u%u", state.flood, state.mist);
+}
+
+static coolant_state_t coolant_get_state (void)
+{
+    return coolant;
+}
+
+static void rgb_out (uint16_t device, rgb_color_t color)
+{
+    hal_call();
+
+    mock_log("RGB", "%u %02X%02X%02X%02X", device, color.R, color.G, color.B, color.W);
+}
+
+static void rgb_write (void)
+{
+    hal_call();
+
+    mock_log("RGB_WRITE", "");
+}
+
+rgb_color_t rgb_set_intensity (rgb_color_t color, uint8_t intensity)
+{
+    color.R = (uint8_t)(((uint32_t)color.R * intensity) / 255);
+    color.G = (uint8_t)(((uint32_t)color.G * intensity) / 255);
+    color.B = (uint8_t)(((uint32_t)color.B * intensity) / 255);
+    color.W = (uint8_t)(((uint32_t)color.W * intensity) / 255);
+
+    return color;
+}
+
+// NVS
+
+nvs_crc_t calc_checksum (uint8_t *data, uint32_t size)
+{
+    uint8_t checksum = 0;
+
+    while(size--) {
+        checksum = (checksum << 1) | (checksum >> 7);
+        checksum += *(data++);
+    }
+
+    return checksum;
+}
+
+static nvs_transfer_result_t memcpy_to_nvs (nvs_address_t dest, uint8_t *source, uint32_t size, bool with_checksum)
+{
+    uint32_t idx;
+    char hex[2 * NVS_SIZE + 4], *s = hex;
+
+    hal_call();
+
+    if(dest + size + (with_checksum ? NVS_CRC_BYTES : 0) > NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(&nvs[dest], source, size);
+
+    for(idx = 0; idx < size; idx++)
+        s += sprintf(s, "%02X", source[idx]);
+
+    if(with_checksum) {
+        nvs[dest + size] = calc_checksum(source, size);
+        sprintf(s, "|%02X", nvs[dest + size]);
+    }
+
+    mock_log("NVS", "%u %u %s", (unsigned)dest, (unsigned)size, hex);
+
+    return NVS_TransferResult_OK;
+}
+
+static nvs_transfer_result_t memcpy_from_nvs (uint8_t *dest, nvs_address_t source, uint32_t size, bool with_checksum)
+{
+    hal_call();
+
+    if(source + size + (with_checksum ? NVS_CRC_BYTES : 0) > NVS_SIZE)
+        return NVS_TransferResult_Failed;
+
+    memcpy(dest, &nvs[source], size);
+
+    return !with_checksum || calc_checksum(dest, size) == nvs[source + size] ? NVS_TransferResult_OK : NVS_TransferResult_Failed;
+}
+
+static uint8_t nvs_get_byte (uint32_t addr)
+{
+    hal_call();
+
+    return addr < NVS_SIZE ? nvs[addr] : 0xFF;
+}
+
+static void nvs_put_byte (uint32_t addr, uint8_t new_value)
+{
+    hal_call();
+
+    if(addr < NVS_SIZE)
+        nvs[addr] = new_value;
+}
+
+nvs_address_t nvs_alloc (size_t size)
+{
+    nvs_address_t addr = 0;
+
+    if(nvs_next + size + NVS_CRC_BYTES <= NVS_SIZE) {
+        addr = nvs_next;
+        nvs_next += size + NVS_CRC_BYTES;
+    }
+
+    return addr;
+}
+
+// Stream
+
+static int16_t stream_read (void)
+{
+    char c;
+
+    if(rx.tail == rx.head)
+        return SERIAL_NO_DATA;
+
+    c = rx.data[rx.tail];
+    rx.tail = (rx.tail + 1) % sizeof(rx.data);
+
+    return (int16_t)(uint8_t)c;
+}
+
+static bool stream_write_char (const char c)
+{
+    if(c == ASCII_LF) {
+        output.data[output.len] = '\0';
+        mock_log("OUT", "%s", output.data);
+        if(mock_on_output)
+            mock_on_output(output.data);
+        output.len = 0;
+    } else if(c != ASCII_CR && output.len < sizeof(output.data) - 1)
+        output.data[output.len++] = c;
+
+    return true;
+}
+
+static void stream_write_n (const char *s, uint16_t length)
+{
+    hal_call();
+
+    while(length--)
+        stream_write_char(*s++);
+}
+
+static void stream_write (const char *s)
+{
+    stream_write_n(s, (uint16_t)strlen(s));
+}
+
+static uint16_t stream_get_rx_buffer_free (void)
+{
+    return sizeof(rx.data) - 1 - (rx.head + sizeof(rx.data) - rx.tail) % sizeof(rx.data);
+}
+
+static bool stream_is_connected (void)
+{
+    return true;
+}
+
+bool stream_connected (void)
+{
+    return true;
+}
+
+bool stream_buffer_all (char c)
+{
+    return false;
+}
+
+bool stream_rx_suspend (stream_rx_buffer_t *rxbuffer, bool suspend)
+{
+    return false;
+}
+
+bool stream_connect (const io_stream_t *stream)
+{
+    memcpy(&hal.stream, stream, sizeof(io_stream_t));
+
+    if(grbl.on_stream_changed)
+        grbl.on_stream_changed(hal.stream.type);
+
+    return true;
+}
+
+void stream_disconnect (const io_stream_t *stream)
+{
+}
+
+void mock_stream_input (const char *data, size_t length)
+{
+    while(length--) {
+        rx.data[rx.head] = *data++;
+        rx.head = (rx.head + 1) % sizeof(rx.data);
+    }
+}
+
+// Reports
+
+void report_message (const char *msg, message_type_t type)
+{
+    hal.stream.write("[MSG:");
+    if(type == Message_Warning)
+        hal.stream.write("Warning: ");
+    hal.stream.write(msg);
+    hal.stream.write("]" ASCII_EOL);
+}
+
+void report_warning (void *message)
+{
+    report_message((const char *)message, Message_Warning);
+}
+
+void report_plugin (const char *name, const char *version)
+{
+    hal.stream.write("[PLUGIN:");
+    hal.stream.write(name);
+    hal.stream.write(" v");
+    hal.stream.write(version);
+    hal.stream.write("]" ASCII_EOL);
+}
+
+// Number formatting
+
+bool isintf (float value)
+{
+    return !isnan(value) && fabsf(value - truncf(value)) < 0.001f;
+}
+
+char *uitoa (uint32_t n)
+{
+    static char buf[12];
+
+    sprintf(buf, "%u", (unsigned)n);
+
+    return buf;
+}
+
+char *ftoa (float n, uint8_t decimal_places)
+{
+    static char buf[32];
+
+    snprintf(buf, sizeof(buf), "%.*f", decimal_places, n);
+
+    if(buf[0] == '-' && strspn(buf + 1, "0.") == strlen(buf + 1)) // no negative zero
+        memmove(buf, buf + 1, strlen(buf));
+
+    return buf;
+}
+
+// Settings and system commands
+
+void settings_register (setting_details_t *details)
+{
+    setting_details_t **last = &setting_details;
+
+    while(*last)
+        last = &(*last)->next;
+
+    *last = details;
+    details->next = NULL;
+}
+
+void settings_write_global (void)
+{
+}
+
+static void settings_changed (settings_t *settings, settings_changed_flags_t changed)
+{
+}
+
+// Default handlers, plugins chain to these without checking for NULL as with the core.
+
+static void execute_realtime (sys_state_t state)
+{
+}
+
+static void report_options (bool newopt)
+{
+}
+
+static void driver_reset (void)
+{
+}
+
+static status_code_t setting_set (setting_id_t id, char *value)
+{
+    uint_fast8_t idx;
+    uint_fast16_t offset;
+    char *end;
+    status_code_t status = Status_OK;
+    const setting_detail_t *setting;
+    setting_details_t *details;
+
+    for(details = setting_details; details; details = details->next) {
+
+        for(idx = 0; idx < details->n_settings; idx++) {
+
+            setting = &details->settings[idx];
+            offset = id - setting->id;
+
+            if(id < setting->id || offset > (setting->flags.increment ? 9 : 0))
+                continue;
+
+            if(setting->is_available && !((bool (*)(const setting_detail_t *, uint_fast16_t))setting->is_available)(setting, offset))
+                return Status_SettingDisabled;
+
+            if(setting->datatype == Format_Decimal) {
+
+                float v = strtof(value, &end);
+
+                if(end == value || *end)
+                    return Status_BadNumberFormat;
+
+                if(setting->type == Setting_NonCoreFn)
+                    status = ((status_code_t (*)(setting_id_t, float))setting->value)(id, v);
+                else
+                    *(float *)setting->value = v;
+
+            } else {
+
+                uint32_t v = strtoul(value, &end, 10);
+
+                if(end == value || *end)
+                    return Status_BadNumberFormat;
+
+                if(setting->type == Setting_NonCoreFn)
+                    status = ((status_code_t (*)(setting_id_t, uint_fast16_t))setting->value)(id, (uint_fast16_t)v);
+                else switch(setting->datatype) {
+
+                    case Format_Int16:
+                        *(uint16_t *)setting->value = (uint16_t)v;
+                        break;
+
+                    case Format_Integer:
+                        *(uint32_t *)setting->value = v;
+                        break;
+
+                    default:
+                        *(uint8_t *)setting->value = (uint8_t)v;
+                        break;
+                }
+            }
+
+            if(status == Status_OK) {
+                if(details->save)
+                    details->save();
+                if(details->on_changed)
+                    details->on_changed(&settings, (settings_changed_flags_t){0});
+            }
+
+            return status;
+        }
+    }
+
+    return Status_InvalidStatement;
+}
+
+void system_register_commands (sys_commands_t *list)
+{
+    sys_commands_t **last = &commands;
+
+    while(*last)
+        last = &(*last)->next;
+
+    *last = list;
+    list->next = NULL;
+}
+
+// Executes a $ command or setting, "$X" clears an alarm.
+status_code_t mock_command (char *line)
+{
+    uint_fast8_t idx;
+    char *args = strchr(line, '=');
+    sys_commands_t *list;
+
+    if(*line++ != '$')
+        return Status_InvalidStatement;
+
+    if(args)
+        *args++ = '\0';
+
+    if(isdigit((unsigned char)*line))
+        return mock.status = args ? setting_set((setting_id_t)atoi(line), args) : Status_InvalidStatement;
+
+    if(!strcasecmp(line, "X")) {
+        if(mock.state == STATE_ALARM)
+            mock_set_state(STATE_IDLE);
+        return mock.status = Status_OK;
+    }
+
+    for(list = commands; list; list = list->next) {
+        for(idx = 0; idx < list->n_commands; idx++) {
+            if(!strcasecmp(line, list->commands[idx].command))
+                return mock.status = list->commands[idx].execute(mock.state, args);
+        }
+    }
+
+    return mock.status = Status_InvalidStatement;
+}
+
+// G-code
+
+bool protocol_enqueue_gcode (char *data)
+{
+    bool ok = queued_gcode[0] == '\0' && (mock.state == STATE_IDLE || (mock.state & (STATE_ALARM|STATE_JOG|STATE_TOOL_CHANGE)));
+
+    if(ok)
+        strncpy(queued_gcode, data, sizeof(queued_gcode) - 1);
+
+    return ok;
+}
+
+static void set_word (parser_block_t *block, char letter, float value)
+{
+    ((uint32_t *)&block->words)[letter - 'A'] = 1;
+
+    switch(letter) {
+        case 'A': block->values.a = value; break;
+        case 'B': block->values.b = value; break;
+        case 'C': block->values.c = value; break;
+        case 'D': block->values.d = value; break;
+        case 'E': block->values.e = value; break;
+        case 'F': block->values.f = value; break;
+        case 'H': block->values.h = value; break;
+        case 'I': block->values.ijk[0] = value; break;
+        case 'J': block->values.ijk[1] = value; break;
+        case 'K': block->values.ijk[2] = value; break;
+        case 'P': block->values.p = value; break;
+        case 'Q': block->values.q = value; break;
+        case 'R': block->values.r = value; break;
+        case 'S': block->values.s = value; break;
+        case 'T': block->values.t = value; break;
+        case 'U': block->values.u = value; break;
+        case 'V': block->values.v = value; break;
+        case 'W': block->values.w = value; break;
+        case 'X': block->values.xyz[X_AXIS] = block->values.x = value; break;
+        case 'Y': block->values.xyz[Y_AXIS] = block->values.y = value; break;
+        case 'Z': block->values.xyz[Z_AXIS] = block->values.z = value; break;
+        default: break;
+    }
+}
+
+static status_code_t probe_cycle (float *target, float rate)
+{
+    uint_fast8_t idx;
+    axes_signals_t axes = { .z = On };
+    plan_line_data_t pl_data = { .feed_rate = rate };
+    bool contact;
+
+    if(rate <= 0.0f)
+        return Status_GcodeValueWordMissing;
+
+    core_synchronize();
+
+    if(grbl.on_probe_start && !grbl.on_probe_start(axes, target, &pl_data))
+        return Status_InvalidStatement;
+
+    contact = mock_machine.probe_contact && mock_machine.probe_z <= planner.position[Z_AXIS] && mock_machine.probe_z >= target[Z_AXIS];
+
+    if(contact)
+        target[Z_AXIS] = mock_machine.probe_z;
+
+    plan_line(target, rate, false);
+    core_synchronize();
+
+    sys.flags.probe_succeeded = contact;
+    for(idx = 0; idx < N_AXIS; idx++)
+        sys.probe_position[idx] = lroundf(target[idx] * MOCK_STEPS_PER_MM);
+
+    mock_log("PROBE", "%s", contact ? "contact" : "failed");
+
+    if(!contact)
+        mock_set_state(STATE_ALARM);
+
+    if(grbl.on_probe_completed)
+        grbl.on_probe_completed();
+
+    return Status_OK;
+}
+
+#define SWAP_WORDS(a, b) { word_flags_t t = a; a = b; b = t; }
+
+static status_code_t execute_block (char *line)
+{
+    uint_fast8_t idx, n_g = 0, n_m = 0;
+    uint32_t m[4], user_mcode = 0;
+    float g[4], value, target[N_AXIS];
+    bool axis_words = false, novalue = false, dwell = false, probe = false, program_end = false, spindle_mcode = false, coolant_mcode = false;
+    char *s = line, *end, letter;
+    status_code_t status = Status_OK;
+    user_mcode_type_t mcode_type = UserMCode_Unsupported;
+    parser_block_t block;
+    word_flags_t user_words;
+    spindle_state_t spindle_state = {0};
+    coolant_state_t coolant_state = coolant;
+
+    memset(&block, 0, sizeof(parser_block_t));
+
+    mock_log(">", "%s", line);
+
+    if(mock.state & (STATE_ALARM|STATE_ESTOP))
+        return Status_SystemGClock;
+
+    while(*s) {
+
+        letter = toupper((unsigned char)*s++);
+
+        if(letter == ' ')
+            continue;
+
+        if(letter == '(') {
+            while(*s && *s++ != ')');
+            continue;
+        }
+
+        if(letter == ';')
+            break;
+
+        if(letter < 'A' || letter > 'Z')
+            return Status_ExpectedCommandLetter;
+
+        value = strtof(s, &end);
+        if(end == s) {
+            value = NAN;    // allowed for user M-codes with parameter words without value
+            novalue = true;
+        }
+        s = end;
+
+        switch(letter) {
+
+            case 'G':
+                if(n_g == 4)
+                    return Status_InvalidStatement;
+                g[n_g++] = value;
+                break;
+
+            case 'M':
+                if(n_m == 4)
+                    return Status_InvalidStatement;
+                m[n_m++] = (uint32_t)value;
+                break;
+
+            case 'N':
+                break;
+
+            default:
+                set_word(&block, letter, value);
+                axis_words |= letter >= 'X';
+                break;
+        }
+    }
+
+    for(idx = 0; idx < n_g; idx++) {
+        switch((int)lroundf(g[idx] * 10.0f)) {
+            case 0: gc_state.modal.motion = MotionMode_Seek; break;
+            case 10: gc_state.modal.motion = MotionMode_Linear; break;
+            case 40: dwell = true; break;
+            case 200: gc_state.modal.units_imperial = true; break;
+            case 210: gc_state.modal.units_imperial = false; break;
+            case 382: probe = true; break;
+            case 530: break; // no work offsets
+            case 800: gc_state.modal.motion = MotionMode_None; break;
+            case 900: gc_state.modal.distance_incremental = false; break;
+            case 910: gc_state.modal.distance_incremental = true; break;
+            default: return Status_GcodeUnsupportedCommand;
+        }
+    }
+
+    for(idx = 0; idx < n_m; idx++) {
+        switch(m[idx]) {
+
+            case 2:
+            case 30:
+                program_end = true;
+                break;
+
+            case 3:
+            case 4:
+            case 5:
+                spindle_mcode = true;
+                spindle_state.on = m[idx] != 5;
+                spindle_state.ccw = m[idx] == 4;
+                break;
+
+            case 7:
+                coolant_mcode = true;
+                coolant_state.mist = On;
+                break;
+
+            case 8:
+                coolant_mcode = true;
+                coolant_state.flood = On;
+                break;
+
+            case 9:
+                coolant_mcode = true;
+                coolant_state.value = 0;
+                break;
+
+            default:
+                if(user_mcode)
+                    return Status_InvalidStatement;
+                if(grbl.user_mcode.check == NULL || (mcode_type = grbl.user_mcode.check((user_mcode_t)m[idx])) == UserMCode_Unsupported)
+                    return Status_GcodeUnsupportedCommand;
+                user_mcode = m[idx];
+                break;
+        }
+    }
+
+    if(novalue && mcode_type != UserMCode_NoValueWords)
+        return Status_BadNumberFormat;
+
+    // Validate before executing anything.
+
+    if(user_mcode) {
+        user_words = block.words;
+        block.user_mcode = (user_mcode_t)user_mcode;
+        if(grbl.user_mcode.validate && (status = grbl.user_mcode.validate(&block)) != Status_OK)
+            return status;
+        // As the core, execute with the words taken, cleared, by validation.
+        for(idx = 0; idx < 26; idx++)
+            ((uint32_t *)&user_words)[idx] = ((uint32_t *)&user_words)[idx] && !((uint32_t *)&block.words)[idx];
+    }
+
+    if(block.words.f) {
+        gc_state.feed_rate = gc_state.modal.units_imperial ? block.values.f * MM_PER_INCH : block.values.f;
+        block.words.f = Off;
+    }
+
+    if(spindle_mcode) {
+        core_synchronize();
+        mock_log("SPINDLE", "%u %.0f", spindle_state.on, block.words.s ? block.values.s : 0.0f);
+        if(grbl.on_spindle_programmed)
+            grbl.on_spindle_programmed(&spindle, spindle_state, block.words.s ? block.values.s : 0.0f, 0);
+    }
+
+    if(coolant_mcode) {
+        core_synchronize();
+        hal.coolant.set_state(coolant_state);
+    }
+
+    if(user_mcode) {
+        if(!mcode_synchronize(user_mcode))
+            return Status_Reset;
+        mock.mcode = user_mcode;
+        SWAP_WORDS(block.words, user_words);
+        grbl.user_mcode.execute(mock.state, &block);
+        SWAP_WORDS(block.words, user_words);
+    }
+
+    if(dwell) {
+        core_synchronize();
+        delay_sec(block.values.p, DelayMode_Dwell);
+    }
+
+    if(axis_words) {
+
+        memcpy(target, planner.position, sizeof(target));
+
+        for(idx = 0; idx < N_AXIS; idx++) {
+            if(((uint32_t *)&block.words)['X' - 'A' + idx]) {
+                value = block.values.xyz[idx] * (gc_state.modal.units_imperial ? MM_PER_INCH : 1.0f);
+                target[idx] = gc_state.modal.distance_incremental ? target[idx] + value : value;
+            }
+        }
+
+        if(probe) {
+            gc_state.modal.motion = MotionMode_ProbeToward;
+            status = probe_cycle(target, gc_state.feed_rate);
+        } else switch(gc_state.modal.motion) {
+
+            case MotionMode_Seek:
+                plan_line(target, mock_machine.rapid_rate, true);
+                break;
+
+            case MotionMode_Linear:
+                if(gc_state.feed_rate <= 0.0f)
+                    return Status_GcodeValueWordMissing;
+                plan_line(target, gc_state.feed_rate, false);
+                break;
+
+            default:
+                return Status_GcodeUnsupportedCommand;
+        }
+    }
+
+    if(program_end) {
+        core_synchronize();
+        if(grbl.on_program_completed)
+            grbl.on_program_completed(ProgramFlow_CompletedM30, false);
+    }
+
+    return status;
+}
+
+static status_code_t execute_line (char *line)
+{
+    status_code_t status;
+
+    executing = true;
+    status = execute_block(line);
+    executing = false;
+
+    if(status != Status_OK)
+        mock_log("ERROR", "%u", status);
+
+    return mock.status = status;
+}
+
+// Reads and executes the lines available from the input stream.
+static status_code_t protocol_read (void)
+{
+    int16_t c;
+    status_code_t status = Status_OK;
+
+    while((c = hal.stream.read()) != SERIAL_NO_DATA) {
+        if(c == ASCII_CR || c == ASCII_LF) {
+            if(input.len) {
+                input.line[input.len] = '\0';
+                input.len = 0;
+                status = execute_line(input.line);
+            }
+        } else if(input.len < sizeof(input.line) - 1)
+            input.line[input.len++] = (char)c;
+    }
+
+    return status;
+}
+
+status_code_t mock_gcode (const char *line)
+{
+    mock_stream_input(line, strlen(line));
+    mock_stream_input("\n", 1);
+
+    return protocol_read();
+}
+
+// Simulation
+
+// One ms: motion, tasks, queued G-code and the realtime handler.
+static void tick (void)
+{
+    char line[sizeof(queued_gcode)];
+
+    mock.ms++;
+
+    planner_step();
+    run_tasks();
+
+    if(!executing && queued_gcode[0]) {
+        strcpy(line, queued_gcode);
+        queued_gcode[0] = '\0';
+        execute_line(line);
+    }
+
+    if(grbl.on_execute_realtime)
+        grbl.on_execute_realtime(mock.state);
+}
+
+void mock_run (uint32_t ms)
+{
+    while(ms--)
+        tick();
+
+    protocol_read();
+}
+
+// Runs until the planner is empty and no G-code is queued.
+void mock_sync (void)
+{
+    do {
+        tick();
+    } while(planner.count && !(mock.state & (STATE_HOLD|STATE_ALARM|STATE_ESTOP)));
+
+    while(queued_gcode[0])
+        mock_run(1);
+}
+
+void mock_init (void)
+{
+    uint_fast8_t idx;
+
+    memset(&hal, 0, sizeof(grbl_hal_t));
+    memset(&grbl, 0, sizeof(grbl_t));
+    memset(&sys, 0, sizeof(system_t));
+    memset(&gc_state, 0, sizeof(parser_state_t));
+    memset(&planner, 0, sizeof(planner));
+    memset(&tasks, 0, sizeof(tasks));
+    memset(nvs, 0xFF, sizeof(nvs));
+
+    mock.ms = 0;
+    mock.state = STATE_IDLE;
+
+    hal.get_elapsed_ticks = get_elapsed_ticks;
+    hal.get_micros = get_micros;
+    hal.irq_enable = irq_enable;
+    hal.irq_disable = irq_disable;
+    hal.delay_ms = delay_ms;
+    hal.f_step_timer = 1000000;
+
+    hal.port.digital_out = digital_out;
+    hal.port.analog_out = analog_out;
+    hal.port.get_pin_info = get_pin_info;
+    hal.port.set_pin_description = set_pin_description;
+
+    for(idx = 0; idx < MOCK_AOUT_PORTS; idx++) {
+        aout[idx].pin.port = idx;
+        aout[idx].pin.cap.pwm = aout[idx].pin.cap.claimable = aout[idx].pin.cap.output = On;
+        aout[idx].pin.cap.servo_pwm = idx == 0;
+        aout[idx].pin.get_value = pin_get_value;
+        aout[idx].pin.config = pin_config;
+    }
+
+    hal.nvs.memcpy_to_nvs = memcpy_to_nvs;
+    hal.nvs.memcpy_from_nvs = memcpy_from_nvs;
+    hal.nvs.get_byte = nvs_get_byte;
+    hal.nvs.put_byte = nvs_put_byte;
+
+    hal.coolant.set_state = coolant_set_state;
+    hal.coolant.get_state = coolant_get_state;
+
+    hal.stream.type = StreamType_Serial;
+    hal.stream.is_connected = stream_is_connected;
+    hal.stream.read = stream_read;
+    hal.stream.write = stream_write;
+    hal.stream.write_n = stream_write_n;
+    hal.stream.write_char = stream_write_char;
+    hal.stream.get_rx_buffer_free = stream_get_rx_buffer_free;
+
+    hal.rgb0.out = rgb_out;
+    hal.rgb0.write = rgb_write;
+    hal.rgb0.num_devices = mock_machine.rgb_devices;
+    hal.rgb0.flags.is_strip = On;
+
+    hal.settings_changed = settings_changed;
+    hal.driver_reset = driver_reset;
+
+    grbl.on_execute_realtime = grbl.on_execute_delay = execute_realtime;
+    grbl.on_report_options = report_options;
+
+    sys.override.feed_rate = DEFAULT_FEED_OVERRIDE;
+    sys.override.rapid_rate = DEFAULT_RAPID_OVERRIDE;
+
+    for(idx = 0; idx < N_AXIS; idx++)
+        settings.axis[idx].steps_per_mm = MOCK_STEPS_PER_MM;
+
+    gc_state.modal.motion = MotionMode_Seek;
+}
+
+bool mock_plugin_init (const char *name)
+{
+    const mock_plugin_t *plugin;
+
+    for(plugin = plugins; plugin->name; plugin++) {
+        if(!strcmp(plugin->name, name)) {
+            plugin->init();
+            return true;
+        }
+    }
+
+    return false;
+}
+
+// Loads the settings of the registered plugins as the core does after plugin init.
+void mock_boot (void)
+{
+    setting_details_t *details;
+
+    for(details = setting_details; details; details = details->next) {
+        if(details->load)
+            details->load();
+    }
+}
+
+/*
+  Handles a configuration line, returns false if not recognized or invalid.
+
+    plugins <name> ...      initialize the named plugins and load their settings
+    acceleration <mm/s^2>
+    rapids <mm/min>
+    rgb <number of LEDs>    must be set before plugins are initialized
+    probe <z>|none          probe contact height
+    $<setting>=<value>
+*/
+bool mock_configure (char *line)
+{
+    bool ok = true;
+    char *name, *arg;
+
+    if(*line == '$')
+        return mock_command(line) == Status_OK;
+
+    if((name = strtok(line, " \t")) == NULL)
+        return false;
+
+    arg = strtok(NULL, " \t");
+
+    if(!strcmp(name, "plugins")) {
+        for(; ok && arg; arg = strtok(NULL, " \t"))
+            ok = mock_plugin_init(arg);
+        if(ok)
+            mock_boot();
+    } else if(arg == NULL)
+        ok = false;
+    else if(!strcmp(name, "acceleration"))
+        ok = (mock_machine.acceleration = strtof(arg, NULL)) > 0.0f;
+    else if(!strcmp(name, "rapids"))
+        ok = (mock_machine.rapid_rate = strtof(arg, NULL)) > 0.0f;
+    else if(!strcmp(name, "rgb"))
+        hal.rgb0.num_devices = mock_machine.rgb_devices = (uint16_t)atoi(arg);
+    else if(!strcmp(name, "probe")) {
+        if((mock_machine.probe_contact = strcmp(arg, "none") != 0))
+            mock_machine.probe_z = strtof(arg, NULL);
+    } else
+        ok = false;
+
+    return ok;
+}
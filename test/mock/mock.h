@@ -0,0 +1,95 @@
+/*
+
+  mock.h - simulated grblHAL core and HAL for host testing the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  The mock runs plugin code unmodified against a simulated millisecond clock. Tasks, the planner and
+  the realtime handler are run once per simulated ms, blocking delays advance the clock. G-code is fed
+  through hal.stream.read() one line at a time and executed by a minimal parser that handles motion,
+  dwell, units, distance mode, feed rate, spindle and coolant M-codes and user M-codes via the
+  grbl.user_mcode chain. Planner time is estimated with a simple lookahead planner, see mock.c.
+
+  HAL calls made by the plugins can be logged with a timestamp, one line per call:
+
+    <ms> DOUT <port> <0|1>
+    <ms> AOUT <port> <value>
+    <ms> NVS <address> <size> <hex bytes>[|<checksum>]
+    <ms> RGB <device> <RRGGBBWW>
+    <ms> COOLANT <flood><mist>
+    <ms> SPINDLE <0|1> <rpm>
+    <ms> OVERRIDE <feed> <rapid>
+    <ms> DELAY <ms>
+    <ms> PROBE <contact|failed>
+    <ms> STATE <state>
+    <ms> OUT <stream output>
+    <ms> > <G-code block>
+    <ms> ERROR <status code>
+
+  Each call to a HAL function also adds MOCK_CALL_US to the microsecond counter returned by hal.get_micros()
+  so that the profiler hook timing is a deterministic estimate of the work done in the hooks.
+
+*/
+
+#ifndef _MOCK_H_
+#define _MOCK_H_
+
+#include <stdio.h>
+
+#include "grbl/hal.h"
+
+#define MOCK_DOUT_PORTS 4
+#define MOCK_AOUT_PORTS 3   // port 0 has servo PWM capability, ports 1 and 2 are plain PWM
+#define MOCK_PLANNER_SIZE 16
+#define MOCK_NVS_FIRST 1024 // first address returned by nvs_alloc()
+#define MOCK_CALL_US 1      // us added to the microsecond counter per HAL call
+#define MOCK_STEPS_PER_MM 1000.0f
+
+typedef struct {
+    const char *name;
+    void (*init)(void);
+} mock_plugin_t;
+
+typedef struct {
+    float acceleration;     // mm/s^2
+    float rapid_rate;       // mm/min
+    float probe_z;          // probe contact height, probing fails if below the target
+    bool probe_contact;
+    uint16_t rgb_devices;   // number of LEDs on strip 0
+} mock_machine_t;
+
+typedef struct {
+    uint32_t ms;            // simulated time
+    sys_state_t state;
+    status_code_t status;   // status of the last G-code block or command
+    uint32_t mcode;         // last user M-code executed
+    uint32_t blocks;        // motion blocks executed
+    uint32_t syncs;         // planner syncs for user M-codes
+    float position[N_AXIS]; // executed position
+    FILE *log;              // HAL call log, NULL to disable
+} mock_status_t;
+
+extern mock_machine_t mock_machine;
+extern mock_status_t mock;
+
+// Called with the estimated time in ms lost decelerating to a stop for a user M-code sync and
+// accelerating again for the first block planned after it.
+extern void (*mock_on_stop_loss)(uint32_t mcode, float ms);
+// Called for each line written to the stream, without line terminator.
+extern void (*mock_on_output)(const char *line);
+
+void mock_init (void);
+bool mock_plugin_init (const char *name);
+void mock_boot (void);
+bool mock_configure (char *line);
+status_code_t mock_command (char *line);
+status_code_t mock_gcode (const char *line);
+void mock_stream_input (const char *data, size_t length);
+void mock_set_state (sys_state_t state);
+void mock_run (uint32_t ms);
+void mock_sync (void);
+void mock_log (const char *kind, const char *format, ...);
+
+#endif // _MOCK_H_
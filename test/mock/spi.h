@@ -0,0 +1,5 @@
+#include <stdint.h>
+
+void spi_init (void);
+uint8_t spi_put_byte (uint8_t byte);
+uint8_t spi_get_byte (void);
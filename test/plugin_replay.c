@@ -0,0 +1,195 @@
+/*
+
+  plugin_replay.c - replays an input trace against the misc. plugins and logs the resulting HAL calls
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Usage: plugin_replay <trace>
+
+  The trace has one item per line, lines starting with # are comments:
+
+    plugins <name> ...      initialize the plugins
+    acceleration, rapids, rgb, probe <z>|none
+                            machine configuration, see mock_configure() in mock/mock.c
+    boot                    run the deferred startup tasks and start the HAL call trace ($PLUGINTRACE=R),
+                            done before the first item that is not configuration if not given
+    $<command or setting>   e.g. $760=1 or $PLUGINSTALLS, settings before boot are configuration
+    wait <ms>               run the simulation for the given time
+    sync                    run until the planner is empty
+    state <idle|cycle|hold|alarm>
+                            change the controller state
+    stream <bytes>          raw stream input, \r, \n, \\ and \xNN escapes are recognized
+    <G-code block>
+
+  The HAL call log, see mock/mock.h, is written to stdout followed by the output of $PLUGINTRACE, $PLUGINTRACE=D,
+  $PLUGINSTALLS and $PLUGINPROF. The tests compare it with the golden files in replay/, simulated time and the
+  tick counts are deterministic so any change in the port, NVS or stream I/O or in the work done in the hooks shows up.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock/mock.h"
+
+#define BOOT_MS 1000 // settle time for deferred startup tasks
+
+static bool booted = false;
+
+static const struct {
+    const char *name;
+    sys_state_t state;
+} states[] = {
+    { "idle", STATE_IDLE },
+    { "cycle", STATE_CYCLE },
+    { "hold", STATE_HOLD },
+    { "alarm", STATE_ALARM }
+};
+
+static char *read_line (char *line, int size, FILE *file)
+{
+    char *s;
+
+    if((s = fgets(line, size, file)))
+        line[strcspn(line, "\r\n")] = '\0';
+
+    return s;
+}
+
+// Unescapes data in place, returns the length.
+static size_t unescape (char *data)
+{
+    char *s = data, *d = data, hex[3] = {0};
+
+    while(*s) {
+        if(*s == '\\' && s[1]) {
+            switch(*++s) {
+                case 'r': *d++ = ASCII_CR; break;
+                case 'n': *d++ = ASCII_LF; break;
+                case 'x':
+                    if(s[1] && s[2]) {
+                        hex[0] = *++s;
+                        hex[1] = *++s;
+                        *d++ = (char)strtoul(hex, NULL, 16);
+                    }
+                    break;
+                default: *d++ = *s; break;
+            }
+            s++;
+        } else
+            *d++ = *s++;
+    }
+
+    return (size_t)(d - data);
+}
+
+static bool set_state (const char *name)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < sizeof(states) / sizeof(states[0]); idx++) {
+        if(!strcmp(states[idx].name, name)) {
+            mock_set_state(states[idx].state);
+            return true;
+        }
+    }
+
+    return false;
+}
+
+static void command (const char *line)
+{
+    char buf[64];
+
+    strncpy(buf, line, sizeof(buf) - 1);
+    buf[sizeof(buf) - 1] = '\0';
+    mock_log(">", "%s", buf);
+
+    if(mock_command(buf) != Status_OK)
+        mock_log("ERROR", "%u", mock.status);
+}
+
+static void boot (void)
+{
+    booted = true;
+    mock_run(BOOT_MS);
+    command("$PLUGINTRACE=R");
+}
+
+static bool replay (char *line)
+{
+    bool ok = true;
+
+    if(!strncmp(line, "plugins ", 8) || !strncmp(line, "acceleration ", 13) || !strncmp(line, "rapids ", 7) ||
+         !strncmp(line, "rgb ", 4) || !strncmp(line, "probe ", 6))
+        return mock_configure(line);
+
+    if(!strcmp(line, "boot")) {
+        if((ok = !booted))
+            boot();
+        return ok;
+    }
+
+    if(!booted && *line != '$')
+        boot();
+
+    if(*line == '$')
+        command(line);
+    else if(!strncmp(line, "wait ", 5))
+        mock_run((uint32_t)atoi(line + 5));
+    else if(!strcmp(line, "sync"))
+        mock_sync();
+    else if(!strncmp(line, "state ", 6))
+        ok = set_state(line + 6);
+    else if(!strncmp(line, "stream ", 7)) {
+        mock_stream_input(line + 7, unescape(line + 7));
+        mock_run(0);
+    } else
+        mock_gcode(line);
+
+    return ok;
+}
+
+int main (int argc, char **argv)
+{
+    char line[256];
+    uint32_t n = 0;
+    FILE *trace;
+
+    if(argc != 2) {
+        fprintf(stderr, "Usage: %s <trace>\n", argv[0]);
+        return 2;
+    }
+
+    if((trace = fopen(argv[1], "r")) == NULL) {
+        perror("plugin_replay");
+        return 2;
+    }
+
+    mock_init();
+    mock.log = stdout;
+
+    while(read_line(line, sizeof(line), trace)) {
+        n++;
+        if(*line && *line != '#' && !replay(line)) {
+            fprintf(stderr, "%s:%u: invalid trace item\n", argv[1], (unsigned)n);
+            return 2;
+        }
+    }
+
+    fclose(trace);
+
+    if(!booted)
+        boot();
+
+    mock_sync();
+
+    command("$PLUGINTRACE");
+    command("$PLUGINTRACE=D");
+    command("$PLUGINSTALLS");
+    command("$PLUGINPROF");
+
+    return 0;
+}
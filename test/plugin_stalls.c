@@ -0,0 +1,182 @@
+/*
+
+  plugin_stalls.c - offline analyser for protocol loop stalls caused by the misc. plugins
+
+  Part of grblHAL misc. plugins
+
+  Public domain.
+
+  Usage: plugin_stalls <configuration> <G-code program>
+
+  Runs the program through the plugin code against the simulated core in mock/ and reports the time lost
+  per plugin. The configuration has one item per line, see mock_configure() in mock/mock.c, e.g.:
+
+    plugins bltouch pwm_servo rgb_led feed_override eventout
+    acceleration 500
+    rapids 5000
+    $750=4
+
+  The $PLUGINSTALLS report from the profiler is output as is, it has the number of and time spent in
+  planner syncs and blocking delays per plugin. Sync time is the time waited for the planner to empty
+  which is mostly motion that has to be executed anyway, the time lost is estimated as the time to
+  decelerate to a stop and to accelerate back to speed compared to passing through at speed.
+  Time lost per plugin is the sum of that and the blocking delays.
+
+*/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "mock/mock.h"
+
+#define BOOT_MS 1000 // settle time for deferred startup tasks before the program is run
+
+typedef struct {
+    const char *name;   // as reported by $PLUGINSTALLS
+    uint32_t mcode[2];
+    uint32_t syncs;
+    uint32_t sync_ms;
+    uint32_t delays;
+    uint32_t delay_ms;
+    float stop_ms;
+} plugin_time_t;
+
+static plugin_time_t plugin[] = {
+    { "BLTouch", { Probe_Deploy, Probe_Stow } },
+    { "Feed override", { SetFeedOverrides } },
+    { "PWM servo", { PWMServo_SetPosition } },
+    { "RGB LED", { RGB_WriteLEDs } }
+};
+
+#define N_PLUGINS (sizeof(plugin) / sizeof(plugin_time_t))
+
+static uint32_t outputs = 0;
+static digital_out_ptr digital_out;
+
+static void onStopLoss (uint32_t mcode, float ms)
+{
+    uint_fast8_t idx;
+
+    for(idx = 0; idx < N_PLUGINS; idx++) {
+        if(plugin[idx].mcode[0] == mcode || plugin[idx].mcode[1] == mcode)
+            plugin[idx].stop_ms += ms;
+    }
+}
+
+static void onOutput (const char *line)
+{
+    uint_fast8_t idx;
+    char name[32];
+    unsigned syncs, sync_ms, delays, delay_ms;
+
+    puts(line);
+
+    if(sscanf(line, "[STALL:%31[^|]|SYNC:%u,%u|DELAY:%u,%u|", name, &syncs, &sync_ms, &delays, &delay_ms) == 5) {
+        for(idx = 0; idx < N_PLUGINS; idx++) {
+            if(!strcmp(plugin[idx].name, name)) {
+                plugin[idx].syncs = syncs;
+                plugin[idx].sync_ms = sync_ms;
+                plugin[idx].delays = delays;
+                plugin[idx].delay_ms = delay_ms;
+            }
+        }
+    }
+}
+
+// Output changes are made by the event plugin only.
+static void countOutput (uint8_t port, bool on)
+{
+    outputs++;
+    digital_out(port, on);
+}
+
+static uint32_t lost_ms (const plugin_time_t *p)
+{
+    return p->delay_ms + (uint32_t)lroundf(p->stop_ms);
+}
+
+static int by_lost (const void *a, const void *b)
+{
+    uint32_t la = lost_ms((const plugin_time_t *)a), lb = lost_ms((const plugin_time_t *)b);
+
+    return la == lb ? strcmp(((const plugin_time_t *)a)->name, ((const plugin_time_t *)b)->name) : (la < lb ? 1 : -1);
+}
+
+static char *read_line (char *line, int size, FILE *file)
+{
+    char *s;
+
+    if((s = fgets(line, size, file)))
+        line[strcspn(line, "\r\n")] = '\0';
+
+    return s;
+}
+
+int main (int argc, char **argv)
+{
+    char line[256], command[] = "$PLUGINSTALLS", reset[] = "$PLUGINSTALLS=R";
+    uint_fast8_t idx;
+    uint32_t n = 0, start, errors = 0;
+    FILE *config, *program;
+
+    if(argc != 3) {
+        fprintf(stderr, "Usage: %s <configuration> <G-code program>\n", argv[0]);
+        return 2;
+    }
+
+    if((config = fopen(argv[1], "r")) == NULL || (program = fopen(argv[2], "r")) == NULL) {
+        perror("plugin_stalls");
+        return 2;
+    }
+
+    mock_init();
+
+    while(read_line(line, sizeof(line), config)) {
+        n++;
+        if(*line && *line != '#' && !mock_configure(line)) {
+            fprintf(stderr, "%s:%u: invalid configuration\n", argv[1], (unsigned)n);
+            return 2;
+        }
+    }
+
+    fclose(config);
+
+    mock_run(BOOT_MS);
+    mock_command(reset);
+
+    mock_on_stop_loss = onStopLoss;
+    digital_out = hal.port.digital_out;
+    hal.port.digital_out = countOutput;
+    start = mock.ms;
+    n = 0;
+
+    while(read_line(line, sizeof(line), program)) {
+        n++;
+        if(*line && mock_gcode(line) != Status_OK) {
+            fprintf(stderr, "%s:%u: error:%u\n", argv[2], (unsigned)n, mock.status);
+            errors++;
+        }
+    }
+
+    fclose(program);
+
+    mock_sync();
+
+    printf("Program time: %u ms, %u motion blocks, %u M-code syncs\n", (unsigned)(mock.ms - start), (unsigned)mock.blocks, (unsigned)mock.syncs);
+
+    mock_on_output = onOutput;
+    mock_command(command);
+    mock_on_output = NULL;
+
+    qsort(plugin, N_PLUGINS, sizeof(plugin_time_t), by_lost);
+
+    printf("\n%-14s %6s %8s %8s %7s %9s %8s\n", "Plugin", "Syncs", "Wait ms", "Stop ms", "Delays", "Delay ms", "Lost ms");
+
+    for(idx = 0; idx < N_PLUGINS; idx++)
+        printf("%-14s %6u %8u %8.0f %7u %9u %8u\n", plugin[idx].name, (unsigned)plugin[idx].syncs, (unsigned)plugin[idx].sync_ms,
+                plugin[idx].stop_ms, (unsigned)plugin[idx].delays, (unsigned)plugin[idx].delay_ms, (unsigned)lost_ms(&plugin[idx]));
+
+    printf("\nEvent outputs switched: %u\n", (unsigned)outputs);
+
+    return errors ? 1 : 0;
+}
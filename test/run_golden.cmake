@@ -0,0 +1,32 @@
+# run_golden.cmake - runs a host test program and compares its output with an expected output file.
+#
+# Invoked by the tests added with misc_plugins_golden_test(), see CMakeLists.txt.
+#
+#  COMMAND  - program and arguments, ; separated.
+#  EXPECTED - expected output file.
+#  OUTPUT   - file the actual output is saved to.
+#  UPDATE   - ON to rewrite the expected output file instead of comparing.
+
+execute_process(COMMAND ${COMMAND} OUTPUT_VARIABLE output ERROR_VARIABLE errors RESULT_VARIABLE result)
+
+file(WRITE "${OUTPUT}" "${output}")
+
+if(NOT result EQUAL 0)
+    message(FATAL_ERROR "Test program failed (${result}):\n${errors}")
+endif()
+
+if(UPDATE)
+    file(WRITE "${EXPECTED}" "${output}")
+    message(STATUS "Updated ${EXPECTED}")
+    return()
+endif()
+
+file(READ "${EXPECTED}" expected)
+
+if(NOT output STREQUAL expected)
+    find_program(DIFF_TOOL diff)
+    if(DIFF_TOOL)
+        execute_process(COMMAND ${DIFF_TOOL} -u "${EXPECTED}" "${OUTPUT}" OUTPUT_VARIABLE diff)
+    endif()
+    message(FATAL_ERROR "Output differs from ${EXPECTED}, actual output is in ${OUTPUT}\n${diff}")
+endif()
@@ -0,0 +1,30 @@
+(sample job: probe, then mill a pocket with status LEDs, a servo driven dust shoe and a feed override)
+G21G90
+M150 U255 P128
+G0 X10 Y10
+M401
+G38.2 Z-10 F200
+M402
+G0 Z5
+M280 P0 S90
+M3 S12000
+G0 X0 Y0
+G1 Z-1 F300
+G1 X40 F1200
+G1 Y40
+M8
+G1 X0
+G1 Y0
+M220 S150
+G1 X40
+G1 Y40
+M220 R
+G1 X0
+G1 Y0
+M9
+M150 R255 U255 P255
+G0 Z5
+M5
+M280 P0 S0
+M150 U255 P128
+M30